@@ -0,0 +1,427 @@
+/*
+SAL program analysis
+
+Copyright © 2025-2026 Reuben Thomas <rrt@sc3d.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+package main
+
+import (
+	"strings"
+)
+
+// Walk a syntax tree in pre-order, calling visit on each node. If visit
+// returns false, the node's children are skipped. Files named by `use`
+// are walked as part of the statement that uses them.
+func walk(node any, visit func(node any) bool) {
+	if !visit(node) {
+		return
+	}
+	switch n := node.(type) {
+	case *Body:
+		if n.Statements != nil {
+			for i := range *n.Statements {
+				walk(&(*n.Statements)[i], visit)
+			}
+		}
+		if n.Terminator != nil {
+			walk(n.Terminator, visit)
+		}
+	case *Block:
+		walk(n.Body, visit)
+	case *Statement:
+		if n.Assignment != nil {
+			walk(n.Assignment, visit)
+		} else if n.Declarations != nil {
+			for i := range *n.Declarations {
+				walk(&(*n.Declarations)[i], visit)
+			}
+		} else if n.Use != nil {
+			walk(usedBody(n.Use), visit)
+		}
+	case *Assignment:
+		walk(n.Lvalue, visit)
+		if n.Expression != nil {
+			walk(n.Expression, visit)
+		}
+	case *Declaration:
+		walk(n.Value, visit)
+	case *Terminator:
+		if n.Return != nil {
+			walk(n.Return, visit)
+		} else if n.BreakExp != nil {
+			walk(n.BreakExp, visit)
+		}
+	case *Function:
+		walk(n.Body, visit)
+	case *Expression:
+		if n.Ifs != nil {
+			walk(n.Ifs, visit)
+		} else if n.Loop != nil {
+			walk(n.Loop, visit)
+		} else if n.Asm != nil {
+			for _, a := range *n.Asm {
+				if a.Expression != nil {
+					walk(a.Expression, visit)
+				}
+			}
+		} else if n.ForVar != "" {
+			walk(n.Iter, visit)
+			walk(n.Body, visit)
+		} else if n.Expression != nil {
+			walk(n.Expression, visit)
+		}
+	case *Ifs:
+		for _, i := range *n.IfList {
+			walk(i.Cond, visit)
+			walk(i.Then, visit)
+		}
+		if n.FinalElse != nil {
+			walk(n.FinalElse, visit)
+		}
+	case *LogicExp:
+		walk(n.Left, visit)
+		if n.Right != nil {
+			walk(n.Right, visit)
+		}
+	case *LogicNotExp:
+		if n.LogicNotExp != nil {
+			walk(n.LogicNotExp, visit)
+		} else {
+			walk(n.PushExp, visit)
+		}
+	case *PushExp:
+		walk(n.Left, visit)
+		if n.Right != nil {
+			walk(n.Right, visit)
+		}
+	case *BitwiseExp:
+		walk(n.Left, visit)
+		if n.Right != nil {
+			walk(n.Right, visit)
+		}
+	case *CompareExp:
+		walk(n.Left, visit)
+		if n.Right != nil {
+			walk(n.Right, visit)
+		}
+	case *SumExp:
+		walk(n.Left, visit)
+		if n.Right != nil {
+			walk(n.Right, visit)
+		}
+	case *ProductExp:
+		walk(n.Left, visit)
+		if n.Right != nil {
+			walk(n.Right, visit)
+		}
+	case *ExponentExp:
+		walk(n.Left, visit)
+		if n.Right != nil {
+			walk(n.Right, visit)
+		}
+	case *UnaryExp:
+		if n.PrefixUnaryExp != nil {
+			walk(n.PrefixUnaryExp, visit)
+		} else {
+			walk(n.PostfixExp, visit)
+		}
+	case *CallExp:
+		walk(n.Function, visit)
+		if n.Calls != nil {
+			for _, c := range *n.Calls {
+				if c.Arguments != nil {
+					for i := range *c.Arguments {
+						walk(&(*c.Arguments)[i], visit)
+					}
+				}
+			}
+		}
+	case *IndexedExp:
+		walk(n.Object, visit)
+		if n.Indexes != nil {
+			for i := range *n.Indexes {
+				walk(&(*n.Indexes)[i], visit)
+			}
+		}
+	case *PrimaryExp:
+		if n.Container != nil {
+			for _, p := range *n.Container {
+				walk(p.Key, visit)
+				if p.Value != nil {
+					walk(p.Value, visit)
+				}
+			}
+		} else if n.Block != nil {
+			walk(n.Block, visit)
+		} else if n.Function != nil {
+			walk(n.Function, visit)
+		} else if n.Paren != nil {
+			walk(n.Paren, visit)
+		}
+	}
+}
+
+// Return the set of variable names used in a syntax tree.
+func variablesUsed(node any) map[string]bool {
+	used := make(map[string]bool)
+	walk(node, func(node any) bool {
+		if p, ok := node.(*PrimaryExp); ok && p.Variable != nil {
+			used[*p.Variable] = true
+		}
+		return true
+	})
+	return used
+}
+
+// Return the set of variable names declared in a syntax tree, including
+// loop variables, but not those declared in functions inside it.
+func variablesDeclared(node any) map[string]bool {
+	declared := make(map[string]bool)
+	walk(node, func(node any) bool {
+		switch n := node.(type) {
+		case *Declaration:
+			declared[*n.Variable] = true
+		case *Expression:
+			if n.ForVar != "" {
+				declared[n.ForVar] = true
+			}
+		case *Function:
+			return false
+		}
+		return true
+	})
+	return declared
+}
+
+// How the variables of a function, or of the top level, are captured by
+// the closures created in it. Variables are identified by name, so a
+// name that is shadowed is treated as one variable; this can only make a
+// variable a cell when it need not be.
+type captureInfo struct {
+	mutated      map[string]bool // assigned anywhere, including in inner functions
+	captured     map[string]bool // used in an inner function
+	selfCaptured map[string]bool // used in an inner function in its own declaration
+}
+
+func analyzeCaptures(body *Body) *captureInfo {
+	info := captureInfo{
+		mutated:      make(map[string]bool),
+		captured:     make(map[string]bool),
+		selfCaptured: make(map[string]bool),
+	}
+	walk(body, func(node any) bool {
+		switch n := node.(type) {
+		case *Assignment:
+			if n.Expression != nil {
+				if lv := expToLvalue(n.Lvalue); lv.Variable != nil {
+					info.mutated[*lv.Variable] = true
+				}
+			}
+		case *Function:
+			for id := range variablesUsed(n.Body) {
+				info.captured[id] = true
+			}
+		case *Declaration:
+			walk(n.Value, func(node any) bool {
+				if f, ok := node.(*Function); ok && variablesUsed(f.Body)[*n.Variable] {
+					info.selfCaptured[*n.Variable] = true
+				}
+				return true
+			})
+		}
+		return true
+	})
+	return &info
+}
+
+// A captured variable that can change after it is captured is kept in a
+// cell, a one-element array shared by the frame and the closures that
+// capture it. Other captured variables are copied into the closure.
+func (info *captureInfo) isCell(id string) bool {
+	return info.captured[id] && (info.mutated[id] || info.selfCaptured[id])
+}
+
+// The type of a value, as far as the compiler knows it.
+type valueType int
+
+const (
+	typeUnknown valueType = iota
+	typeInt
+	typeFloat
+	typeNone // no value yet; only used while inferring types
+)
+
+// Combine the types of two values that a variable might hold, or of the
+// operands of an arithmetic operator.
+func joinTypes(a, b valueType) valueType {
+	if a == typeNone {
+		return b
+	} else if b == typeNone || a == b {
+		return a
+	}
+	return typeUnknown
+}
+
+// Infer the types of the variables of a function, or of the top level. A
+// variable has a type if every value it is given has that type. As for
+// captures, variables are identified by name; a variable that a closure
+// can assign is not given a type. The types are only hints: the typed
+// instructions compiled from them check their operands.
+func inferTypes(body *Body, info *captureInfo) map[string]valueType {
+	// The expressions assigned to each variable, or for loop variables,
+	// the loops.
+	type loopVar struct{ loop *Expression }
+	values := make(map[string][]any)
+	walk(body, func(node any) bool {
+		switch n := node.(type) {
+		case *Function:
+			return false
+		case *Declaration:
+			values[*n.Variable] = append(values[*n.Variable], n.Value)
+		case *Assignment:
+			if n.Expression != nil {
+				if lv := expToLvalue(n.Lvalue); lv.Variable != nil {
+					values[*lv.Variable] = append(values[*lv.Variable], n.Expression)
+				}
+			}
+		case *Expression:
+			if n.ForVar != "" {
+				values[n.ForVar] = append(values[n.ForVar], loopVar{n})
+			}
+		}
+		return true
+	})
+
+	// Start with no type for each variable, and widen until nothing changes.
+	types := make(map[string]valueType)
+	for id := range values {
+		types[id] = typeNone
+	}
+	for changed := true; changed; {
+		changed = false
+		for id, vs := range values {
+			t := typeNone
+			for _, v := range vs {
+				if lv, ok := v.(loopVar); ok {
+					t = joinTypes(t, loopVarType(lv.loop, types))
+				} else {
+					t = joinTypes(t, typeOf(v, types))
+				}
+			}
+			if t != types[id] {
+				types[id] = t
+				changed = true
+			}
+		}
+	}
+	for id, t := range types {
+		if t == typeNone || (info.captured[id] && info.mutated[id]) {
+			delete(types, id)
+		}
+	}
+	return types
+}
+
+// The type of the variable of a for loop: iterating over an integer gives
+// integers, and over a list literal, its elements.
+func loopVarType(loop *Expression, types map[string]valueType) valueType {
+	if p := expToPrimary(loop.Iter); p != nil && p.Container != nil && isNonNullList(*p.Container) {
+		t := typeNone
+		for _, e := range *p.Container {
+			t = joinTypes(t, typeOf(e.Key, types))
+		}
+		return t
+	} else if typeOf(loop.Iter, types) == typeInt {
+		return typeInt
+	}
+	return typeUnknown
+}
+
+// The type of an expression, given the types of variables.
+func typeOf(node any, types map[string]valueType) valueType {
+	switch n := node.(type) {
+	case *Expression:
+		if n.Expression != nil {
+			return typeOf(n.Expression, types)
+		}
+	case *LogicExp:
+		if n.Right == nil {
+			return typeOf(n.Left, types)
+		}
+	case *LogicNotExp:
+		if n.PushExp != nil {
+			return typeOf(n.PushExp, types)
+		}
+	case *PushExp:
+		if n.Right == nil {
+			return typeOf(n.Left, types)
+		}
+	case *BitwiseExp:
+		if n.Right == nil {
+			return typeOf(n.Left, types)
+		}
+	case *CompareExp:
+		if n.Right == nil {
+			return typeOf(n.Left, types)
+		}
+	case *SumExp:
+		if n.Right == nil {
+			return typeOf(n.Left, types)
+		}
+		return joinTypes(typeOf(n.Left, types), typeOf(n.Right, types))
+	case *ProductExp:
+		if n.Right == nil {
+			return typeOf(n.Left, types)
+		}
+		return joinTypes(typeOf(n.Left, types), typeOf(n.Right, types))
+	case *ExponentExp:
+		if n.Right == nil {
+			return typeOf(n.Left, types)
+		}
+	case *UnaryExp:
+		if n.PrefixUnaryExp != nil {
+			if n.PreOp == "-" || n.PreOp == "+" {
+				return typeOf(n.PrefixUnaryExp, types)
+			}
+		} else if n.PostOp == nil {
+			return typeOf(n.PostfixExp, types)
+		}
+	case *CallExp:
+		if n.Calls == nil {
+			if n.Function.Indexes == nil {
+				return typeOf(n.Function.Object, types)
+			}
+		} else if len(*n.Calls) == 1 && n.Function.Indexes == nil && n.Function.Object.Variable != nil {
+			switch strings.ToUpper(*n.Function.Object.Variable) {
+			case "I2F":
+				return typeFloat
+			case "F2I":
+				return typeInt
+			}
+		}
+	case *PrimaryExp:
+		if n.Int != nil {
+			return typeInt
+		} else if n.Float != nil {
+			return typeFloat
+		} else if n.Paren != nil {
+			return typeOf(n.Paren, types)
+		} else if n.Variable != nil {
+			return types[*n.Variable]
+		}
+	}
+	return typeUnknown
+}
@@ -0,0 +1,437 @@
+/*
+Compile SAM code to C
+
+Copyright © 2026 Reuben Thomas <rrt@sc3d.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+package main
+
+import (
+	"fmt"
+	"strings"
+
+	"github.com/rrthomas/sam/libsam"
+)
+
+// A compiled program is a C translation unit that is linked with libsam.
+// It makes the program's blobs when it starts, and gives each code array a
+// C function that libsam runs in place of interpreting the array. The
+// function has a case for each word, so that it can start at any word;
+// jumps to a known word are direct, and integers that give the address of
+// SGET and SSET or the offset of JUMP and JUMP_IF_FALSE are compiled with
+// them. Other instructions and traps call libsam, so the semantics are the
+// interpreter's; if they change the code array, the interpreter runs the
+// rest of it. Under --debug the interpreter runs the code as usual, so
+// that it can be traced.
+
+type cProgram struct {
+	blobs []libsam.Blob
+	index map[libsam.Blob]int
+	code  map[libsam.Blob]bool // arrays that are run as code
+}
+
+// Compile the program whose top-level code is `code` to C.
+func BuildC(code libsam.Blob) (string, error) {
+	p := cProgram{index: make(map[libsam.Blob]int), code: make(map[libsam.Blob]bool)}
+	p.code[code] = true
+	if err := p.collect(code); err != nil {
+		return "", err
+	}
+
+	var out strings.Builder
+	out.WriteString(cPrologue)
+	fmt.Fprintf(&out, "static sam_blob_t *blob[%d];\n\n", len(p.blobs))
+	out.WriteString(cFill)
+	for i, b := range p.blobs {
+		if p.code[b] {
+			out.WriteString(p.function(i, b))
+		}
+	}
+	out.WriteString(p.build())
+	out.WriteString(cMain)
+	return out.String(), nil
+}
+
+// Number the blobs reachable from `b`.
+func (p *cProgram) collect(b libsam.Blob) error {
+	if _, ok := p.index[b]; ok {
+		return nil
+	}
+	p.index[b] = len(p.blobs)
+	p.blobs = append(p.blobs, b)
+	switch b.Type() {
+	case libsam.BLOB_ARRAY:
+		for i := libsam.Uword(0); i < b.Sp(); i++ {
+			if _, w := b.Peek(i); libsam.Word(w)&libsam.BLOB_TAG_MASK == libsam.BLOB_TAG {
+				item := libsam.WordBlob(w)
+				if p.code[b] && item.Type() == libsam.BLOB_ARRAY {
+					p.code[item] = true
+				}
+				if err := p.collect(item); err != nil {
+					return err
+				}
+			}
+		}
+	case libsam.BLOB_CLOSURE:
+		code, context := b.ClosureParts()
+		p.code[code] = true
+		if err := p.collect(code); err != nil {
+			return err
+		}
+		return p.collect(context)
+	case libsam.BLOB_STRING:
+	default:
+		return fmt.Errorf("cannot compile a blob of type %d", b.Type())
+	}
+	return nil
+}
+
+// The C function for code array number `n`.
+func (p *cProgram) function(n int, code libsam.Blob) string {
+	length := int(code.Sp())
+	words := make([]libsam.Uword, length)
+	for i := range words {
+		_, words[i] = code.Peek(libsam.Uword(i))
+	}
+
+	// Decode the words.
+	type cWord struct {
+		text   string
+		target int // for words compiled with the next word, the word after
+	}
+	body := make([]cWord, length)
+	next := false // whether NEXT is used
+	for i, w := range words {
+		var text strings.Builder
+		body[i].target = -1
+		switch {
+		case libsam.Word(w)&libsam.INT_TAG_MASK == libsam.INT_TAG:
+			if i+1 < length {
+				if s, ok := p.fused(libsam.Word(w)>>libsam.INT_SHIFT, i, words, length); ok {
+					body[i] = cWord{s, i + 2}
+					next = next || strings.Contains(s, "NEXT(")
+					continue
+				}
+			}
+			fmt.Fprintf(&text, "PUSH_WORD(%#x);", w)
+		case libsam.Word(w)&libsam.FLOAT_TAG_MASK == libsam.FLOAT_TAG:
+			fmt.Fprintf(&text, "PUSH_WORD(%#x);", w)
+		case libsam.Word(w)&libsam.BLOB_TAG_MASK == libsam.BLOB_TAG:
+			fmt.Fprintf(&text, "PUSH_BLOB(blob[%d]);", p.index[libsam.WordBlob(w)])
+		case libsam.Word(w)&libsam.ATOM_TAG_MASK == libsam.ATOM_TAG:
+			switch libsam.Uword(libsam.Word(w)&libsam.ATOM_TYPE_MASK) >> libsam.Uword(libsam.ATOM_TYPE_SHIFT) {
+			case libsam.ATOM_NULL, libsam.ATOM_BOOL:
+				fmt.Fprintf(&text, "PUSH_WORD(%#x);", w)
+			default:
+				text.WriteString("HALT(SAM_ERROR_INVALID_ATOM_TYPE);")
+			}
+		case libsam.Word(w)&libsam.TRAP_TAG_MASK == libsam.TRAP_TAG:
+			fmt.Fprintf(&text, "HALT_IF_ERROR(sam_trap(state, %d));\n        NEXT(%d);", w>>libsam.Uword(libsam.TRAP_FUNCTION_SHIFT), i+1)
+			next = true
+		default:
+			fmt.Fprintf(&text, "HALT_IF_ERROR(sam_run_insts(state, %#x));\n        NEXT(%d);", w, i+1)
+			next = true
+		}
+		body[i].text = text.String()
+	}
+
+	var out strings.Builder
+	fmt.Fprintf(&out, "static sam_word_t code_%d(sam_state_t *state)\n{\n", n)
+	out.WriteString("    sam_word_t error = SAM_ERROR_OK;\n")
+	if next {
+		out.WriteString("    sam_blob_t *code = state->p0;\n\ndispatch:\n")
+	} else {
+		out.WriteString("\n")
+	}
+	out.WriteString("    switch (state->pc) {\n")
+	for i := range body {
+		fmt.Fprintf(&out, "    case %d: goto w%d;\n", i, i)
+	}
+	fmt.Fprintf(&out, "    default: goto w%d;\n    }\n\n", length)
+	for i, w := range body {
+		pc := i + 1
+		if w.target >= 0 {
+			pc = w.target
+		}
+		fmt.Fprintf(&out, "w%d:\n    {\n        TICK();\n        state->pc = %d;\n        %s\n", i, pc, w.text)
+		if w.target >= 0 {
+			fmt.Fprintf(&out, "        goto w%d;\n", w.target)
+		}
+		out.WriteString("    }\n")
+	}
+	fmt.Fprintf(&out, "w%d:\n    HALT(SAM_ERROR_ARRAY_OVERFLOW);\n\nerror:\n    return error;\n}\n\n", length)
+	return out.String()
+}
+
+// Compile the integer `n` at word `i` together with the word after it, if
+// that uses it as a stack address or jump offset.
+func (p *cProgram) fused(n libsam.Word, i int, words []libsam.Uword, length int) (string, bool) {
+	w := words[i+1]
+	if libsam.Word(w)&libsam.INSTS_TAG_MASK == libsam.INSTS_TAG {
+		opcodes := w >> libsam.Uword(libsam.INSTS_SHIFT)
+		opcode := opcodes & libsam.Uword(libsam.INST_MASK)
+		var text string
+		_, sget := libsam.Instructions["sget"].SetAndOpcode()
+		_, sset := libsam.Instructions["sset"].SetAndOpcode()
+		if opcode == sget {
+			text = fmt.Sprintf(`sam_uword_t addr, item;
+        HALT_IF_ERROR(sam_array_item(state->s0, %d, &addr));
+        HALT_IF_ERROR(sam_array_peek(state->s0, addr, &item));
+        PUSH_WORD(item);`, n)
+		} else if opcode == sset {
+			text = fmt.Sprintf(`sam_uword_t dest;
+        sam_word_t val;
+        HALT_IF_ERROR(sam_array_item(state->s0, %d, &dest));
+        POP_WORD(&val);
+        HALT_IF_ERROR(sam_array_poke(state->s0, dest, val));`, n)
+		} else {
+			return "", false
+		}
+		if rest := opcodes >> libsam.Uword(libsam.ONE_INST_SHIFT); rest != 0 {
+			ir := w&(1<<libsam.Uword(libsam.INSTS_SHIFT)-1) | rest<<libsam.Uword(libsam.INSTS_SHIFT)
+			text += fmt.Sprintf("\n        HALT_IF_ERROR(sam_run_insts(state, %#x));\n        NEXT(%d);", ir, i+2)
+		}
+		return text, true
+	} else if libsam.Word(w)&libsam.TRAP_TAG_MASK == libsam.TRAP_TAG {
+		target := i + 2 + int(n)
+		if target < 0 || target > length {
+			return "", false
+		}
+		switch uint(w >> libsam.Uword(libsam.TRAP_FUNCTION_SHIFT)) {
+		case libsam.Traps["JUMP"]:
+			return fmt.Sprintf("state->pc = %d;\n        goto w%d;", target, target), true
+		case libsam.Traps["JUMP_IF_FALSE"]:
+			return fmt.Sprintf(`sam_word_t flag;
+        POP_BOOL(flag);
+        if (!flag) {
+            state->pc = %d;
+            goto w%d;
+        }`, target, target), true
+		}
+	}
+	return "", false
+}
+
+// The function that makes the program's blobs.
+func (p *cProgram) build() string {
+	var out strings.Builder
+	for i, b := range p.blobs {
+		if b.Type() != libsam.BLOB_ARRAY || b.Sp() == 0 {
+			continue
+		}
+		fmt.Fprintf(&out, "static const sam_word_t words_%d[] = {\n", i)
+		for j := libsam.Uword(0); j < b.Sp(); j++ {
+			_, w := b.Peek(j)
+			if libsam.Word(w)&libsam.BLOB_TAG_MASK == libsam.BLOB_TAG {
+				w = libsam.Uword(p.index[libsam.WordBlob(w)])<<libsam.Uword(libsam.BLOB_SHIFT) | libsam.Uword(libsam.BLOB_TAG)
+			}
+			fmt.Fprintf(&out, "    %d,\n", libsam.Word(w))
+		}
+		out.WriteString("};\n\n")
+	}
+
+	out.WriteString("// Make the program's blobs.\nstatic sam_word_t build(void)\n{\n    sam_word_t error = SAM_ERROR_OK;\n")
+	for i, b := range p.blobs {
+		switch b.Type() {
+		case libsam.BLOB_ARRAY:
+			fmt.Fprintf(&out, "    HALT_IF_ERROR(sam_array_new(&blob[%d]));\n", i)
+		case libsam.BLOB_STRING:
+			s := b.StringValue()
+			fmt.Fprintf(&out, "    HALT_IF_ERROR(sam_string_new(&blob[%d], %s, %d));\n", i, cString(s), len(s))
+		}
+	}
+	for i, b := range p.blobs {
+		if b.Type() == libsam.BLOB_CLOSURE {
+			code, context := b.ClosureParts()
+			fmt.Fprintf(&out, "    HALT_IF_ERROR(sam_closure_new(&blob[%d], blob[%d], blob[%d]));\n", i, p.index[code], p.index[context])
+		}
+	}
+	for i, b := range p.blobs {
+		if b.Type() != libsam.BLOB_ARRAY {
+			continue
+		}
+		if b.Sp() > 0 {
+			fmt.Fprintf(&out, "    HALT_IF_ERROR(fill(blob[%d], words_%d, %d));\n", i, i, b.Sp())
+		}
+		if b.Verified() {
+			fmt.Fprintf(&out, "    HALT_IF_ERROR(sam_array_set_verified(blob[%d]));\n", i)
+		}
+		if p.code[b] {
+			fmt.Fprintf(&out, "    HALT_IF_ERROR(sam_array_set_native(blob[%d], code_%d));\n", i, i)
+		}
+	}
+	out.WriteString("\nerror:\n    return error;\n}\n\n")
+	return out.String()
+}
+
+// Quote a string for C. Octal escapes are used, as they cannot run on
+// into the following characters.
+func cString(s string) string {
+	var out strings.Builder
+	out.WriteByte('"')
+	for i := 0; i < len(s); i++ {
+		c := s[i]
+		if c == '"' || c == '\\' || c < ' ' || c > '~' {
+			fmt.Fprintf(&out, "\\%03o", c)
+		} else {
+			out.WriteByte(c)
+		}
+	}
+	out.WriteByte('"')
+	return out.String()
+}
+
+var cPrologue = `// Generated by sam build; compile and link with libsam.
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sam.h"
+#include "sam_opcodes.h"
+#include "sam_sdl.h"
+#include "private.h"
+#include "run.h"
+#include "traps_basic.h"
+
+static sam_uword_t tick_count;
+
+// Checking the time is too slow to do on every instruction.
+#define TICK()                                           \
+    if ((++tick_count & 0xff) == 0)                      \
+        sam_sdl_poll()
+
+// Carry on at word n, unless control has left the code, or the code has
+// changed, in which case the interpreter runs it.
+#define NEXT(n)                                          \
+    do {                                                 \
+        if (state->p0 != code ||                         \
+            ((sam_array_t *)code->data)->native == NULL) \
+            return SAM_ERROR_OK;                         \
+        if (state->pc != (n))                            \
+            goto dispatch;                               \
+    } while (0)
+
+`
+
+var cFill = `// Fill an array with words, in which blob words give the number of a blob.
+static sam_word_t fill(sam_blob_t *array, const sam_word_t *words, size_t n)
+{
+    sam_word_t error = SAM_ERROR_OK;
+    for (size_t i = 0; i < n; i++) {
+        sam_word_t w = words[i];
+        if ((w & SAM_BLOB_TAG_MASK) == SAM_BLOB_TAG)
+            w = (sam_uword_t)blob[w >> SAM_BLOB_SHIFT] | SAM_BLOB_TAG;
+        HALT_IF_ERROR(sam_array_push(array, w));
+    }
+
+error:
+    return error;
+}
+
+`
+
+var cMain = `#ifdef SAM_DEBUG
+// The names of errors, as sam --debug gives them.
+static const char *error_names[] = {
+    [SAM_ERROR_OK] = "ERROR_OK",
+    [SAM_ERROR_INVALID_OPCODE] = "ERROR_INVALID_OPCODE",
+    [SAM_ERROR_INVALID_ADDRESS] = "ERROR_INVALID_ADDRESS",
+    [SAM_ERROR_ARRAY_UNDERFLOW] = "ERROR_ARRAY_UNDERFLOW",
+    [SAM_ERROR_ARRAY_OVERFLOW] = "ERROR_ARRAY_OVERFLOW",
+    [SAM_ERROR_WRONG_TYPE] = "ERROR_WRONG_TYPE",
+    [SAM_ERROR_INVALID_TRAP] = "ERROR_INVALID_TRAP",
+    [SAM_ERROR_TRAP_INIT] = "ERROR_TRAP_INIT",
+    [SAM_ERROR_NO_MEMORY] = "ERROR_NO_MEMORY",
+    [SAM_ERROR_INVALID_BLOB_TYPE] = "ERROR_INVALID_BLOB_TYPE",
+};
+
+// Print what sam_run returned and the final stack, as sam --debug does.
+// Like sam, write straight to standard output, ahead of any output that
+// the program's traps have buffered.
+static void print_result(sam_state_t *state, sam_word_t error)
+{
+    dprintf(STDOUT_FILENO, "\n\nsam_run returns: ");
+    sam_array_t *s;
+    if (error == SAM_ERROR_OK && sam_array_from_blob(state->s0, &s) == SAM_ERROR_OK && s->sp > 0) {
+        sam_uword_t w;
+        sam_array_peek(state->s0, s->sp - 1, &w);
+        sam_word_t result = w;
+        char *text = disas(result);
+        if ((result & SAM_BLOB_TAG_MASK) == SAM_BLOB_TAG) {
+            const char *start = text;
+            while (isspace((unsigned char)*start))
+                start++;
+            int len = strlen(start);
+            while (len > 0 && isspace((unsigned char)start[len - 1]))
+                len--;
+            if (len == 0) {
+                start = "(empty blob)";
+                len = strlen(start);
+            }
+            dprintf(STDOUT_FILENO, "halt with result blob %#lx:\n%.*s\n", (unsigned long)(result & ~SAM_BLOB_TAG_MASK), len, start);
+        } else
+            dprintf(STDOUT_FILENO, "halt with result %s\n", text);
+        free(text);
+    } else if (error >= SAM_ERROR_OK && error <= SAM_ERROR_INVALID_BLOB_TYPE)
+        dprintf(STDOUT_FILENO, "%s\n", error_names[error] != NULL ? error_names[error] : "");
+    else
+        dprintf(STDOUT_FILENO, "unknown error code %ld (0x%lx)\n", (long)error, (unsigned long)error);
+    sam_print_array(state->s0);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0)
+            sam_headless = true;
+#ifdef SAM_DEBUG
+        else if (strcmp(argv[i], "--debug") == 0)
+            do_debug = true;
+#endif
+        else {
+            fprintf(stderr, "Usage: %s [--headless] [--debug]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    sam_word_t error = SAM_ERROR_OK;
+    sam_state_t *state = sam_state_new();
+    if (state == NULL)
+        return SAM_ERROR_NO_MEMORY;
+    HALT_IF_ERROR(build());
+    HALT_IF_ERROR(sam_array_new(&state->s0));
+    HALT_IF_ERROR(sam_basic_init());
+    HALT_IF_ERROR(sam_sdl_init());
+#ifdef SAM_DEBUG
+    sam_print_array(blob[0]);
+#endif
+    state->p0 = blob[0];
+    error = sam_run(state);
+#ifdef SAM_DEBUG
+    if (do_debug)
+        print_result(state, error);
+#endif
+    sam_basic_finish();
+    sam_sdl_finish();
+
+error:
+    return error;
+}
+`
@@ -0,0 +1,305 @@
+/*
+Cache compiled SAL programs
+
+Copyright © 2026 Reuben Thomas <rrt@sc3d.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+package main
+
+import (
+	"crypto/sha256"
+	"encoding/gob"
+	"encoding/hex"
+	"fmt"
+	"io"
+	"os"
+	"path/filepath"
+	rtdebug "runtime/debug"
+	"time"
+
+	"github.com/rrthomas/sam/libsam"
+)
+
+// The code compiled from a program is cached in the user's cache
+// directory, keyed by a hash of the program's source, the compiler and its
+// options. A file named by `use` is compiled inline, in the scope of the
+// `use` statement, so its code cannot be cached on its own; instead, a
+// cache entry records the hashes of the files the program used, and is only
+// used if none of them has changed. If the cache cannot be read, the
+// program is compiled as usual. Entries that have not been used for
+// cacheMaxAge are removed when a new entry is written.
+
+const cacheMaxAge = 30 * 24 * time.Hour
+
+// A blob in a cache entry. References to other blobs are their indices in
+// the entry.
+type cachedBlob struct {
+	Type    libsam.Uword
+	Words   []cachedWord // array
+	String  string       // string
+	Code    int          // closure
+	Context int          // closure
+}
+
+// A word of an array. Blob is 0 for a word that is not a blob, or 1 more
+// than the index of the blob.
+type cachedWord struct {
+	Word libsam.Uword
+	Blob int
+}
+
+type cacheEntry struct {
+	Used  map[string][sha256.Size]byte
+	Blobs []cachedBlob
+}
+
+// Compile SAL source, using the cache when possible.
+func compileSal(source []byte) libsam.Blob {
+	if printAst || noCache {
+		return Sal(string(source), printAst, optimize)
+	}
+	file, err := cacheFile(source)
+	if err != nil {
+		return Sal(string(source), printAst, optimize)
+	}
+	if code, err := loadCache(file, optimize); err == nil {
+		now := time.Now()
+		_ = os.Chtimes(file, now, now) // mark the entry as used, so it is not pruned
+		return code
+	}
+	code := Sal(string(source), printAst, optimize)
+	if saveCache(file, code) == nil { // the cache is only an optimization
+		pruneCache(filepath.Dir(file))
+	}
+	return code
+}
+
+// The cache file for a program.
+func cacheFile(source []byte) (string, error) {
+	dir, err := os.UserCacheDir()
+	if err != nil {
+		return "", err
+	}
+	id, err := compilerID()
+	if err != nil {
+		return "", err
+	}
+	h := sha256.New()
+	fmt.Fprintf(h, "%s %t\n", id, optimize)
+	h.Write(source)
+	return filepath.Join(dir, "sam", hex.EncodeToString(h.Sum(nil))), nil
+}
+
+// Identify the compiler: by its version or commit if it was built from
+// one, or else by a hash of the executable, which, unlike its path, is the
+// same each time `go run` builds it.
+func compilerID() (string, error) {
+	if info, ok := rtdebug.ReadBuildInfo(); ok {
+		if info.Main.Version != "" && info.Main.Version != "(devel)" {
+			return info.Main.Version, nil
+		}
+		var revision, modified string
+		for _, s := range info.Settings {
+			switch s.Key {
+			case "vcs.revision":
+				revision = s.Value
+			case "vcs.modified":
+				modified = s.Value
+			}
+		}
+		if revision != "" && modified == "false" {
+			return revision, nil
+		}
+	}
+	exe, err := os.Executable()
+	if err != nil {
+		return "", err
+	}
+	f, err := os.Open(exe)
+	if err != nil {
+		return "", err
+	}
+	defer f.Close()
+	h := sha256.New()
+	if _, err := io.Copy(h, f); err != nil {
+		return "", err
+	}
+	return hex.EncodeToString(h.Sum(nil)), nil
+}
+
+// Remove cache entries, and temporary files left by interrupted writes,
+// that have not been used for cacheMaxAge.
+func pruneCache(dir string) {
+	entries, err := os.ReadDir(dir)
+	if err != nil {
+		return
+	}
+	for _, e := range entries {
+		if info, err := e.Info(); err == nil && time.Since(info.ModTime()) > cacheMaxAge {
+			os.Remove(filepath.Join(dir, e.Name()))
+		}
+	}
+}
+
+// Load a cached program. If verify is true, its code is verified, as the
+// compiler does when optimizing.
+func loadCache(file string, verify bool) (libsam.Blob, error) {
+	f, err := os.Open(file)
+	if err != nil {
+		return libsam.Blob{}, err
+	}
+	defer f.Close()
+	var entry cacheEntry
+	if err := gob.NewDecoder(f).Decode(&entry); err != nil {
+		return libsam.Blob{}, err
+	}
+	for filename, hash := range entry.Used {
+		src, err := os.ReadFile(filename)
+		if err != nil || sha256.Sum256(src) != hash {
+			return libsam.Blob{}, fmt.Errorf("%s has changed", filename)
+		}
+	}
+
+	// Make each blob after the blobs it refers to, so that each array can
+	// be made in one call.
+	const (
+		unmade = iota
+		making
+		made
+	)
+	blobs := make([]libsam.Blob, len(entry.Blobs))
+	words := make([][]libsam.Word, len(entry.Blobs))
+	state := make([]int, len(entry.Blobs))
+	var build func(i int) (libsam.Blob, error)
+	build = func(i int) (libsam.Blob, error) {
+		if i < 0 || i >= len(blobs) || state[i] == making {
+			return libsam.Blob{}, fmt.Errorf("bad cache entry")
+		} else if state[i] == made {
+			return blobs[i], nil
+		}
+		state[i] = making
+		b := entry.Blobs[i]
+		switch b.Type {
+		case libsam.BLOB_ARRAY:
+			words[i] = make([]libsam.Word, len(b.Words))
+			for j, w := range b.Words {
+				if w.Blob > 0 {
+					item, err := build(w.Blob - 1)
+					if err != nil {
+						return item, err
+					}
+					words[i][j] = libsam.MakeInstArray(item)
+				} else {
+					words[i][j] = libsam.Word(w.Word)
+				}
+			}
+			blobs[i] = libsam.NewArrayFromWords(words[i])
+		case libsam.BLOB_STRING:
+			blobs[i] = libsam.NewString(b.String)
+		case libsam.BLOB_CLOSURE:
+			code, err := build(b.Code)
+			if err != nil {
+				return code, err
+			}
+			context, err := build(b.Context)
+			if err != nil {
+				return context, err
+			}
+			blobs[i] = libsam.NewClosure(code, context)
+		default:
+			return libsam.Blob{}, fmt.Errorf("bad cache entry")
+		}
+		state[i] = made
+		return blobs[i], nil
+	}
+	code, err := build(0)
+	if err != nil || !verify {
+		return code, err
+	}
+
+	// Verified code runs without checks, so verify the code again rather
+	// than trusting the entry. Blob 0 is the top-level code; arrays in code
+	// and the code of closures are the code of closures.
+	visited := make([]bool, len(blobs))
+	var verifyCode func(i int, frame bool)
+	verifyCode = func(i int, frame bool) {
+		if visited[i] || entry.Blobs[i].Type != libsam.BLOB_ARRAY {
+			return
+		}
+		visited[i] = true
+		if libsam.VerifyWords(words[i], frame) {
+			blobs[i].SetVerified()
+		}
+		for _, w := range entry.Blobs[i].Words {
+			if w.Blob > 0 {
+				if item := entry.Blobs[w.Blob-1]; item.Type == libsam.BLOB_CLOSURE {
+					verifyCode(item.Code, true)
+				} else {
+					verifyCode(w.Blob-1, true)
+				}
+			}
+		}
+	}
+	verifyCode(0, false)
+	return code, nil
+}
+
+func saveCache(file string, code libsam.Blob) error {
+	p := cProgram{index: make(map[libsam.Blob]int), code: make(map[libsam.Blob]bool)}
+	if err := p.collect(code); err != nil {
+		return err
+	}
+	entry := cacheEntry{Used: usedHashes, Blobs: make([]cachedBlob, len(p.blobs))}
+	for i, b := range p.blobs {
+		cb := cachedBlob{Type: b.Type()}
+		switch cb.Type {
+		case libsam.BLOB_ARRAY:
+			cb.Words = make([]cachedWord, b.Sp())
+			for j := range cb.Words {
+				_, w := b.Peek(libsam.Uword(j))
+				if libsam.Word(w)&libsam.BLOB_TAG_MASK == libsam.BLOB_TAG {
+					cb.Words[j].Blob = p.index[libsam.WordBlob(w)] + 1
+				} else {
+					cb.Words[j].Word = w
+				}
+			}
+		case libsam.BLOB_STRING:
+			cb.String = b.StringValue()
+		case libsam.BLOB_CLOSURE:
+			code, context := b.ClosureParts()
+			cb.Code, cb.Context = p.index[code], p.index[context]
+		}
+		entry.Blobs[i] = cb
+	}
+
+	// Write the entry to a temporary file, then rename it, so that a
+	// partly-written entry is never read.
+	if err := os.MkdirAll(filepath.Dir(file), 0755); err != nil {
+		return err
+	}
+	f, err := os.CreateTemp(filepath.Dir(file), "tmp")
+	if err != nil {
+		return err
+	}
+	defer os.Remove(f.Name())
+	if err := gob.NewEncoder(f).Encode(entry); err != nil {
+		f.Close()
+		return err
+	}
+	if err := f.Close(); err != nil {
+		return err
+	}
+	return os.Rename(f.Name(), file)
+}
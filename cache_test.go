@@ -0,0 +1,85 @@
+/*
+Tests for the compiled code cache
+
+Copyright © 2026 Reuben Thomas <rrt@sc3d.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+package main
+
+import (
+	"encoding/gob"
+	"os"
+	"path/filepath"
+	"strings"
+	"testing"
+
+	"github.com/alecthomas/assert/v2"
+	"github.com/rrthomas/sam/libsam"
+)
+
+// A program loaded from the cache must be the program that was compiled.
+func TestCache(t *testing.T) {
+	files, err := filepath.Glob("test/*.sal")
+	assert.NoError(t, err)
+	file := filepath.Join(t.TempDir(), "entry")
+	for _, opt := range []bool{false, true} {
+		for _, name := range files {
+			src, err := os.ReadFile(name)
+			assert.NoError(t, err)
+			if _, err := parseSAL(string(src)); err != nil {
+				continue
+			}
+			if strings.HasPrefix(string(src), "use ") {
+				continue // `use` paths are relative to the test directory
+			}
+			code := Sal(string(src), false, opt)
+			assert.NoError(t, saveCache(file, code), name)
+			loaded, err := loadCache(file, opt)
+			assert.NoError(t, err, name)
+			expected, err := BuildC(code)
+			assert.NoError(t, err, name)
+			actual, err := BuildC(loaded)
+			assert.NoError(t, err, name)
+			assert.Equal(t, expected, actual, name)
+			assert.Equal(t, code.Verified(), loaded.Verified(), name)
+		}
+	}
+}
+
+// Code loaded from the cache is verified again, so a changed entry cannot
+// make unsafe code run without checks.
+func TestCacheVerify(t *testing.T) {
+	file := filepath.Join(t.TempDir(), "entry")
+	code := Sal("let x = 1\nx + 1", false, true)
+	assert.True(t, code.Verified())
+	assert.NoError(t, saveCache(file, code))
+
+	// Make the code start by popping an item that it has not pushed.
+	f, err := os.Open(file)
+	assert.NoError(t, err)
+	var entry cacheEntry
+	assert.NoError(t, gob.NewDecoder(f).Decode(&entry))
+	f.Close()
+	_, drop := libsam.Instructions["drop"].SetAndOpcode()
+	entry.Blobs[0].Words[0] = cachedWord{Word: libsam.Uword(libsam.MakeInstInsts(libsam.INST_SET_ANY, drop))}
+	f, err = os.Create(file)
+	assert.NoError(t, err)
+	assert.NoError(t, gob.NewEncoder(f).Encode(entry))
+	assert.NoError(t, f.Close())
+
+	loaded, err := loadCache(file, true)
+	assert.NoError(t, err)
+	assert.False(t, loaded.Verified())
+}
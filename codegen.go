@@ -19,31 +19,79 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 package main
 
 import (
+	"runtime"
+	"sync"
+
 	"github.com/rrthomas/sam/libsam"
 )
 
 // Assemble a program
 // FIXME: check all return codes from libsam and panic on error
 // FIXME: separate assembler in this module from assembler in assembler.go
+//
+// Code is assembled in two phases. While the program is compiled, which
+// resolves variables, captures and jumps, each assembler builds its words
+// in Go. Then generate makes each code array from its words in one call to
+// libsam, and verifies it. The code of a function is made before the code
+// that refers to it, but otherwise functions are independent, so that
+// phase runs on several goroutines.
 type assembler struct {
-	array  libsam.Blob
-	insts  libsam.Uword
-	nInsts uint
+	array    libsam.Blob // made by generate
+	words    []libsam.Word
+	refs     []asmRef     // words that refer to the code of children
+	children []*assembler // code of the functions compiled in this code
+	verify   bool         // verify the code when it is generated
+	frame    bool         // the code is the code of a closure
+	done     chan struct{}
+	insts    libsam.Uword
+	nInsts   uint
+	set      libsam.Uword // instruction set of insts
+	typed    bool         // insts contains an instruction that uses set
+}
+
+// A word that refers to the code of another assembler, or to a closure of
+// it with no captures, which is filled in when that code is made.
+type asmRef struct {
+	addr    int
+	code    *assembler
+	closure bool
+}
+
+// The number of words of code so far.
+func (a *assembler) sp() libsam.Uword {
+	return libsam.Uword(len(a.words))
+}
+
+// Set the word at addr, which must already have been added, to an
+// integer, such as a jump offset.
+func (a *assembler) pokeInt(addr libsam.Uword, n libsam.Word) {
+	a.words[addr] = libsam.MakeInstInt(n)
 }
 
 func (a *assembler) flushInstructions() {
 	if a.nInsts > 0 {
-		a.array.PushInsts(a.insts)
+		a.words = append(a.words, libsam.MakeInstInsts(a.set, a.insts))
 	}
 	a.nInsts = 0
 	a.insts = 0
+	a.set = libsam.INST_SET_ANY
+	a.typed = false
 }
 
 func (a *assembler) addInstruction(opcode libsam.Instruction) {
 	if (a.nInsts+1)*uint(libsam.ONE_INST_SHIFT)+uint(libsam.INSTS_SHIFT) > uint(libsam.WORD_BIT) {
 		a.flushInstructions()
 	}
-	a.insts |= (opcode.Opcode & libsam.Uword(libsam.INST_MASK)) << (libsam.Uword(a.nInsts) * libsam.Uword(libsam.ONE_INST_SHIFT))
+	// Instructions without typed versions can go in a word of any set.
+	set, op := opcode.SetAndOpcode()
+	if libsam.IsTypedOpcode(op) {
+		if a.typed && set != a.set {
+			a.flushInstructions()
+		}
+		a.set = set
+		a.typed = true
+	}
+	a.insts |= op << (libsam.Uword(a.nInsts) * libsam.Uword(libsam.ONE_INST_SHIFT))
 	a.nInsts += 1
 	if opcode.Terminal {
 		a.flushInstructions()
@@ -52,12 +100,12 @@ func (a *assembler) addInstruction(opcode libsam.Instruction) {
 
 func (a *assembler) addTrap(function libsam.Uword) {
 	a.flushInstructions()
-	a.array.PushTrap(function)
+	a.words = append(a.words, libsam.MakeInstTrap(function))
 }
 
 func (a *assembler) addNull() {
 	a.flushInstructions()
-	a.array.PushAtom(libsam.ATOM_NULL, 0)
+	a.words = append(a.words, libsam.MakeInstAtom(libsam.ATOM_NULL, 0))
 }
 
 func (a *assembler) addBool(f bool) {
@@ -68,22 +116,28 @@ func (a *assembler) addBool(f bool) {
 	} else {
 		boolVal = libsam.Uword(libsam.FALSE)
 	}
-	a.array.PushAtom(libsam.ATOM_BOOL, boolVal)
+	a.words = append(a.words, libsam.MakeInstAtom(libsam.ATOM_BOOL, boolVal))
 }
 
 func (a *assembler) addInt(int libsam.Word) {
 	a.flushInstructions()
-	a.array.PushInt(int)
+	a.words = append(a.words, libsam.MakeInstInt(int))
 }
 
 func (a *assembler) addFloat(float float64) {
 	a.flushInstructions()
-	a.array.PushFloat(float)
+	a.words = append(a.words, libsam.MakeInstFloat(float))
 }
 
 func (a *assembler) addBlob(blob libsam.Blob) {
 	a.flushInstructions()
-	a.array.PushBlob(blob)
+	a.words = append(a.words, libsam.MakeInstArray(blob))
+}
+
+func (a *assembler) addCode(code *assembler, closure bool) {
+	a.flushInstructions()
+	a.refs = append(a.refs, asmRef{len(a.words), code, closure})
+	a.words = append(a.words, 0)
 }
 
 func (a *assembler) addSingleInstruction(opcode libsam.Instruction) {
@@ -91,3 +145,54 @@ func (a *assembler) addSingleInstruction(opcode libsam.Instruction) {
 	a.addInstruction(opcode)
 	a.flushInstructions()
 }
+
+// Make the code arrays of an assembler and of the functions compiled in
+// it, and verify the code that asks for it.
+func (a *assembler) generate() {
+	// List the assemblers with each one after its children.
+	var order []*assembler
+	var walk func(a *assembler)
+	walk = func(a *assembler) {
+		for _, child := range a.children {
+			walk(child)
+		}
+		a.done = make(chan struct{})
+		order = append(order, a)
+	}
+	walk(a)
+
+	// A job is taken after its children's jobs, so a worker that waits
+	// for them is waiting for jobs that are under way.
+	jobs := make(chan *assembler)
+	var wg sync.WaitGroup
+	for range min(runtime.GOMAXPROCS(0), len(order)) {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for job := range jobs {
+				job.emit()
+			}
+		}()
+	}
+	for _, a := range order {
+		jobs <- a
+	}
+	close(jobs)
+	wg.Wait()
+}
+
+func (a *assembler) emit() {
+	for _, ref := range a.refs {
+		<-ref.code.done
+		blob := ref.code.array
+		if ref.closure {
+			blob = libsam.NewClosure(blob, libsam.NewArray())
+		}
+		a.words[ref.addr] = libsam.MakeInstArray(blob)
+	}
+	a.array = libsam.NewArrayFromWords(a.words)
+	if a.verify && libsam.VerifyWords(a.words, a.frame) {
+		a.array.SetVerified()
+	}
+	close(a.done)
+}
@@ -21,7 +21,6 @@ package main
 import (
 	"io"
 
-	"github.com/alecthomas/participle/v2"
 	"github.com/alecthomas/participle/v2/lexer"
 )
 
@@ -49,10 +48,6 @@ var (
 			{Name: "Chars", Pattern: `[^{"\\]+`, Action: nil},
 		},
 	})
-	parser = participle.MustBuild[Body](
-		participle.Lexer(&fixupLexerDefinition{}),
-		participle.UseLookahead(1),
-	)
 
 	identToken     = lex.Symbols()["Ident"]
 	stringEndToken = lex.Symbols()["StringEnd"]
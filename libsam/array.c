@@ -17,6 +17,18 @@
 #include "private.h"
 
 
+// An array that changes is no longer verified, and its translation and
+// compiled code, if any, are out of date.
+static void array_changed(sam_array_t *s)
+{
+    s->verified = false;
+    s->native = NULL;
+    if (s->translation != NULL) {
+        free(s->translation);
+        s->translation = NULL;
+    }
+}
+
 int sam_array_from_blob(sam_blob_t *blob, sam_array_t **s)
 {
     sam_word_t error = SAM_ERROR_OK;
@@ -43,6 +55,28 @@ error:
     return error;
 }
 
+// Make an array holding a copy of n words, so that a whole array can be
+// made in one call.
+int sam_array_new_from_words(const sam_word_t *words, sam_uword_t n, sam_blob_t **new_array)
+{
+    sam_word_t error = SAM_ERROR_OK;
+    HALT_IF_ERROR(sam_array_new(new_array));
+    sam_array_t *s;
+    EXTRACT_BLOB(*new_array, SAM_BLOB_ARRAY, sam_array_t, s);
+    if (n > s->size) {
+        sam_word_t *data = realloc(s->data, n * sizeof(sam_word_t));
+        if (data == NULL)
+            HALT(SAM_ERROR_NO_MEMORY);
+        s->data = data;
+        s->size = n;
+    }
+    if (n > 0)
+        memcpy(s->data, words, n * sizeof(sam_word_t));
+    s->sp = n;
+error:
+    return error;
+}
+
 int sam_array_copy(sam_blob_t *stack, sam_blob_t **new_stack)
 {
     int error = SAM_ERROR_OK;
@@ -82,6 +116,30 @@ int sam_array_poke(sam_blob_t *blob, sam_uword_t addr, sam_uword_t val)
     if (addr >= s->size)
         return SAM_ERROR_INVALID_ADDRESS;
     s->data[addr] = val;
+    array_changed(s);
+error:
+    return error;
+}
+
+// Mark an array as code that has been checked by the verifier, so that it
+// can run without some run-time checks. Changing the array clears the mark.
+int sam_array_set_verified(sam_blob_t *blob)
+{
+    sam_word_t error = SAM_ERROR_OK;
+    sam_array_t *s;
+    EXTRACT_BLOB(blob, SAM_BLOB_ARRAY, sam_array_t, s);
+    s->verified = true;
+    s->runs = 0;
+error:
+    return error;
+}
+
+int sam_array_set_native(sam_blob_t *blob, sam_native_t native)
+{
+    sam_word_t error = SAM_ERROR_OK;
+    sam_array_t *s;
+    EXTRACT_BLOB(blob, SAM_BLOB_ARRAY, sam_array_t, s);
+    s->native = native;
 error:
     return error;
 }
@@ -152,6 +210,7 @@ int sam_array_pop(sam_blob_t *blob, sam_word_t *val_ptr)
         return SAM_ERROR_ARRAY_UNDERFLOW;
     HALT_IF_ERROR(sam_array_peek(blob, s->sp - 1, (sam_uword_t *)val_ptr));
     s->sp--;
+    array_changed(s);
  error:
     return error;
 }
@@ -166,6 +225,7 @@ int sam_array_shift(sam_blob_t *blob, sam_word_t *val_ptr)
     HALT_IF_ERROR(sam_array_peek(blob, 0, (sam_uword_t *)val_ptr));
     memmove(s->data, s->data + 1, s->sp * sizeof(sam_uword_t));
     s->sp--;
+    array_changed(s);
  error:
     return error;
 }
@@ -244,10 +304,10 @@ int sam_make_inst_trap(sam_word_t *inst, sam_uword_t function)
     return SAM_ERROR_OK;
 }
 
-int sam_make_inst_insts(sam_word_t *inst, sam_uword_t insts)
+int sam_make_inst_insts(sam_word_t *inst, sam_uword_t set, sam_uword_t insts)
 {
     // FIXME: error if too many bits
-    *inst = SAM_INSTS_TAG | (insts << SAM_INSTS_SHIFT);
+    *inst = SAM_INSTS_TAG | (set << SAM_INST_SET_SHIFT) | (insts << SAM_INSTS_SHIFT);
     return SAM_ERROR_OK;
 }
 
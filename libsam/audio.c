@@ -0,0 +1,289 @@
+// Software audio mixer.
+//
+// (c) Reuben Thomas 2026
+//
+// The package is distributed under the GNU Public License version 3, or,
+// at your option, any later version.
+//
+// THIS PROGRAM IS PROVIDED AS IS, WITH NO WARRANTY. USE IS AT THE USER’S
+// RISK.
+
+// Sounds are decoded once, when loaded, to stereo float samples at the
+// output rate. Playing a sound takes one of a fixed set of voices, so many
+// sounds can play at once without allocating memory. The voices are mixed
+// in SDL_mixer's music hook, applying each sound's volume, pan and speed,
+// together with the synthesiser's notes.
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL.h>
+#include <SDL_mixer.h>
+
+#include "sam.h"
+#include "private.h"
+#include "sdl_private.h"
+
+#define AUDIO_RATE 48000 // requested output rate, and rate when headless
+#define AUDIO_BUFFER_FRAMES 1024
+#define MAX_VOICES 32
+#define MIX_BLOCK_FRAMES 256
+
+typedef struct {
+    sam_audiofile_t *sound; // NULL if the voice is free
+    double pos; // position in frames
+    bool paused;
+    unsigned long started; // when the voice was started, for stealing
+} voice_t;
+
+static int rate = AUDIO_RATE;
+static bool device_open;
+static voice_t voices[MAX_VOICES];
+static unsigned long voices_started;
+static SDL_mutex *voices_lock; // held while voices are changed or mixed
+static float mix_buffer[MIX_BLOCK_FRAMES * 2];
+
+// Add `frames` frames of `voice` to `out`, advancing it. Returns false if
+// the sound has finished.
+static bool mix_voice(voice_t *voice, float *restrict out, unsigned frames)
+{
+    const sam_audiofile_t *sound = voice->sound;
+    const float *restrict samples = sound->samples;
+    float left = sound->volume * (sound->pan > 0 ? 1 - sound->pan : 1);
+    float right = sound->volume * (sound->pan < 0 ? 1 + sound->pan : 1);
+    double speed = sound->speed;
+    unsigned i = 0;
+
+    while (i < frames) {
+        if (voice->pos >= sound->frames) {
+            if (!sound->loop || sound->frames == 0)
+                return false;
+            voice->pos = fmod(voice->pos, (double)sound->frames);
+        }
+
+        unsigned long pos = (unsigned long)voice->pos;
+        if (speed == 1.0 && voice->pos == pos) {
+            // Normal speed: copy a run of samples, which vectorises.
+            unsigned n = frames - i;
+            if (n > sound->frames - pos)
+                n = sound->frames - pos;
+            const float *restrict src = samples + pos * 2;
+            float *restrict dst = out + i * 2;
+            for (unsigned j = 0; j < n; j++) {
+                dst[j * 2] += src[j * 2] * left;
+                dst[j * 2 + 1] += src[j * 2 + 1] * right;
+            }
+            i += n;
+            voice->pos += n;
+        } else {
+            // Other speeds: interpolate linearly between frames.
+            for (; i < frames && voice->pos < sound->frames; i++) {
+                unsigned long p0 = (unsigned long)voice->pos;
+                unsigned long p1 = p0 + 1 < sound->frames ? p0 + 1 : (sound->loop ? 0 : p0);
+                float t = (float)(voice->pos - p0);
+                out[i * 2] += (samples[p0 * 2] + (samples[p1 * 2] - samples[p0 * 2]) * t) * left;
+                out[i * 2 + 1] += (samples[p0 * 2 + 1] + (samples[p1 * 2 + 1] - samples[p0 * 2 + 1]) * t) * right;
+                voice->pos += speed;
+            }
+        }
+    }
+    return true;
+}
+
+static void mix_audio(void *udata, Uint8 *stream, int len)
+{
+    (void)udata;
+    Sint16 *out = (Sint16 *)stream;
+    unsigned frames = len / (2 * sizeof(Sint16));
+
+    SDL_LockMutex(voices_lock);
+    while (frames > 0) {
+        unsigned n = frames < MIX_BLOCK_FRAMES ? frames : MIX_BLOCK_FRAMES;
+        memset(mix_buffer, 0, n * 2 * sizeof(float));
+        for (unsigned v = 0; v < MAX_VOICES; v++) {
+            voice_t *voice = &voices[v];
+            if (voice->sound != NULL && !voice->paused && !mix_voice(voice, mix_buffer, n))
+                voice->sound = NULL;
+        }
+        sam_synth_render(mix_buffer, n);
+        for (unsigned i = 0; i < n * 2; i++) {
+            float x = mix_buffer[i] * 32767.0f;
+            out[i] = x > 32767.0f ? 32767 : (x < -32768.0f ? -32768 : (Sint16)x);
+        }
+        out += n * 2;
+        frames -= n;
+    }
+    SDL_UnlockMutex(voices_lock);
+}
+
+int sam_audio_init(bool open_device)
+{
+    voices_lock = SDL_CreateMutex();
+    if (voices_lock == NULL)
+        return SAM_ERROR_NO_MEMORY;
+    if (!open_device)
+        return SAM_ERROR_OK;
+
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0)
+        return SAM_ERROR_TRAP_INIT;
+    Mix_Init(0);
+    if (Mix_OpenAudioDevice(AUDIO_RATE, AUDIO_S16SYS, 2, AUDIO_BUFFER_FRAMES, NULL, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE) != 0)
+        return SAM_ERROR_TRAP_INIT;
+    Uint16 format;
+    int channels;
+    Mix_QuerySpec(&rate, &format, &channels);
+    sam_synth_init(rate);
+    Mix_HookMusic(mix_audio, NULL);
+    device_open = true;
+    return SAM_ERROR_OK;
+}
+
+// Return true if a sound that will finish is playing.
+static bool finite_sound_playing(void)
+{
+    bool playing = false;
+    SDL_LockMutex(voices_lock);
+    for (unsigned v = 0; v < MAX_VOICES; v++)
+        if (voices[v].sound != NULL && !voices[v].paused && !voices[v].sound->loop)
+            playing = true;
+    SDL_UnlockMutex(voices_lock);
+    return playing;
+}
+
+void sam_audio_finish(void)
+{
+    if (device_open) {
+        // Wait for sounds playing to finish
+        while (finite_sound_playing())
+            SDL_Delay(100);
+        Mix_HookMusic(NULL, NULL);
+        Mix_CloseAudio();
+        device_open = false;
+    }
+    SDL_DestroyMutex(voices_lock);
+    voices_lock = NULL;
+}
+
+int sam_audio_decode(const unsigned char *mem, size_t size, sam_audiofile_t *sound)
+{
+    SDL_AudioSpec spec;
+    Uint8 *wav;
+    Uint32 wav_len;
+    if (SDL_LoadWAV_RW(SDL_RWFromConstMem(mem, (int)size), 1, &spec, &wav, &wav_len) == NULL)
+        return SAM_ERROR_TRAP_INIT;
+
+    SDL_AudioCVT cvt;
+    int error = SAM_ERROR_OK;
+    if (SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq, AUDIO_F32SYS, 2, rate) < 0)
+        error = SAM_ERROR_TRAP_INIT;
+    else {
+        cvt.len = wav_len;
+        cvt.buf = malloc((size_t)wav_len * cvt.len_mult);
+        if (cvt.buf == NULL)
+            error = SAM_ERROR_NO_MEMORY;
+        else {
+            memcpy(cvt.buf, wav, wav_len);
+            if (SDL_ConvertAudio(&cvt) != 0) {
+                free(cvt.buf);
+                error = SAM_ERROR_TRAP_INIT;
+            }
+        }
+    }
+    SDL_FreeWAV(wav);
+    if (error != SAM_ERROR_OK)
+        return error;
+
+    sound->samples = (float *)cvt.buf;
+    sound->frames = cvt.len_cvt / (2 * sizeof(float));
+    sound->volume = 1.0f;
+    sound->pan = 0.0f;
+    sound->speed = 1.0;
+    sound->cue = 0;
+    sound->loop = false;
+    return SAM_ERROR_OK;
+}
+
+double sam_audio_rate(void)
+{
+    return rate;
+}
+
+void sam_audio_play(sam_audiofile_t *sound)
+{
+    if (!device_open)
+        return;
+    SDL_LockMutex(voices_lock);
+    // Resume the sound if it is paused.
+    bool resumed = false;
+    for (unsigned v = 0; v < MAX_VOICES; v++)
+        if (voices[v].sound == sound && voices[v].paused) {
+            voices[v].paused = false;
+            resumed = true;
+        }
+    if (!resumed) {
+        // Take a free voice, or the one that has been playing longest.
+        voice_t *voice = &voices[0];
+        for (unsigned v = 0; v < MAX_VOICES; v++) {
+            if (voices[v].sound == NULL) {
+                voice = &voices[v];
+                break;
+            }
+            if (voices[v].started < voice->started)
+                voice = &voices[v];
+        }
+        voice->sound = sound;
+        voice->pos = sound->cue;
+        voice->paused = false;
+        voice->started = ++voices_started;
+    }
+    SDL_UnlockMutex(voices_lock);
+}
+
+void sam_audio_pause(sam_audiofile_t *sound)
+{
+    if (!device_open)
+        return;
+    SDL_LockMutex(voices_lock);
+    for (unsigned v = 0; v < MAX_VOICES; v++)
+        if (voices[v].sound == sound)
+            voices[v].paused = true;
+    SDL_UnlockMutex(voices_lock);
+}
+
+void sam_audio_jump(sam_audiofile_t *sound, unsigned long frame)
+{
+    if (!device_open)
+        return;
+    SDL_LockMutex(voices_lock);
+    for (unsigned v = 0; v < MAX_VOICES; v++)
+        if (voices[v].sound == sound)
+            voices[v].pos = frame;
+    SDL_UnlockMutex(voices_lock);
+}
+
+bool sam_audio_is_playing(sam_audiofile_t *sound)
+{
+    bool playing = false;
+    if (!device_open)
+        return false;
+    SDL_LockMutex(voices_lock);
+    for (unsigned v = 0; v < MAX_VOICES; v++)
+        if (voices[v].sound == sound && !voices[v].paused)
+            playing = true;
+    SDL_UnlockMutex(voices_lock);
+    return playing;
+}
+
+// Lock the mixer while changing the parameters of a sound that may be
+// playing.
+void sam_audio_lock(void)
+{
+    SDL_LockMutex(voices_lock);
+}
+
+void sam_audio_unlock(void)
+{
+    SDL_UnlockMutex(voices_lock);
+}
@@ -18,7 +18,6 @@
 
 #include "sam.h"
 #include "sam_opcodes.h"
-#include "sam_sdl.h"
 
 #include "private.h"
 #include "traps_basic.h"
@@ -330,12 +329,21 @@ char *disas(sam_word_t inst)
         xasprintf(&text, "trap %s", trap_name(function));
     } else if ((inst & SAM_INSTS_TAG_MASK) == SAM_INSTS_TAG) {
         sam_uword_t opcodes = (sam_uword_t)inst >> SAM_INSTS_SHIFT;
+        sam_uword_t set = (inst & SAM_INST_SET_MASK) >> SAM_INST_SET_SHIFT;
         do {
             sam_word_t opcode = opcodes & SAM_INST_MASK;
+            // Show the type of typed arithmetic and comparison instructions
+            const char *type = "";
+            if (opcode == INST_NEG || opcode == INST_ADD || opcode == INST_MUL || opcode == INST_LT) {
+                if (set == SAM_INST_SET_INT)
+                    type = "_int";
+                else if (set == SAM_INST_SET_FLOAT)
+                    type = "_float";
+            }
             if (text == NULL)
-                xasprintf(&text, "%s", inst_name(opcode));
+                xasprintf(&text, "%s%s", inst_name(opcode), type);
             else
-                xasprintf(&text, "%s %s", text, inst_name(opcode));
+                xasprintf(&text, "%s %s%s", text, inst_name(opcode), type);
             opcodes >>= SAM_ONE_INST_SHIFT;
         } while (opcodes != 0);
     } else if ((inst & SAM_BLOB_TAG_MASK) == SAM_BLOB_TAG) {
@@ -396,30 +404,4 @@ void sam_print_working_stack(sam_blob_t *blob)
     free(text);
 }
 
-/* Dump screen as a PBM */
-void sam_dump_screen(const char *filename)
-{
-    FILE *fp = fopen(filename, "w");
-    if (fp == NULL)
-        debug("could not open file %s\n", filename);
-    else {
-        fprintf(fp, "P3\n");
-        fprintf(fp, "# SAM screen dump\n");
-        fprintf(fp, "%u %u 255\n", sam_display_width, sam_display_height);
-        for (size_t j = 0; j < sam_display_height; j++) {
-            for (size_t i = 0; i < sam_display_width; i++) {
-                uint32_t p = sam_getpixel(i, j);
-                uint8_t r = p & 0xff;
-                uint8_t g = (p >> 8) & 0xff;
-                uint8_t b = (p >> 16) & 0xff;
-                fprintf(fp, "%d %d %d", r, g, b);
-                if (i < sam_display_width - 1)
-                    fprintf(fp, "  ");
-            }
-            fprintf(fp, "\n");
-        }
-        fclose(fp);
-    }
-}
-
 #endif
@@ -8,6 +8,8 @@
 // THIS PROGRAM IS PROVIDED AS IS, WITH NO WARRANTY. USE IS AT THE USER’S
 // RISK.
 
+#include <stdbool.h>
+
 #include "sam.h"
 
 // Structs
@@ -16,10 +18,16 @@ typedef struct sam_blob {
     _Alignas(max_align_t) sam_word_t data[];
 } sam_blob_t;
 
+typedef struct sam_translation sam_translation_t;
+
 typedef struct sam_array {
     sam_word_t *data;
     sam_uword_t size; // Size of stack in words
     sam_uword_t sp; // Number of words in stack
+    bool verified; // Code checked by the verifier; cleared when the array changes
+    sam_uword_t runs; // Number of words of verified code run, to find hot code
+    sam_translation_t *translation; // Translation of hot verified code, or NULL
+    sam_native_t native; // Code compiled to C, or NULL
 } sam_array_t;
 
 typedef struct sam_closure {
@@ -45,6 +53,7 @@ typedef struct sam_state {
     sam_blob_t *s0;
     sam_blob_t *p0;
     sam_uword_t pc;
+    bool checked; // Unverified code has run, so all code is fully checked
 } sam_state_t;
 
 // Errors
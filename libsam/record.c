@@ -0,0 +1,188 @@
+// Record the frames shown on the screen.
+//
+// (c) Reuben Thomas 2026
+//
+// The package is distributed under the GNU Public License version 3, or,
+// at your option, any later version.
+//
+// THIS PROGRAM IS PROVIDED AS IS, WITH NO WARRANTY. USE IS AT THE USER’S
+// RISK.
+
+// Frames are written by a background thread, which takes them from a small
+// queue. The VM only waits if the queue is full.
+//
+// A raw recording is a sequence of RGBA frames with no header, suitable
+// for e.g. `ffmpeg -f rawvideo -pix_fmt rgba -s WIDTHxHEIGHT`.
+//
+// A delta recording starts with the line "SAMDELTA WIDTH HEIGHT\n". Each
+// frame is then a 32-bit little-endian count of changed rows, followed by
+// that many rows, each a 32-bit little-endian row number followed by the
+// row's RGBA pixels. Rows are compared with the previous frame, which is
+// all zeros before the first frame.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL.h>
+
+#include "sam.h"
+#include "private.h"
+#include "sdl_private.h"
+
+#define QUEUE_LENGTH 4
+
+static FILE *fp;
+static bool delta;
+static unsigned width, height;
+static size_t row_size, frame_size;
+static uint8_t *frames[QUEUE_LENGTH];
+static uint8_t *previous; // last frame written, for delta encoding
+static unsigned first, count; // queued frames are frames[first .. first + count - 1]
+static bool quit;
+static bool write_error;
+static SDL_mutex *lock;
+static SDL_cond *queue_changed;
+static SDL_Thread *writer;
+
+static void write_u32(uint32_t n)
+{
+    uint8_t bytes[4] = {n & 0xff, (n >> 8) & 0xff, (n >> 16) & 0xff, n >> 24};
+    if (fwrite(bytes, 1, sizeof(bytes), fp) != sizeof(bytes))
+        write_error = true;
+}
+
+static void write_frame(const uint8_t *frame)
+{
+    if (!delta) {
+        if (fwrite(frame, 1, frame_size, fp) != frame_size)
+            write_error = true;
+        return;
+    }
+
+    uint32_t changed = 0;
+    for (unsigned y = 0; y < height; y++)
+        if (memcmp(frame + y * row_size, previous + y * row_size, row_size) != 0)
+            changed++;
+    write_u32(changed);
+    for (unsigned y = 0; y < height && !write_error; y++) {
+        const uint8_t *row = frame + y * row_size;
+        if (memcmp(row, previous + y * row_size, row_size) != 0) {
+            write_u32(y);
+            if (fwrite(row, 1, row_size, fp) != row_size)
+                write_error = true;
+        }
+    }
+    memcpy(previous, frame, frame_size);
+}
+
+static int writer_loop(void *data)
+{
+    (void)data;
+    SDL_LockMutex(lock);
+    for (;;) {
+        while (count == 0 && !quit)
+            SDL_CondWait(queue_changed, lock);
+        if (count == 0)
+            break;
+
+        // Write the frame without holding the lock; the VM does not touch
+        // queued frames.
+        uint8_t *frame = frames[first];
+        SDL_UnlockMutex(lock);
+        if (!write_error)
+            write_frame(frame);
+        SDL_LockMutex(lock);
+
+        first = (first + 1) % QUEUE_LENGTH;
+        count--;
+        SDL_CondSignal(queue_changed);
+    }
+    SDL_UnlockMutex(lock);
+    return 0;
+}
+
+// Free the buffers, file and locks of a recording.
+static void free_recording(void)
+{
+    if (fp != NULL && fclose(fp) != 0)
+        write_error = true;
+    fp = NULL;
+    for (unsigned i = 0; i < QUEUE_LENGTH; i++) {
+        free(frames[i]);
+        frames[i] = NULL;
+    }
+    free(previous);
+    previous = NULL;
+    SDL_DestroyCond(queue_changed);
+    queue_changed = NULL;
+    SDL_DestroyMutex(lock);
+    lock = NULL;
+}
+
+int sam_record_start(const char *filename, bool delta_rows, unsigned w, unsigned h)
+{
+    int error = SAM_ERROR_OK;
+    delta = delta_rows;
+    width = w;
+    height = h;
+    row_size = (size_t)width * 4;
+    frame_size = row_size * height;
+    for (unsigned i = 0; i < QUEUE_LENGTH; i++)
+        if ((frames[i] = malloc(frame_size)) == NULL)
+            HALT(SAM_ERROR_NO_MEMORY);
+    if (delta && (previous = calloc(1, frame_size)) == NULL)
+        HALT(SAM_ERROR_NO_MEMORY);
+
+    fp = fopen(filename, "wb");
+    if (fp == NULL)
+        HALT(SAM_ERROR_TRAP_INIT);
+    if (delta)
+        fprintf(fp, "SAMDELTA %u %u\n", width, height);
+
+    lock = SDL_CreateMutex();
+    queue_changed = SDL_CreateCond();
+    if (lock == NULL || queue_changed == NULL)
+        HALT(SAM_ERROR_NO_MEMORY);
+    writer = SDL_CreateThread(writer_loop, "sam-record", NULL);
+    if (writer == NULL)
+        HALT(SAM_ERROR_TRAP_INIT);
+
+error:
+    if (error != SAM_ERROR_OK)
+        free_recording();
+    return error;
+}
+
+uint8_t *sam_record_begin_frame(void)
+{
+    SDL_LockMutex(lock);
+    while (count == QUEUE_LENGTH)
+        SDL_CondWait(queue_changed, lock);
+    uint8_t *frame = frames[(first + count) % QUEUE_LENGTH];
+    SDL_UnlockMutex(lock);
+    return frame;
+}
+
+void sam_record_end_frame(void)
+{
+    SDL_LockMutex(lock);
+    count++;
+    SDL_CondSignal(queue_changed);
+    SDL_UnlockMutex(lock);
+}
+
+int sam_record_finish(void)
+{
+    if (writer != NULL) {
+        SDL_LockMutex(lock);
+        quit = true;
+        SDL_CondSignal(queue_changed);
+        SDL_UnlockMutex(lock);
+        SDL_WaitThread(writer, NULL);
+        writer = NULL;
+    }
+    free_recording();
+    return write_error ? -1 : 0;
+}
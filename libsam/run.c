@@ -61,30 +61,723 @@ const int SAM_ONE_INST_SHIFT = 5;
 const sam_word_t SAM_TRAP_BASE_MASK = ~0xff;
 
 // Trap dispatcher
-static sam_word_t sam_trap(sam_state_t *state, sam_uword_t function)
+typedef sam_word_t (*trap_function_t)(sam_state_t *state, sam_uword_t function);
+
+static trap_function_t trap_function(sam_uword_t function)
 {
     switch (function & SAM_TRAP_BASE_MASK) {
     case SAM_TRAP_BASIC_BASE:
-        return sam_basic_trap(state, function);
+        return sam_basic_trap;
     case SAM_TRAP_MATH_BASE:
-        return sam_math_trap(state, function);
+        return sam_math_trap;
     case SAM_TRAP_GRAPHICS_BASE:
-        return sam_graphics_trap(state, function);
+        return sam_graphics_trap;
     case SAM_TRAP_STRING_BASE:
-        return sam_string_trap(state, function);
+        return sam_string_trap;
     case SAM_TRAP_INPUT_BASE:
-        return sam_input_trap(state, function);
+        return sam_input_trap;
     case SAM_TRAP_AUDIO_BASE:
-        return sam_audio_trap(state, function);
+        return sam_audio_trap;
     default:
+        return NULL;
+    }
+}
+
+sam_word_t sam_trap(sam_state_t *state, sam_uword_t function)
+{
+    trap_function_t trap = trap_function(function);
+    if (trap == NULL)
         return SAM_ERROR_INVALID_TRAP;
+    return trap(state, function);
+}
+
+// Run NEG, ADD, MUL or LT on operands that the instruction set says are
+// all integers or all floats, checking their types together. Return false
+// if they are not of that type, so that the generic instruction is run.
+static inline bool run_typed(sam_array_t *s, sam_uword_t set, sam_word_t opcode)
+{
+    sam_uword_t nargs = opcode == INST_NEG ? 1 : 2;
+    if (s->sp < nargs)
+        return false;
+    sam_word_t *x = &s->data[s->sp - nargs], *y = &s->data[s->sp - 1];
+
+    if (set == SAM_INST_SET_INT) {
+        if ((*x & SAM_INT_TAG_MASK) != SAM_INT_TAG || (*y & SAM_INT_TAG_MASK) != SAM_INT_TAG)
+            return false;
+        sam_uword_t a = LRSHIFT(*x, SAM_INT_SHIFT), b = LRSHIFT(*y, SAM_INT_SHIFT);
+        switch (opcode) {
+        case INST_NEG:
+            *x = SAM_INT_TAG | LSHIFT(-a, SAM_INT_SHIFT);
+            return true;
+        case INST_ADD:
+            *x = SAM_INT_TAG | LSHIFT(a + b, SAM_INT_SHIFT);
+            break;
+        case INST_MUL:
+            *x = SAM_INT_TAG | LSHIFT(a * b, SAM_INT_SHIFT);
+            break;
+        case INST_LT:
+            *x = SAM_VALUE_BOOL(ARSHIFT(*x, SAM_INT_SHIFT) < ARSHIFT(*y, SAM_INT_SHIFT));
+            break;
+        default:
+            return false;
+        }
+    } else if (set == SAM_INST_SET_FLOAT) {
+        if ((*x & SAM_FLOAT_TAG_MASK) != SAM_FLOAT_TAG || (*y & SAM_FLOAT_TAG_MASK) != SAM_FLOAT_TAG)
+            return false;
+        sam_float_t a = *(sam_float_t *)x, b = *(sam_float_t *)y;
+        switch (opcode) {
+        case INST_NEG:
+            sam_make_inst_float(x, -a);
+            return true;
+        case INST_ADD:
+            sam_make_inst_float(x, a + b);
+            break;
+        case INST_MUL:
+            sam_make_inst_float(x, a * b);
+            break;
+        case INST_LT:
+            *x = SAM_VALUE_BOOL(a < b);
+            break;
+        default:
+            return false;
+        }
+    } else
+        return false;
+    s->sp--;
+    return true;
+}
+
+#define s ((sam_array_t *)state->s0->data)
+
+// In verified code, pop stack items without checking.
+#undef POP_WORD
+#define POP_WORD(ptr)                                                   \
+    do {                                                                \
+        if (unchecked)                                                  \
+            *(ptr) = s->data[--s->sp];                                  \
+        else                                                            \
+            HALT_IF_ERROR(sam_array_pop(state->s0, (sam_word_t *)(ptr))); \
+    } while (0)
+
+// Run the instructions in the instruction word `ir`.
+static sam_word_t run_insts(sam_state_t *state, sam_uword_t ir, bool unchecked)
+{
+    sam_word_t error = SAM_ERROR_OK;
+    sam_uword_t set = (ir & SAM_INST_SET_MASK) >> SAM_INST_SET_SHIFT;
+    for (sam_uword_t opcodes = (sam_uword_t)ir >> SAM_INSTS_SHIFT; opcodes != 0; ) {
+        sam_word_t opcode = opcodes & SAM_INST_MASK;
+#ifdef SAM_DEBUG
+        debug("%s\n", inst_name(opcode));
+#endif
+        switch (opcode) {
+        case INST_NOP:
+            break;
+        case INST_NEW:
+            {
+                sam_blob_t *stack;
+                HALT_IF_ERROR(sam_array_new(&stack));
+                sam_word_t inst;
+                HALT_IF_ERROR(sam_make_inst_blob(&inst, stack));
+                HALT_IF_ERROR(sam_array_push(state->s0, inst));
+            }
+            break;
+        case INST_S0:
+            {
+                sam_word_t inst;
+                HALT_IF_ERROR(sam_make_inst_blob(&inst, state->s0));
+                HALT_IF_ERROR(sam_array_push(state->s0, inst));
+            }
+            break;
+        case INST_DROP:
+            if (s->sp < 1)
+                HALT(SAM_ERROR_ARRAY_UNDERFLOW);
+            s->sp -= 1;
+            break;
+        case INST_SGET:
+            {
+                sam_word_t pos;
+                POP_INT(pos);
+                sam_uword_t addr, item;
+                HALT_IF_ERROR(sam_array_item(state->s0, pos, &addr));
+                HALT_IF_ERROR(sam_array_peek(state->s0, addr, &item));
+                PUSH_WORD(item);
+            }
+            break;
+        case INST_SSET:
+            {
+                sam_word_t pos, val;
+                POP_INT(pos);
+                sam_uword_t dest;
+                HALT_IF_ERROR(sam_array_item(state->s0, pos, &dest));
+                POP_WORD(&val);
+                HALT_IF_ERROR(sam_array_poke(state->s0, dest, val));
+            }
+            break;
+        case INST_DUP:
+            {
+                sam_word_t a;
+                POP_WORD(&a);
+                PUSH_WORD(a);
+                PUSH_WORD(a);
+            }
+            break;
+        case INST_SWAP:
+            {
+                sam_word_t a, b;
+                POP_WORD(&a);
+                POP_WORD(&b);
+                PUSH_WORD(a);
+                PUSH_WORD(b);
+            }
+            break;
+        case INST_OVER:
+            {
+                sam_uword_t addr, item;
+                HALT_IF_ERROR(sam_array_item(state->s0, -2, &addr));
+                HALT_IF_ERROR(sam_array_peek(state->s0, addr, &item));
+                PUSH_WORD(item);
+            }
+            break;
+        case INST_GET:
+            {
+                sam_blob_t *blob;
+                POP_BLOB(blob);
+                switch (blob->type) {
+                case SAM_BLOB_ARRAY:
+                    {
+                        sam_word_t pos;
+                        POP_INT(pos);
+                        sam_uword_t addr, item;
+                        HALT_IF_ERROR(sam_array_item(blob, pos, &addr));
+                        HALT_IF_ERROR(sam_array_peek(blob, addr, &item));
+                        HALT_IF_ERROR(sam_array_push(state->s0, item));
+                    }
+                    break;
+                case SAM_BLOB_MAP:
+                    {
+                        sam_word_t key, val;
+                        POP_WORD(&key);
+                        HALT_IF_ERROR(sam_map_get(blob, key, &val));
+                        HALT_IF_ERROR(sam_array_push(state->s0, val));
+                    }
+                    break;
+                }
+            }
+            break;
+        case INST_SET:
+            {
+                sam_blob_t *blob;
+                POP_BLOB(blob);
+                switch (blob->type) {
+                case SAM_BLOB_ARRAY:
+                    {
+                        sam_word_t pos, val;
+                        POP_INT(pos);
+                        sam_uword_t dest;
+                        HALT_IF_ERROR(sam_array_item(blob, pos, &dest));
+                        POP_WORD(&val);
+                        HALT_IF_ERROR(sam_array_poke(blob, dest, val));
+                    }
+                    break;
+                case SAM_BLOB_MAP:
+                    {
+                        sam_word_t key, val;
+                        POP_WORD(&key);
+                        POP_WORD(&val);
+                        HALT_IF_ERROR(sam_map_set(blob, key, val));
+                    }
+                    break;
+                }
+            }
+            break;
+        case INST_EXTRACT:
+            {
+                sam_blob_t *blob;
+                POP_BLOB(blob);
+                sam_word_t pos;
+                POP_INT(pos);
+                sam_uword_t addr;
+                HALT_IF_ERROR(sam_array_item(blob, pos, &addr));
+                HALT_IF_ERROR(sam_array_extract(blob, addr));
+            }
+            break;
+        case INST_INSERT:
+            {
+                sam_blob_t *blob;
+                POP_BLOB(blob);
+                sam_word_t pos;
+                POP_INT(pos);
+                sam_uword_t addr;
+                HALT_IF_ERROR(sam_array_item(blob, pos, &addr));
+                HALT_IF_ERROR(sam_array_insert(blob, addr));
+            }
+            break;
+        case INST_POP:
+            {
+                sam_blob_t *blob;
+                POP_BLOB(blob);
+                sam_array_t *stack;
+                EXTRACT_BLOB(blob, SAM_BLOB_ARRAY, sam_array_t, stack);
+                if (stack->sp < 1)
+                    HALT(SAM_ERROR_ARRAY_UNDERFLOW);
+                sam_word_t val;
+                HALT_IF_ERROR(sam_array_pop(blob, &val));
+                PUSH_WORD(val);
+            }
+            break;
+        case INST_SHIFT:
+            {
+                sam_blob_t *blob;
+                POP_BLOB(blob);
+                sam_array_t *stack;
+                EXTRACT_BLOB(blob, SAM_BLOB_ARRAY, sam_array_t, stack);
+                if (stack->sp < 1)
+                    HALT(SAM_ERROR_ARRAY_UNDERFLOW);
+                sam_word_t val;
+                HALT_IF_ERROR(sam_array_shift(blob, &val));
+                PUSH_WORD(val);
+            }
+            break;
+        case INST_APPEND:
+            {
+                sam_blob_t *stack;
+                POP_BLOB(stack);
+                sam_word_t val;
+                POP_WORD(&val);
+                HALT_IF_ERROR(sam_array_push(stack, val));
+            }
+            break;
+        case INST_PREPEND:
+            {
+                sam_blob_t *stack;
+                POP_BLOB(stack);
+                sam_word_t val;
+                POP_WORD(&val);
+                HALT_IF_ERROR(sam_array_prepend(stack, val));
+            }
+            break;
+        case INST_RESUME:
+            {
+                sam_blob_t *blob, *frame;
+                POP_BLOB(frame);
+                sam_word_t inst;
+                HALT_IF_ERROR(sam_array_pop(frame, &inst));
+                sam_uword_t new_pc;
+                EXTRACT_INSN(inst, SAM_INT_TAG, SAM_INT_TAG_MASK, LRSHIFT, SAM_INT_SHIFT);
+                new_pc = (sam_uword_t)inst;
+                HALT_IF_ERROR(sam_make_inst_blob(&inst, state->s0));
+                HALT_IF_ERROR(sam_array_push(frame, inst));
+                HALT_IF_ERROR(sam_make_inst_blob(&inst, state->p0));
+                HALT_IF_ERROR(sam_array_push(frame, inst));
+                POP_BLOB(blob);
+                sam_closure_t *cl;
+                EXTRACT_BLOB(blob, SAM_BLOB_CLOSURE, sam_closure_t, cl);
+                HALT_IF_ERROR(sam_make_inst_blob(&inst, cl->context));
+                HALT_IF_ERROR(sam_array_push(frame, inst));
+                sam_uword_t nargs;
+                POP_UINT(nargs);
+                for (sam_uword_t i = nargs; i > 0; i--) {
+                    sam_uword_t val;
+                    HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - i, &val));
+                    HALT_IF_ERROR(sam_array_push(frame, val));
+                }
+                sam_word_t val;
+                for (sam_uword_t i = 0; i < nargs; i++)
+                    POP_WORD(&val);
+                PUSH_INT(state->pc);
+                state->s0 = frame;
+                state->p0 = cl->code;
+                state->pc = new_pc;
+                opcodes = 0;
+            }
+            break;
+        case INST_NOT:
+            {
+                sam_uword_t operand;
+                sam_word_t a;
+                HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
+                if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
+                    POP_INT(a);
+                    PUSH_INT(~a);
+                } else {
+                    POP_BOOL(a);
+                    PUSH_BOOL(!a);
+                }
+            }
+            break;
+        case INST_AND:
+            {
+                sam_uword_t operand;
+                sam_word_t a, b;
+                HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
+                if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
+                    POP_INT(b);
+                    POP_INT(a);
+                    PUSH_INT(a & b);
+                } else {
+                    POP_BOOL(b);
+                    POP_BOOL(a);
+                    PUSH_BOOL(a & b);
+                }
+            }
+            break;
+        case INST_OR:
+            {
+                sam_uword_t operand;
+                sam_word_t a, b;
+                HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
+                if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
+                    POP_INT(b);
+                    POP_INT(a);
+                    PUSH_INT(a | b);
+                } else {
+                    POP_BOOL(b);
+                    POP_BOOL(a);
+                    PUSH_BOOL(a | b);
+                }
+            }
+            break;
+        case INST_XOR:
+            {
+                sam_uword_t operand;
+                sam_word_t a, b;
+                HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
+                if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
+                    POP_INT(b);
+                    POP_INT(a);
+                    PUSH_INT(a ^ b);
+                } else {
+                    POP_BOOL(b);
+                    POP_BOOL(a);
+                    PUSH_BOOL(a ^ b);
+                }
+            }
+            break;
+        case INST_EQ:
+            {
+                sam_word_t x, y;
+                POP_WORD(&y);
+                POP_WORD(&x);
+                PUSH_BOOL(x == y);
+            }
+            break;
+        case INST_LT:
+            {
+                if (set != SAM_INST_SET_ANY && run_typed(s, set, opcode))
+                    break;
+                sam_uword_t operand;
+                HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
+                if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
+                    sam_word_t a, b;
+                    POP_INT(b);
+                    POP_INT(a);
+                    PUSH_BOOL(a < b);
+                } else if ((operand & SAM_FLOAT_TAG_MASK) == SAM_FLOAT_TAG) {
+                    sam_float_t a, b;
+                    POP_FLOAT(b);
+                    POP_FLOAT(a);
+                    PUSH_BOOL(a < b);
+                } else
+                    HALT(SAM_ERROR_WRONG_TYPE);
+            }
+            break;
+        case INST_NEG:
+            {
+                if (set != SAM_INST_SET_ANY && run_typed(s, set, opcode))
+                    break;
+                sam_uword_t operand;
+                HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
+                if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
+                    sam_uword_t a;
+                    POP_UINT(a);
+                    PUSH_INT(-a);
+                } else if ((operand & SAM_FLOAT_TAG_MASK) == SAM_FLOAT_TAG) {
+                    sam_float_t a;
+                    POP_FLOAT(a);
+                    PUSH_FLOAT(-a);
+                } else
+                    HALT(SAM_ERROR_WRONG_TYPE);
+            }
+            break;
+        case INST_ADD:
+            {
+                if (set != SAM_INST_SET_ANY && run_typed(s, set, opcode))
+                    break;
+                sam_uword_t operand;
+                HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
+                if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
+                    sam_uword_t a, b;
+                    POP_UINT(b);
+                    POP_UINT(a);
+                    PUSH_INT((sam_word_t)(a + b));
+                } else if ((operand & SAM_FLOAT_TAG_MASK) == SAM_FLOAT_TAG) {
+                    sam_float_t a, b;
+                    POP_FLOAT(b);
+                    POP_FLOAT(a);
+                    PUSH_FLOAT(a + b);
+                } else
+                    HALT(SAM_ERROR_WRONG_TYPE);
+            }
+            break;
+        case INST_MUL:
+            {
+                if (set != SAM_INST_SET_ANY && run_typed(s, set, opcode))
+                    break;
+                sam_uword_t operand;
+                HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
+                if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
+                    sam_uword_t a, b;
+                    POP_UINT(b);
+                    POP_UINT(a);
+                    PUSH_INT((sam_word_t)(a * b));
+                } else if ((operand & SAM_FLOAT_TAG_MASK) == SAM_FLOAT_TAG) {
+                    sam_float_t a, b;
+                    POP_FLOAT(b);
+                    POP_FLOAT(a);
+                    PUSH_FLOAT(a * b);
+                } else
+                    HALT(SAM_ERROR_WRONG_TYPE);
+            }
+            break;
+        case INST_0:
+            PUSH_INT(0);
+            break;
+        case INST_1:
+            PUSH_INT(1);
+            break;
+        case INST_MINUS_1:
+            PUSH_INT(-1);
+            break;
+        case INST_2:
+            PUSH_INT(2);
+            break;
+        case INST_MINUS_2:
+            PUSH_INT(-2);
+            break;
+        }
+
+        opcodes >>= SAM_ONE_INST_SHIFT;
+
+#ifdef SAM_DEBUG
+        if (opcodes != 0) {
+            debug("sam_run: p0 = %p, pc = %u, s0 = %p, sp = %u, ir = %x\n", state->p0, state->pc, s, s->sp, ir);
+            sam_print_working_stack(state->s0);
+        }
+#endif
+    }
+
+error:
+    return error;
+}
+
+sam_word_t sam_run_insts(sam_state_t *state, sam_uword_t ir)
+{
+    return run_insts(state, ir, !state->checked);
+}
+
+// Translation of hot code
+//
+// Verified code that runs often is translated into operations that are
+// decoded once, so that running it does not need to fetch and decode each
+// word. An integer followed by the SGET, SSET, JUMP, JUMP_IF_FALSE or COUNT
+// that uses it becomes one operation. Words that are not translated are
+// run by the interpreter. Changing the array discards its translation.
+
+#define HOT_RUNS 1000 // Words run before code is translated
+#define NO_OP ((sam_uword_t)-1)
+
+#ifdef SAM_DEBUG
+#define TRACING do_debug // Translated and compiled code do not trace each word
+#else
+#define TRACING false
+#endif
+
+enum {
+    OP_PUSH,
+    OP_SGET,
+    OP_SSET,
+    OP_JUMP,
+    OP_JUMP_IF_FALSE,
+    OP_COUNT,
+    OP_TRAP,
+    OP_INSTS,
+};
+
+typedef struct {
+    unsigned kind;
+    sam_uword_t next; // Word after those the operation was translated from
+    sam_word_t operand; // Value, stack address, jump destination or trap function
+    sam_uword_t ir; // Instructions, run after SGET or SSET
+    trap_function_t trap;
+} sam_op_t;
+
+struct sam_translation {
+    sam_uword_t length; // Number of words translated
+    sam_uword_t *ops_at; // Operation for each word, or NO_OP
+    sam_op_t ops[];
+};
+
+static sam_word_t translate(sam_array_t *code)
+{
+    sam_translation_t *t = malloc(sizeof(sam_translation_t) + code->sp * (sizeof(sam_op_t) + sizeof(sam_uword_t)));
+    if (t == NULL)
+        return SAM_ERROR_NO_MEMORY;
+    t->length = code->sp;
+    t->ops_at = (sam_uword_t *)&t->ops[code->sp];
+
+    sam_uword_t nops = 0;
+    for (sam_uword_t pc = 0; pc < code->sp; ) {
+        sam_op_t *op = &t->ops[nops];
+        sam_uword_t start = pc;
+        sam_word_t ir = code->data[pc++];
+        t->ops_at[start] = NO_OP;
+        if ((ir & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
+            op->kind = OP_PUSH;
+            op->operand = ir;
+            sam_word_t next = pc < code->sp ? code->data[pc] : 0;
+            sam_word_t n = ARSHIFT(ir, SAM_INT_SHIFT);
+            if ((next & SAM_INSTS_TAG_MASK) == SAM_INSTS_TAG) {
+                sam_uword_t opcodes = (sam_uword_t)next >> SAM_INSTS_SHIFT;
+                sam_uword_t opcode = opcodes & SAM_INST_MASK;
+                if (opcode == INST_SGET || opcode == INST_SSET) {
+                    op->kind = opcode == INST_SGET ? OP_SGET : OP_SSET;
+                    op->operand = n;
+                    opcodes >>= SAM_ONE_INST_SHIFT;
+                    op->ir = opcodes == 0 ? 0 : ((sam_uword_t)next & (((sam_uword_t)1 << SAM_INSTS_SHIFT) - 1)) | opcodes << SAM_INSTS_SHIFT;
+                    t->ops_at[pc++] = NO_OP;
+                }
+            } else if ((next & SAM_TRAP_TAG_MASK) == SAM_TRAP_TAG) {
+                switch ((sam_uword_t)next >> SAM_TRAP_FUNCTION_SHIFT) {
+                case TRAP_BASIC_JUMP:
+                    op->kind = OP_JUMP;
+                    break;
+                case TRAP_BASIC_JUMP_IF_FALSE:
+                    op->kind = OP_JUMP_IF_FALSE;
+                    break;
+                case TRAP_BASIC_COUNT:
+                    op->kind = OP_COUNT;
+                    break;
+                }
+                if (op->kind != OP_PUSH) {
+                    t->ops_at[pc++] = NO_OP;
+                    op->operand = pc + n;
+                }
+            }
+        } else if ((ir & SAM_BLOB_TAG_MASK) == SAM_BLOB_TAG || (ir & SAM_FLOAT_TAG_MASK) == SAM_FLOAT_TAG) {
+            op->kind = OP_PUSH;
+            op->operand = ir;
+        } else if ((ir & SAM_ATOM_TAG_MASK) == SAM_ATOM_TAG) {
+            sam_word_t atom_type = (ir & SAM_ATOM_TYPE_MASK) >> SAM_ATOM_TYPE_SHIFT;
+            if (atom_type != SAM_ATOM_NULL && atom_type != SAM_ATOM_BOOL)
+                continue;
+            op->kind = OP_PUSH;
+            op->operand = ir;
+        } else if ((ir & SAM_TRAP_TAG_MASK) == SAM_TRAP_TAG) {
+            op->operand = (sam_uword_t)ir >> SAM_TRAP_FUNCTION_SHIFT;
+            op->trap = trap_function(op->operand);
+            if (op->trap == NULL)
+                continue;
+            op->kind = OP_TRAP;
+        } else {
+            op->kind = OP_INSTS;
+            op->ir = ir;
+        }
+        op->next = pc;
+        t->ops_at[start] = nops++;
+    }
+
+    code->translation = t;
+    return SAM_ERROR_OK;
+}
+
+// Run translated code until control leaves it, reaches a word that was
+// not translated, or the code changes.
+static sam_word_t run_translation(sam_state_t *state, sam_translation_t *t, sam_uword_t *tick_count)
+{
+    sam_word_t error = SAM_ERROR_OK;
+    bool unchecked = true; // Only verified code is translated
+    sam_blob_t *code = state->p0;
+    sam_uword_t i = t->ops_at[state->pc];
+
+    for (;;) {
+        sam_op_t *op = &t->ops[i];
+        state->pc = op->next;
+        switch (op->kind) {
+        case OP_PUSH:
+            PUSH_WORD(op->operand);
+            break;
+        case OP_SGET:
+            {
+                sam_uword_t addr = op->operand < 0 ? s->sp + op->operand : (sam_uword_t)op->operand;
+                if (addr >= s->sp)
+                    HALT(SAM_ERROR_ARRAY_OVERFLOW);
+                PUSH_WORD(s->data[addr]);
+                if (op->ir != 0)
+                    HALT_IF_ERROR(run_insts(state, op->ir, unchecked));
+            }
+            break;
+        case OP_SSET:
+            {
+                sam_uword_t addr = op->operand < 0 ? s->sp + op->operand : (sam_uword_t)op->operand;
+                if (addr >= s->sp)
+                    HALT(SAM_ERROR_ARRAY_OVERFLOW);
+                sam_word_t val;
+                POP_WORD(&val);
+                s->data[addr] = val;
+                if (op->ir != 0)
+                    HALT_IF_ERROR(run_insts(state, op->ir, unchecked));
+            }
+            break;
+        case OP_JUMP:
+            state->pc = op->operand;
+            break;
+        case OP_JUMP_IF_FALSE:
+            {
+                sam_word_t flag;
+                POP_BOOL(flag);
+                if (!flag)
+                    state->pc = op->operand;
+            }
+            break;
+        case OP_COUNT:
+            {
+                if (s->sp < 3)
+                    HALT(SAM_ERROR_ARRAY_UNDERFLOW);
+                sam_word_t count, limit;
+                PEEK_INT(count, s->sp - 2);
+                PEEK_INT(limit, s->sp - 3);
+                if (++count < limit) {
+                    s->data[s->sp - 2] = SAM_INT_TAG | LSHIFT(count, SAM_INT_SHIFT);
+                    PUSH_INT(count);
+                } else
+                    state->pc = op->operand;
+            }
+            break;
+        case OP_TRAP:
+            HALT_IF_ERROR(op->trap(state, op->operand));
+            break;
+        case OP_INSTS:
+            HALT_IF_ERROR(run_insts(state, op->ir, unchecked));
+            break;
+        }
+
+        if ((++*tick_count & 0xff) == 0)
+            sam_sdl_poll();
+
+        // Stop if control has left the code, or the code has changed, which
+        // frees its translation.
+        if (state->p0 != code || ((sam_array_t *)code->data)->translation != t ||
+            state->pc >= t->length || (i = t->ops_at[state->pc]) == NO_OP)
+            break;
     }
+
+error:
+    return error;
 }
 
 // Execution function
 sam_word_t sam_run(sam_state_t *state)
 {
-#define s ((sam_array_t *)state->s0->data)
     sam_uword_t tick_count = 0;
     sam_word_t error = SAM_ERROR_OK;
     CHECK_BLOB(state->s0, SAM_BLOB_ARRAY);
@@ -92,11 +785,38 @@ sam_word_t sam_run(sam_state_t *state)
     for (;;) {
         sam_array_t *p0;
         EXTRACT_BLOB(state->p0, SAM_BLOB_ARRAY, sam_array_t, p0);
-        if (state->pc == p0->sp)
-            HALT(SAM_ERROR_ARRAY_OVERFLOW);
+
+        // Verified code cannot run off its end, or pop an item that it did
+        // not push. Once unverified code has run, it may have kept a
+        // reference to a stack and changed it, so everything is checked.
+        if (!p0->verified)
+            state->checked = true;
+        bool unchecked = !state->checked;
+
+        // Run compiled code, if any.
+        if (p0->native != NULL && !TRACING) {
+            HALT_IF_ERROR(p0->native(state));
+            continue;
+        }
+
+        // Translate hot verified code, and run the translation.
+        if (unchecked && !TRACING) {
+            if (p0->translation == NULL && ++p0->runs == HOT_RUNS)
+                HALT_IF_ERROR(translate(p0));
+            if (p0->translation != NULL && state->pc < p0->translation->length && p0->translation->ops_at[state->pc] != NO_OP) {
+                HALT_IF_ERROR(run_translation(state, p0->translation, &tick_count));
+                continue;
+            }
+        }
 
         sam_uword_t ir;
-        HALT_IF_ERROR(sam_array_peek(state->p0, state->pc++, &ir));
+        if (unchecked)
+            ir = p0->data[state->pc++];
+        else {
+            if (state->pc == p0->sp)
+                HALT(SAM_ERROR_ARRAY_OVERFLOW);
+            HALT_IF_ERROR(sam_array_peek(state->p0, state->pc++, &ir));
+        }
 #ifdef SAM_DEBUG
         debug("sam_run: p0 = %p, pc = %u, s0 = %p, sp = %u, ir = %x\n", state->p0, state->pc, s, s->sp, ir);
         sam_print_working_stack(state->s0);
@@ -142,405 +862,14 @@ sam_word_t sam_run(sam_state_t *state)
 #endif
             HALT_IF_ERROR(sam_trap(state, function));
         } else if ((ir & SAM_INSTS_TAG_MASK) == SAM_INSTS_TAG) {
-            for (sam_uword_t opcodes = (sam_uword_t)ir >> SAM_INSTS_SHIFT; opcodes != 0; ) {
-                sam_word_t opcode = opcodes & SAM_INST_MASK;
-#ifdef SAM_DEBUG
-                debug("%s\n", inst_name(opcode));
-#endif
-                switch (opcode) {
-                case INST_NOP:
-                    break;
-                case INST_NEW:
-                    {
-                        sam_blob_t *stack;
-                        HALT_IF_ERROR(sam_array_new(&stack));
-                        sam_word_t inst;
-                        HALT_IF_ERROR(sam_make_inst_blob(&inst, stack));
-                        HALT_IF_ERROR(sam_array_push(state->s0, inst));
-                    }
-                    break;
-                case INST_S0:
-                    {
-                        sam_word_t inst;
-                        HALT_IF_ERROR(sam_make_inst_blob(&inst, state->s0));
-                        HALT_IF_ERROR(sam_array_push(state->s0, inst));
-                    }
-                    break;
-                case INST_DROP:
-                    if (s->sp < 1)
-                        HALT(SAM_ERROR_ARRAY_UNDERFLOW);
-                    s->sp -= 1;
-                    break;
-                case INST_SGET:
-                    {
-                        sam_word_t pos;
-                        POP_INT(pos);
-                        sam_uword_t addr, item;
-                        HALT_IF_ERROR(sam_array_item(state->s0, pos, &addr));
-                        HALT_IF_ERROR(sam_array_peek(state->s0, addr, &item));
-                        PUSH_WORD(item);
-                    }
-                    break;
-                case INST_SSET:
-                    {
-                        sam_word_t pos, val;
-                        POP_INT(pos);
-                        sam_uword_t dest;
-                        HALT_IF_ERROR(sam_array_item(state->s0, pos, &dest));
-                        POP_WORD(&val);
-                        HALT_IF_ERROR(sam_array_poke(state->s0, dest, val));
-                    }
-                    break;
-                case INST_DUP:
-                    {
-                        sam_word_t a;
-                        POP_WORD(&a);
-                        PUSH_WORD(a);
-                        PUSH_WORD(a);
-                    }
-                    break;
-                case INST_SWAP:
-                    {
-                        sam_word_t a, b;
-                        POP_WORD(&a);
-                        POP_WORD(&b);
-                        PUSH_WORD(a);
-                        PUSH_WORD(b);
-                    }
-                    break;
-                case INST_OVER:
-                    {
-                        sam_uword_t addr, item;
-                        HALT_IF_ERROR(sam_array_item(state->s0, -2, &addr));
-                        HALT_IF_ERROR(sam_array_peek(state->s0, addr, &item));
-                        PUSH_WORD(item);
-                    }
-                    break;
-                case INST_GET:
-                    {
-                        sam_blob_t *blob;
-                        POP_BLOB(blob);
-                        switch (blob->type) {
-                        case SAM_BLOB_ARRAY:
-                            {
-                                sam_word_t pos;
-                                POP_INT(pos);
-                                sam_uword_t addr, item;
-                                HALT_IF_ERROR(sam_array_item(blob, pos, &addr));
-                                HALT_IF_ERROR(sam_array_peek(blob, addr, &item));
-                                HALT_IF_ERROR(sam_array_push(state->s0, item));
-                            }
-                            break;
-                        case SAM_BLOB_MAP:
-                            {
-                                sam_word_t key, val;
-                                POP_WORD(&key);
-                                HALT_IF_ERROR(sam_map_get(blob, key, &val));
-                                HALT_IF_ERROR(sam_array_push(state->s0, val));
-                            }
-                            break;
-                        }
-                    }
-                    break;
-                case INST_SET:
-                    {
-                        sam_blob_t *blob;
-                        POP_BLOB(blob);
-                        switch (blob->type) {
-                        case SAM_BLOB_ARRAY:
-                            {
-                                sam_word_t pos, val;
-                                POP_INT(pos);
-                                sam_uword_t dest;
-                                HALT_IF_ERROR(sam_array_item(blob, pos, &dest));
-                                POP_WORD(&val);
-                                HALT_IF_ERROR(sam_array_poke(blob, dest, val));
-                            }
-                            break;
-                        case SAM_BLOB_MAP:
-                            {
-                                sam_word_t key, val;
-                                POP_WORD(&key);
-                                POP_WORD(&val);
-                                HALT_IF_ERROR(sam_map_set(blob, key, val));
-                            }
-                            break;
-                        }
-                    }
-                    break;
-                case INST_EXTRACT:
-                    {
-                        sam_blob_t *blob;
-                        POP_BLOB(blob);
-                        sam_word_t pos;
-                        POP_INT(pos);
-                        sam_uword_t addr;
-                        HALT_IF_ERROR(sam_array_item(blob, pos, &addr));
-                        HALT_IF_ERROR(sam_array_extract(blob, addr));
-                    }
-                    break;
-                case INST_INSERT:
-                    {
-                        sam_blob_t *blob;
-                        POP_BLOB(blob);
-                        sam_word_t pos;
-                        POP_INT(pos);
-                        sam_uword_t addr;
-                        HALT_IF_ERROR(sam_array_item(blob, pos, &addr));
-                        HALT_IF_ERROR(sam_array_insert(blob, addr));
-                    }
-                    break;
-                case INST_POP:
-                    {
-                        sam_blob_t *blob;
-                        POP_BLOB(blob);
-                        sam_array_t *stack;
-                        EXTRACT_BLOB(blob, SAM_BLOB_ARRAY, sam_array_t, stack);
-                        if (stack->sp < 1)
-                            HALT(SAM_ERROR_ARRAY_UNDERFLOW);
-                        sam_word_t val;
-                        HALT_IF_ERROR(sam_array_pop(blob, &val));
-                        PUSH_WORD(val);
-                    }
-                    break;
-                case INST_SHIFT:
-                    {
-                        sam_blob_t *blob;
-                        POP_BLOB(blob);
-                        sam_array_t *stack;
-                        EXTRACT_BLOB(blob, SAM_BLOB_ARRAY, sam_array_t, stack);
-                        if (stack->sp < 1)
-                            HALT(SAM_ERROR_ARRAY_UNDERFLOW);
-                        sam_word_t val;
-                        HALT_IF_ERROR(sam_array_shift(blob, &val));
-                        PUSH_WORD(val);
-                    }
-                    break;
-                case INST_APPEND:
-                    {
-                        sam_blob_t *stack;
-                        POP_BLOB(stack);
-                        sam_word_t val;
-                        POP_WORD(&val);
-                        HALT_IF_ERROR(sam_array_push(stack, val));
-                    }
-                    break;
-                case INST_PREPEND:
-                    {
-                        sam_blob_t *stack;
-                        POP_BLOB(stack);
-                        sam_word_t val;
-                        POP_WORD(&val);
-                        HALT_IF_ERROR(sam_array_prepend(stack, val));
-                    }
-                    break;
-                case INST_RESUME:
-                    {
-                        sam_blob_t *blob, *frame;
-                        POP_BLOB(frame);
-                        sam_word_t inst;
-                        HALT_IF_ERROR(sam_array_pop(frame, &inst));
-                        sam_uword_t new_pc;
-                        EXTRACT_INSN(inst, SAM_INT_TAG, SAM_INT_TAG_MASK, LRSHIFT, SAM_INT_SHIFT);
-                        new_pc = (sam_uword_t)inst;
-                        HALT_IF_ERROR(sam_make_inst_blob(&inst, state->s0));
-                        HALT_IF_ERROR(sam_array_push(frame, inst));
-                        HALT_IF_ERROR(sam_make_inst_blob(&inst, state->p0));
-                        HALT_IF_ERROR(sam_array_push(frame, inst));
-                        POP_BLOB(blob);
-                        sam_closure_t *cl;
-                        EXTRACT_BLOB(blob, SAM_BLOB_CLOSURE, sam_closure_t, cl);
-                        HALT_IF_ERROR(sam_make_inst_blob(&inst, cl->context));
-                        HALT_IF_ERROR(sam_array_push(frame, inst));
-                        sam_uword_t nargs;
-                        POP_UINT(nargs);
-                        for (sam_uword_t i = nargs; i > 0; i--) {
-                            sam_uword_t val;
-                            HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - i, &val));
-                            HALT_IF_ERROR(sam_array_push(frame, val));
-                        }
-                        sam_word_t val;
-                        for (sam_uword_t i = 0; i < nargs; i++)
-                            POP_WORD(&val);
-                        PUSH_INT(state->pc);
-                        state->s0 = frame;
-                        state->p0 = cl->code;
-                        state->pc = new_pc;
-                        opcodes = 0;
-                    }
-                    break;
-                case INST_NOT:
-                    {
-                        sam_uword_t operand;
-                        sam_word_t a;
-                        HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
-                        if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
-                            POP_INT(a);
-                            PUSH_INT(~a);
-                        } else {
-                            POP_BOOL(a);
-                            PUSH_BOOL(!a);
-                        }
-                    }
-                    break;
-                case INST_AND:
-                    {
-                        sam_uword_t operand;
-                        sam_word_t a, b;
-                        HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
-                        if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
-                            POP_INT(b);
-                            POP_INT(a);
-                            PUSH_INT(a & b);
-                        } else {
-                            POP_BOOL(b);
-                            POP_BOOL(a);
-                            PUSH_BOOL(a & b);
-                        }
-                    }
-                    break;
-                case INST_OR:
-                    {
-                        sam_uword_t operand;
-                        sam_word_t a, b;
-                        HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
-                        if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
-                            POP_INT(b);
-                            POP_INT(a);
-                            PUSH_INT(a | b);
-                        } else {
-                            POP_BOOL(b);
-                            POP_BOOL(a);
-                            PUSH_BOOL(a | b);
-                        }
-                    }
-                    break;
-                case INST_XOR:
-                    {
-                        sam_uword_t operand;
-                        sam_word_t a, b;
-                        HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
-                        if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
-                            POP_INT(b);
-                            POP_INT(a);
-                            PUSH_INT(a ^ b);
-                        } else {
-                            POP_BOOL(b);
-                            POP_BOOL(a);
-                            PUSH_BOOL(a ^ b);
-                        }
-                    }
-                    break;
-                case INST_EQ:
-                    {
-                        sam_word_t x, y;
-                        POP_WORD(&y);
-                        POP_WORD(&x);
-                        PUSH_BOOL(x == y);
-                    }
-                    break;
-                case INST_LT:
-                    {
-                        sam_uword_t operand;
-                        HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
-                        if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
-                            sam_word_t a, b;
-                            POP_INT(b);
-                            POP_INT(a);
-                            PUSH_BOOL(a < b);
-                        } else if ((operand & SAM_FLOAT_TAG_MASK) == SAM_FLOAT_TAG) {
-                            sam_float_t a, b;
-                            POP_FLOAT(b);
-                            POP_FLOAT(a);
-                            PUSH_BOOL(a < b);
-                        } else
-                            HALT(SAM_ERROR_WRONG_TYPE);
-                    }
-                    break;
-                case INST_NEG:
-                    {
-                        sam_uword_t operand;
-                        HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
-                        if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
-                            sam_uword_t a;
-                            POP_UINT(a);
-                            PUSH_INT(-a);
-                        } else if ((operand & SAM_FLOAT_TAG_MASK) == SAM_FLOAT_TAG) {
-                            sam_float_t a;
-                            POP_FLOAT(a);
-                            PUSH_FLOAT(-a);
-                        } else
-                            HALT(SAM_ERROR_WRONG_TYPE);
-                    }
-                    break;
-                case INST_ADD:
-                    {
-                        sam_uword_t operand;
-                        HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
-                        if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
-                            sam_uword_t a, b;
-                            POP_UINT(b);
-                            POP_UINT(a);
-                            PUSH_INT((sam_word_t)(a + b));
-                        } else if ((operand & SAM_FLOAT_TAG_MASK) == SAM_FLOAT_TAG) {
-                            sam_float_t a, b;
-                            POP_FLOAT(b);
-                            POP_FLOAT(a);
-                            PUSH_FLOAT(a + b);
-                        } else
-                            HALT(SAM_ERROR_WRONG_TYPE);
-                    }
-                    break;
-                case INST_MUL:
-                    {
-                        sam_uword_t operand;
-                        HALT_IF_ERROR(sam_array_peek(state->s0, s->sp - 1, &operand));
-                        if ((operand & SAM_INT_TAG_MASK) == SAM_INT_TAG) {
-                            sam_uword_t a, b;
-                            POP_UINT(b);
-                            POP_UINT(a);
-                            PUSH_INT((sam_word_t)(a * b));
-                        } else if ((operand & SAM_FLOAT_TAG_MASK) == SAM_FLOAT_TAG) {
-                            sam_float_t a, b;
-                            POP_FLOAT(b);
-                            POP_FLOAT(a);
-                            PUSH_FLOAT(a * b);
-                        } else
-                            HALT(SAM_ERROR_WRONG_TYPE);
-                    }
-                    break;
-                case INST_0:
-                    PUSH_INT(0);
-                    break;
-                case INST_1:
-                    PUSH_INT(1);
-                    break;
-                case INST_MINUS_1:
-                    PUSH_INT(-1);
-                    break;
-                case INST_2:
-                    PUSH_INT(2);
-                    break;
-                case INST_MINUS_2:
-                    PUSH_INT(-2);
-                    break;
-                }
-
-                opcodes >>= SAM_ONE_INST_SHIFT;
-
-#ifdef SAM_DEBUG
-                if (opcodes != 0) {
-                    debug("sam_run: p0 = %p, pc = %u, s0 = %p, sp = %u, ir = %x\n", state->p0, state->pc, s, s->sp, ir);
-                    sam_print_working_stack(state->s0);
-                }
-#endif
-            }
+            HALT_IF_ERROR(run_insts(state, ir, unchecked));
         } else {
             abort(); // The opcodes are exhaustive
         }
 
-        if (++tick_count % 1000 == 0)
-            sam_sdl_process_events();
+        // Checking the time is too slow to do on every instruction.
+        if ((++tick_count & 0xff) == 0)
+            sam_sdl_poll();
     }
 
 error:
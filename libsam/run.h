@@ -41,6 +41,8 @@
     _POP_INT(var, ARSHIFT)
 #define POP_UINT(var)                           \
     _POP_INT(var, LRSHIFT)
+#define PEEK_INT(var, pos)                      \
+    _PEEK_INSN(var, pos, SAM_INT_TAG, SAM_INT_TAG_MASK, ARSHIFT, SAM_INT_SHIFT)
 #define PUSH_INT(val)                           \
     PUSH_WORD(SAM_INT_TAG | LSHIFT(val, SAM_INT_SHIFT))
 
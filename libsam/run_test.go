@@ -0,0 +1,31 @@
+// Tests for the interpreter.
+package libsam
+
+import (
+	"testing"
+
+	"github.com/alecthomas/assert/v2"
+)
+
+// Code that changes itself while it runs must run the changed words, even
+// once it has been translated.
+func TestChangeRunningCode(t *testing.T) {
+	// With the code itself at the bottom of the stack, add the word at 6 to
+	// a total 2000 times, and after 1000 times, change it from 1 to 100.
+	code := NewArrayFromWords(assemble(
+		0, 0, // total, count
+		1, "add", -2, "sget", 1, "add", -3, "sset",
+		-1, "sget", 1000, "eq", 5, "JUMP_IF_FALSE",
+		100, 6, 0, "sget", "set",
+		-1, "sget", 2000, "lt", 2, "JUMP_IF_FALSE", -27, "JUMP",
+		"drop", "HALT",
+	))
+	assert.True(t, code.Verify(false))
+
+	assert.Equal(t, ERROR_OK, BasicInit())
+	state := NewState()
+	stack := state.Stack()
+	stack.PushBlob(code)
+	assert.Equal(t, ERROR_OK, Run(&state, &code))
+	assert.Equal(t, MakeInstInt(1000+1000*100), state.result)
+}
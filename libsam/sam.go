@@ -14,9 +14,12 @@ package libsam
 //#include "traps_graphics.h"
 //#include "traps_input.h"
 //#include "traps_audio.h"
+//static sam_blob_t *word_blob(sam_uword_t w) { return (sam_blob_t *)(w & ~(sam_uword_t)SAM_BLOB_TAG_MASK); }
+//static void *blob_data(sam_blob_t *blob) { return blob->data; }
 import "C"
 import (
 	"fmt"
+	"math"
 	"strings"
 	"unsafe"
 )
@@ -46,6 +49,9 @@ var INSTS_TAG_MASK = C.SAM_INSTS_TAG_MASK
 var INSTS_SHIFT = C.SAM_INSTS_SHIFT
 var INST_SET_MASK = C.SAM_INST_SET_MASK
 var INST_SET_SHIFT = C.SAM_INST_SET_SHIFT
+var INST_SET_ANY = Uword(C.SAM_INST_SET_ANY)
+var INST_SET_INT = Uword(C.SAM_INST_SET_INT)
+var INST_SET_FLOAT = Uword(C.SAM_INST_SET_FLOAT)
 var INST_MASK = C.SAM_INST_MASK
 var ONE_INST_SHIFT = C.SAM_ONE_INST_SHIFT
 var WORD_BIT = C.SAM_WORD_BIT
@@ -70,12 +76,29 @@ func NewArray() Blob {
 	return blob
 }
 
+// Make an array holding a copy of words, in one call to libsam.
+func NewArrayFromWords(words []Word) Blob {
+	blob := Blob{}
+	var data *Word
+	if len(words) > 0 {
+		data = &words[0]
+	}
+	C.sam_array_new_from_words(data, Uword(len(words)), &blob.blob)
+	return blob
+}
+
 func NewString(str string) Blob {
 	blob := Blob{}
 	cstr := C.CString(str)
 	C.sam_string_new(&blob.blob, cstr, C.size_t(len(str)))
 	return blob
 }
+func NewClosure(code Blob, context Blob) Blob {
+	blob := Blob{}
+	C.sam_closure_new(&blob.blob, code.blob, context.blob)
+	return blob
+}
+
 func NewState() State {
 	state := C.sam_state_new()
 	var blob *C.sam_blob_t
@@ -104,52 +127,61 @@ func (arr *Blob) Push(val Word) int {
 	return int(C.sam_array_push(arr.blob, val))
 }
 
+func (arr *Blob) SetVerified() int {
+	return int(C.sam_array_set_verified(arr.blob))
+}
+
+func (arr *Blob) Verified() bool {
+	var a *C.sam_array_t
+	C.sam_array_from_blob(arr.blob, &a)
+	return bool(a.verified)
+}
+
+// Return the blob that a blob word refers to.
+func WordBlob(w Uword) Blob {
+	return Blob{C.word_blob(w)}
+}
+
+func (b *Blob) Type() Uword {
+	return Uword(b.blob._type)
+}
+
+func (str *Blob) StringValue() string {
+	s := (*C.sam_string_t)(C.blob_data(str.blob))
+	return C.GoStringN(s.str, C.int(s.len))
+}
+
+func (cl *Blob) ClosureParts() (code Blob, context Blob) {
+	c := (*C.sam_closure_t)(C.blob_data(cl.blob))
+	return Blob{c.code}, Blob{c.context}
+}
+
+// The MakeInst functions make words as the sam_make_inst functions do, but
+// in Go, so that code can be assembled without calling C for each word.
+
 func MakeInstArray(a Blob) Word {
-	var inst Word
-	if res := C.sam_make_inst_blob(&inst, a.blob); res != ERROR_OK {
-		panic("invalid array")
-	}
-	return inst
+	return Word(uintptr(unsafe.Pointer(a.blob))) | Word(BLOB_TAG)
 }
 
 func MakeInstInt(i Word) Word {
-	var inst Word
-	if res := C.sam_make_inst_int(&inst, i); res != ERROR_OK {
-		panic("invalid int")
-	}
-	return inst
+	return Word(INT_TAG) | i<<INT_SHIFT
 }
 
 func MakeInstFloat(f float64) Word {
-	var inst Word
-	if res := C.sam_make_inst_float(&inst, C.sam_float_t(f)); res != ERROR_OK {
-		panic("invalid float")
-	}
-	return inst
+	operand := Uword(math.Float64bits(f))
+	return Word(FLOAT_TAG) | Word((operand&^Uword(FLOAT_TAG_MASK))<<FLOAT_SHIFT)
 }
 
 func MakeInstAtom(atomType Uword, operand Uword) Word {
-	var inst Word
-	if res := C.sam_make_inst_atom(&inst, atomType, operand); res != ERROR_OK {
-		panic("invalid atom")
-	}
-	return inst
+	return Word(ATOM_TAG) | Word(atomType<<ATOM_TYPE_SHIFT) | Word(operand<<ATOM_SHIFT)
 }
 
 func MakeInstTrap(function Uword) Word {
-	var inst Word
-	if res := C.sam_make_inst_trap(&inst, function); res != ERROR_OK {
-		panic("invalid atom")
-	}
-	return inst
+	return Word(TRAP_TAG) | Word(function<<TRAP_FUNCTION_SHIFT)
 }
 
-func MakeInstInsts(insts Uword) Word {
-	var inst Word
-	if res := C.sam_make_inst_insts(&inst, insts); res != ERROR_OK {
-		panic("invalid insts")
-	}
-	return inst
+func MakeInstInsts(set Uword, insts Uword) Word {
+	return Word(INSTS_TAG) | Word(set<<INST_SET_SHIFT) | Word(insts<<INSTS_SHIFT)
 }
 
 func (arr *Blob) PushWord(w Word) int {
@@ -176,8 +208,8 @@ func (arr *Blob) PushTrap(function Uword) int {
 	return int(C.sam_array_push(arr.blob, MakeInstTrap(function)))
 }
 
-func (arr *Blob) PushInsts(insts Uword) int {
-	return int(C.sam_array_push(arr.blob, MakeInstInsts(insts)))
+func (arr *Blob) PushInsts(set Uword, insts Uword) int {
+	return int(C.sam_array_push(arr.blob, MakeInstInsts(set, insts)))
 }
 
 func Run(state *State, code *Blob) Word {
@@ -229,12 +261,43 @@ func SetDebug(flag bool) {
 	}
 }
 
+func SetHeadless(flag bool) {
+	if flag {
+		C.sam_headless = true
+	} else {
+		C.sam_headless = false
+	}
+}
+
+func SetRecord(file string, delta bool) {
+	C.sam_record_file = C.CString(file) // Used until SdlFinish
+	if delta {
+		C.sam_record_delta = true
+	} else {
+		C.sam_record_delta = false
+	}
+}
+
 func (arr *Blob) Print() {
 	C.sam_print_array(arr.blob)
 }
 
-func DumpScreen(file string) {
-	C.sam_dump_screen(C.CString(file))
+// TextCacheStats returns the number of TEXT and TEXTBOX draws that were
+// found in the text run cache and that were not, and the number of runs
+// evicted from it.
+func TextCacheStats() (hits, misses, evictions uint64) {
+	var h, m, e C.ulong
+	C.sam_text_cache_stats(&h, &m, &e)
+	return uint64(h), uint64(m), uint64(e)
+}
+
+func DumpScreen(file string) error {
+	cfile := C.CString(file)
+	defer C.free(unsafe.Pointer(cfile))
+	if C.sam_dump_screen(cfile) != 0 {
+		return fmt.Errorf("could not write screen dump %v", file)
+	}
+	return nil
 }
 
 const (
@@ -262,9 +325,10 @@ const (
 )
 
 const (
-	BLOB_ARRAY  = C.SAM_BLOB_ARRAY
-	BLOB_STRING = C.SAM_BLOB_STRING
-	BLOB_RAW    = C.SAM_BLOB_RAW
+	BLOB_ARRAY   = C.SAM_BLOB_ARRAY
+	BLOB_STRING  = C.SAM_BLOB_STRING
+	BLOB_RAW     = C.SAM_BLOB_RAW
+	BLOB_CLOSURE = C.SAM_BLOB_CLOSURE
 )
 
 var errors = map[int]string{
@@ -309,11 +373,33 @@ func (state *State) ErrorMessage(code Word) string {
 
 type Instruction struct {
 	Tag      Word
-	Opcode   Uword
-	Operands int // -1 means >=1 argument
+	Opcode   Uword // for instructions, the instruction set is above the opcode
+	Operands int   // -1 means >=1 argument
 	Terminal bool
 }
 
+// Split an instruction's Opcode into its instruction set and opcode.
+func (i Instruction) SetAndOpcode() (Uword, Uword) {
+	return i.Opcode >> Uword(ONE_INST_SHIFT), i.Opcode & Uword(INST_MASK)
+}
+
+// Whether an opcode has typed versions.
+func IsTypedOpcode(opcode Uword) bool {
+	return opcode == C.INST_NEG || opcode == C.INST_ADD || opcode == C.INST_MUL || opcode == C.INST_LT
+}
+
+// Add the typed versions of instructions, such as "add_int", which expect
+// their operands to be integers or floats.
+func init() {
+	for _, name := range []string{"neg", "add", "mul", "lt"} {
+		inst := Instructions[name]
+		for suffix, set := range map[string]Uword{"_int": INST_SET_INT, "_float": INST_SET_FLOAT} {
+			Instructions[name+suffix] = Instruction{inst.Tag, inst.Opcode | set<<Uword(ONE_INST_SHIFT), inst.Operands, inst.Terminal}
+			StackDifference[name+suffix] = StackDifference[name]
+		}
+	}
+}
+
 var Instructions = map[string]Instruction{
 	"int":   {C.SAM_INT_TAG, 0, 1, true},
 	"float": {C.SAM_FLOAT_TAG, 0, 1, true},
@@ -383,6 +469,8 @@ var Traps = map[string]uint{
 	"LOG":           C.TRAP_BASIC_LOG,
 	"SEED":          C.TRAP_BASIC_SEED,
 	"RANDOM":        C.TRAP_BASIC_RANDOM,
+	"TAIL_CALL":     C.TRAP_BASIC_TAIL_CALL,
+	"COUNT":         C.TRAP_BASIC_COUNT,
 
 	"I2F":   C.TRAP_MATH_I2F,
 	"F2I":   C.TRAP_MATH_F2I,
@@ -463,6 +551,7 @@ var Traps = map[string]uint{
 	"TEXTBOX":         C.TRAP_GRAPHICS_TEXTBOX,
 	"FPS":             C.TRAP_GRAPHICS_FPS,
 	"WAIT":            C.TRAP_GRAPHICS_WAIT,
+	"FLUSH":           C.TRAP_GRAPHICS_FLUSH,
 
 	"KEYPRESSED":             C.TRAP_INPUT_KEYPRESSED,
 	"KEY_A":                  C.TRAP_INPUT_KEY_A,
@@ -710,6 +799,9 @@ var Traps = map[string]uint{
 	"KEY_SOFTRIGHT":          C.TRAP_INPUT_KEY_SOFTRIGHT,
 	"KEY_CALL":               C.TRAP_INPUT_KEY_CALL,
 	"KEY_ENDCALL":            C.TRAP_INPUT_KEY_ENDCALL,
+	"KEYDOWN":                C.TRAP_INPUT_KEYDOWN,
+	"KEYUP":                  C.TRAP_INPUT_KEYUP,
+	"TEXTINPUT":              C.TRAP_INPUT_TEXTINPUT,
 	"NEW_AUDIOFILE":          C.TRAP_AUDIO_NEW_AUDIOFILE,
 	"AUDIO_VOL":              C.TRAP_AUDIO_VOL,
 	"AUDIO_PITCH":            C.TRAP_AUDIO_PITCH,
@@ -731,6 +823,15 @@ var Traps = map[string]uint{
 	"HORSE":                  C.TRAP_AUDIO_HORSE,
 	"LASER":                  C.TRAP_AUDIO_LASER,
 	"OOPS":                   C.TRAP_AUDIO_OOPS,
+	"SYNTH_SINE":             C.TRAP_AUDIO_SYNTH_SINE,
+	"SYNTH_SQUARE":           C.TRAP_AUDIO_SYNTH_SQUARE,
+	"SYNTH_SAW":              C.TRAP_AUDIO_SYNTH_SAW,
+	"SYNTH_TRIANGLE":         C.TRAP_AUDIO_SYNTH_TRIANGLE,
+	"SYNTH_NOISE":            C.TRAP_AUDIO_SYNTH_NOISE,
+	"SYNTH_ENVELOPE":         C.TRAP_AUDIO_SYNTH_ENVELOPE,
+	"SYNTH_NOTE":             C.TRAP_AUDIO_SYNTH_NOTE,
+	"SYNTH_TIME":             C.TRAP_AUDIO_SYNTH_TIME,
+	"SYNTH_STOP":             C.TRAP_AUDIO_SYNTH_STOP,
 }
 
 // The net change in `SP` caused by each instruction.
@@ -814,6 +915,8 @@ var TrapStackEffect = map[string]StackEffect{
 	"LOG":           {1, 0},
 	"SEED":          {1, 0},
 	"RANDOM":        {0, 1},
+	"TAIL_CALL":     {2, 0},
+	"COUNT":         {1, 1},
 
 	// Math traps
 	"I2F":   {1, 1},
@@ -857,6 +960,7 @@ var TrapStackEffect = map[string]StackEffect{
 	"TEXTBOX":         {6, 0},
 	"FPS":             {1, 0},
 	"WAIT":            {0, 0},
+	"FLUSH":           {0, 0},
 
 	// Input traps
 	"KEYPRESSED":             {1, 1},
@@ -1105,6 +1209,9 @@ var TrapStackEffect = map[string]StackEffect{
 	"KEY_SOFTRIGHT":          {0, 1},
 	"KEY_CALL":               {0, 1},
 	"KEY_ENDCALL":            {0, 1},
+	"KEYDOWN":                {0, 1},
+	"KEYUP":                  {0, 1},
+	"TEXTINPUT":              {0, 1},
 
 	// Audio traps
 	"NEW_AUDIOFILE":   {0, 1},
@@ -1128,4 +1235,13 @@ var TrapStackEffect = map[string]StackEffect{
 	"HORSE":           {0, 1},
 	"LASER":           {0, 1},
 	"OOPS":            {0, 1},
+	"SYNTH_SINE":      {0, 1},
+	"SYNTH_SQUARE":    {0, 1},
+	"SYNTH_SAW":       {0, 1},
+	"SYNTH_TRIANGLE":  {0, 1},
+	"SYNTH_NOISE":     {0, 1},
+	"SYNTH_ENVELOPE":  {4, 0},
+	"SYNTH_NOTE":      {5, 0},
+	"SYNTH_TIME":      {0, 1},
+	"SYNTH_STOP":      {0, 0},
 }
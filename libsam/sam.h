@@ -53,6 +53,10 @@ typedef _sam_map_itr sam_map_iter_t;
 // Top-level state
 typedef struct sam_state sam_state_t;
 
+// Code compiled to C, run in place of a code array. It runs from state->pc
+// until control leaves the array, and returns an error code.
+typedef sam_word_t (*sam_native_t)(sam_state_t *state);
+
 // Error codes
 enum SAM_ERROR {
     SAM_ERROR_OK,
@@ -75,10 +79,13 @@ int sam_blob_new(unsigned type, size_t data_size, sam_blob_t **new_blob);
 // Array access
 int sam_array_from_blob(sam_blob_t *blob, sam_array_t **s);
 int sam_array_new(sam_blob_t **new_array);
+int sam_array_new_from_words(const sam_word_t *words, sam_uword_t n, sam_blob_t **new_array);
 int sam_array_copy(sam_blob_t *array, sam_blob_t **new_array);
 // FIXME: val in next two functions should be word, not uword
 int sam_array_peek(sam_blob_t *s, sam_uword_t addr, sam_uword_t *val);
 int sam_array_poke(sam_blob_t *s, sam_uword_t addr, sam_uword_t val);
+int sam_array_set_verified(sam_blob_t *s);
+int sam_array_set_native(sam_blob_t *s, sam_native_t native);
 int sam_array_extract(sam_blob_t *s, sam_uword_t addr);
 int sam_array_insert(sam_blob_t *s, sam_uword_t addr);
 int sam_array_item(sam_blob_t *s, sam_word_t n, sam_uword_t *addr);
@@ -91,7 +98,7 @@ int sam_make_inst_int(sam_word_t *inst, sam_word_t val);
 int sam_make_inst_float(sam_word_t *inst, sam_float_t n);
 int sam_make_inst_atom(sam_word_t *inst, sam_uword_t atom_type, sam_uword_t operand);
 int sam_make_inst_trap(sam_word_t *inst, sam_uword_t function);
-int sam_make_inst_insts(sam_word_t *inst, sam_uword_t insts);
+int sam_make_inst_insts(sam_word_t *inst, sam_uword_t set, sam_uword_t insts);
 int sam_array_iter_new(sam_blob_t *blob, sam_blob_t **new_iter);
 
 // Closures
@@ -118,6 +125,8 @@ sam_state_t *sam_state_new(void);
 
 // Miscellaneous routines
 sam_word_t sam_run(sam_state_t *state);
+sam_word_t sam_run_insts(sam_state_t *state, sam_uword_t ir);
+sam_word_t sam_trap(sam_state_t *state, sam_uword_t function);
 
 // Debug
 #ifdef SAM_DEBUG
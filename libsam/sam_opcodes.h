@@ -69,6 +69,14 @@ enum SAM_BLOB_TYPE {
   SAM_BLOB_TYPES,
 };
 
+// Instruction sets (3 bits). A typed set says that the operands of
+// arithmetic and comparison instructions are expected to be of that type.
+enum SAM_INST_SET {
+  SAM_INST_SET_ANY,
+  SAM_INST_SET_INT,
+  SAM_INST_SET_FLOAT,
+};
+
 // Instructions (5 bits)
 enum SAM_INST {
   INST_NOP,
@@ -110,3 +118,4 @@ _Static_assert(INST_INSTS == 32);
 
 // Useful aliases
 #define SAM_VALUE_NULL ((SAM_ATOM_NULL << SAM_ATOM_TYPE_SHIFT) | SAM_ATOM_TAG)
+#define SAM_VALUE_BOOL(b) ((SAM_ATOM_BOOL << SAM_ATOM_TYPE_SHIFT) | SAM_ATOM_TAG | ((sam_uword_t)((b) ? SAM_TRUE : SAM_FALSE) << SAM_ATOM_SHIFT))
@@ -11,21 +11,27 @@
 #ifndef SAM_SDL
 #define SAM_SDL
 
+#include <stdbool.h>
 #include "sam.h"
 
 extern unsigned sam_display_width;
 extern unsigned sam_display_height;
 extern unsigned sam_update_interval;
+extern bool sam_headless;
+extern const char *sam_record_file;
+extern bool sam_record_delta;
 
 typedef struct sam_audiofile sam_audiofile_t;
 
 sam_word_t sam_sdl_init(void);
 void sam_sdl_finish(void);
 int sam_sdl_process_events(void);
+void sam_sdl_poll(void);
 int sam_sdl_window_used(void);
 uint32_t sam_getpixel(int x, int y);
-void sam_dump_screen(const char *filename);
+int sam_dump_screen(const char *filename);
 void sam_update_screen(void);
 void sam_sdl_wait(void);
+void sam_text_cache_stats(unsigned long *hits, unsigned long *misses, unsigned long *evictions);
 
 #endif
@@ -10,15 +10,17 @@
 
 #include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <SDL.h>
-#include <SDL_mixer.h>
 
 #ifndef DEBUG_NANOVG
 #define NVG_LOG(...)
 #endif
 #include "nanovg.h"
+#include "fontstash.h"
 #define NANOVG_SW_IMPLEMENTATION
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -26,6 +28,12 @@
 #pragma GCC diagnostic ignored "-Wsign-compare"
 #include "nanovg_sw.h"
 #pragma GCC diagnostic pop
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#include "stb_image_write.h"
+#pragma GCC diagnostic pop
 
 #include "sam.h"
 #include "sam_opcodes.h"
@@ -41,6 +49,9 @@
 unsigned sam_update_interval = 10; // milliseconds between screen updates
 unsigned sam_display_width = 1280;
 unsigned sam_display_height = 720;
+bool sam_headless = false; // render into memory, without a window or audio
+const char *sam_record_file = NULL; // file to record frames to
+bool sam_record_delta = false; // record only rows that changed
 
 #define PIXEL_SIZE 2 // FIXME calculate pixel ratio
 static double text_size = 16.0;
@@ -52,6 +63,19 @@ static NVGcontext* vg;
 static SDL_PixelFormat *fmt;
 const unsigned bytes_per_pixel = 4;
 
+// Framebuffer: the window surface, or a malloc'd buffer when headless
+static void *framebuffer;
+static int framebuffer_pitch;
+static bool framebuffer_allocated; // not the window surface
+
+// Pixel layout of the headless framebuffer: R, G, B, A in byte order
+static SDL_PixelFormat headless_fmt = {
+    .Rshift = 0,
+    .Gshift = 8,
+    .Bshift = 16,
+    .Ashift = 24,
+};
+
 enum font_handle {
     FONT_MONO,
     FONT_MONO_BOLD,
@@ -64,6 +88,7 @@ enum font_handle {
 };
 
 static int fonts[FONT_NUM_FONTS];
+static bool fonts_loaded = false; // fonts are loaded when first used
 
 unsigned char font_mono[] = {
 #embed "NotoSansMono-Regular.ttf"
@@ -108,7 +133,8 @@ enum sound_handle {
     SOUND_NUM_SOUNDS,
 };
 
-static sam_blob_t *sounds[SOUND_NUM_SOUNDS];
+static sam_blob_t *sounds[SOUND_NUM_SOUNDS]; // sounds are loaded when first used
+static bool audio_open = false;
 
 unsigned char sound_applause[] = {
 #embed "applause.wav"
@@ -146,27 +172,63 @@ unsigned char sound_oops[] = {
 #embed "oops.wav"
 };
 
-int sam_audiofile_new(sam_blob_t **new_audiofile, Mix_Music *audiofile)
+// Decode a WAV file in memory into a new audio file blob.
+static int sam_audiofile_new(sam_blob_t **new_audiofile, const unsigned char *mem, size_t size)
 {
     sam_word_t error = SAM_ERROR_OK;
     sam_blob_t *blob;
     HALT_IF_ERROR(sam_blob_new(SAM_BLOB_AUDIOFILE, sizeof(sam_audiofile_t), &blob));
     sam_audiofile_t *audio;
     EXTRACT_BLOB(blob, SAM_BLOB_AUDIOFILE, sam_audiofile_t, audio);
-    audio->audio = audiofile;
+    error = sam_audio_decode(mem, size, audio);
+    if (error != SAM_ERROR_OK) {
+        free(blob);
+        return error;
+    }
     *new_audiofile = blob;
 
 error:
     return error;
 }
 
-static int load_audio_memory(unsigned char *mem, size_t size, sam_blob_t **blob)
+static struct {
+    unsigned char *data;
+    size_t size;
+} sound_data[SOUND_NUM_SOUNDS] = {
+    {sound_applause, sizeof(sound_applause)},
+    {sound_beep, sizeof(sound_beep)},
+    {sound_bell, sizeof(sound_bell)},
+    {sound_cow, sizeof(sound_cow)},
+    {sound_explosion, sizeof(sound_explosion)},
+    {sound_gong, sizeof(sound_gong)},
+    {sound_horse, sizeof(sound_horse)},
+    {sound_laser, sizeof(sound_laser)},
+    {sound_oops, sizeof(sound_oops)},
+};
+
+// Start the mixer, the first time a sound is loaded. There is no audio
+// device when headless, but sounds are still decoded.
+static int init_audio(void)
 {
-    SDL_RWops *src = SDL_RWFromMem((void *)mem, (int)size);
-    Mix_Music *audiofile = Mix_LoadMUSType_RW(src, MUS_WAV, 1);
-    if (audiofile == NULL)
-        return SAM_ERROR_TRAP_INIT;
-    return sam_audiofile_new(blob, audiofile);
+    if (audio_open)
+        return SAM_ERROR_OK;
+    int error = sam_audio_init(!sam_headless);
+    if (error == SAM_ERROR_OK)
+        audio_open = true;
+    return error;
+}
+
+static int get_sound(enum sound_handle sound, sam_blob_t **blob)
+{
+    if (sounds[sound] == NULL) {
+        int error = init_audio();
+        if (error == SAM_ERROR_OK)
+            error = sam_audiofile_new(&sounds[sound], sound_data[sound].data, sound_data[sound].size);
+        if (error != SAM_ERROR_OK)
+            return error;
+    }
+    *blob = sounds[sound];
+    return SAM_ERROR_OK;
 }
 
 
@@ -177,24 +239,645 @@ static int load_audio_memory(unsigned char *mem, size_t size, sam_blob_t **blob)
         var = (NVGcolor){.c = (unsigned int)color_word}; \
     } while (0)
 
-static const Uint8 *keymap;
-static int numkeys;
+// Keyboard state when events were last polled
+static Uint8 keymap[SDL_NUM_SCANCODES];
+
+// Input events are queued when events are polled; if a queue is full, its
+// oldest event is dropped.
+#define INPUT_QUEUE_LENGTH 64
+typedef struct {
+    SDL_Scancode keys[INPUT_QUEUE_LENGTH];
+    unsigned first, count;
+} key_queue_t;
+static key_queue_t keys_down, keys_up;
+
+static struct {
+    char text[INPUT_QUEUE_LENGTH][SDL_TEXTINPUTEVENT_TEXT_SIZE];
+    unsigned first, count;
+} text_input;
+
+// Return the index at which to add an item to a queue
+static unsigned queue_add(unsigned *first, unsigned *count)
+{
+    if (*count == INPUT_QUEUE_LENGTH) {
+        *first = (*first + 1) % INPUT_QUEUE_LENGTH;
+        (*count)--;
+    }
+    return (*first + (*count)++) % INPUT_QUEUE_LENGTH;
+}
+
+// Return the index of the item to remove from a non-empty queue
+static unsigned queue_remove(unsigned *first, unsigned *count)
+{
+    unsigned i = *first;
+    *first = (*first + 1) % INPUT_QUEUE_LENGTH;
+    (*count)--;
+    return i;
+}
+
+// Framebuffer rectangles changed since the screen was last updated
+#define MAX_DIRTY_RECTS 32
+static SDL_Rect dirty_rects[MAX_DIRTY_RECTS];
+static int ndirty;
+
+// Mark the framebuffer rectangle [x0, x1) × [y0, y1) as changed.
+static void mark_dirty(int x0, int y0, int x1, int y1)
+{
+    int fb_width = sam_display_width * PIXEL_SIZE, fb_height = sam_display_height * PIXEL_SIZE;
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 > fb_width ? fb_width : x1;
+    y1 = y1 > fb_height ? fb_height : y1;
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    SDL_Rect rect = {x0, y0, x1 - x0, y1 - y0};
+    for (int i = 0; i < ndirty; i++) {
+        SDL_Rect *r = &dirty_rects[i];
+        if (r->x <= x0 && r->y <= y0 && r->x + r->w >= x1 && r->y + r->h >= y1)
+            return; // Already dirty
+    }
+    if (ndirty == MAX_DIRTY_RECTS) {
+        // Too many rectangles: merge them into one.
+        for (int i = 1; i < ndirty; i++)
+            SDL_UnionRect(&dirty_rects[0], &dirty_rects[i], &dirty_rects[0]);
+        SDL_UnionRect(&dirty_rects[0], &rect, &dirty_rects[0]);
+        ndirty = 1;
+    } else
+        dirty_rects[ndirty++] = rect;
+}
+
+// Find the framebuffer rectangle [x0, x1) × [y0, y1) that a nanovg call
+// can change.
+static void nanovg_call_bounds(SWNVGcontext *gl, SWNVGcall *call, int *x0, int *y0, int *x1, int *y1)
+{
+    *x0 = call->bounds[0];
+    *y0 = call->bounds[1];
+    *x1 = call->bounds[2] + 1;
+    *y1 = call->bounds[3] + 1;
+    if (call->type == SWNVG_PAINT_ATLAS && call->triangleCount > 0) {
+        // Text calls are bounded only by the screen, so use the
+        // bounds of their glyph quads.
+        NVGvertex *verts = &gl->verts[call->triangleOffset];
+        float min_x = verts[0].x0, min_y = verts[0].y0, max_x = min_x, max_y = min_y;
+        for (int j = 1; j < call->triangleCount; j++) {
+            min_x = fminf(min_x, verts[j].x0);
+            min_y = fminf(min_y, verts[j].y0);
+            max_x = fmaxf(max_x, verts[j].x0);
+            max_y = fmaxf(max_y, verts[j].y0);
+        }
+        *x0 = swnvg__maxi(*x0, (int)floorf(min_x));
+        *y0 = swnvg__maxi(*y0, (int)floorf(min_y));
+        *x1 = swnvg__mini(*x1, (int)ceilf(max_x) + 1);
+        *y1 = swnvg__mini(*y1, (int)ceilf(max_y) + 1);
+    }
+}
+
+// Mark the areas drawn by the nanovg calls in the current frame as changed.
+static void mark_nanovg_dirty(void)
+{
+    SWNVGcontext *gl = (SWNVGcontext *)nvgInternalParams(vg)->userPtr;
+    for (int i = 0; i < gl->ncalls; i++) {
+        int x0, y0, x1, y1;
+        nanovg_call_bounds(gl, &gl->calls[i], &x0, &y0, &x1, &y1);
+        mark_dirty(x0, y0, x1, y1);
+    }
+}
+
+// Drawing primitives are batched in a single nanovg frame, which is
+// rendered when the screen is updated or read, when the FLUSH trap is
+// called, or when the batch is full.
+#define MAX_BATCHED_DRAWS 4096
+static bool frame_open = false;
+static unsigned batched_draws;
+
+static void begin_draw(void)
+{
+    if (!frame_open) {
+        nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
+        frame_open = true;
+    }
+}
+
+static void flush_draws(void)
+{
+    if (frame_open) {
+        mark_nanovg_dirty();
+        nvgEndFrame(vg);
+        frame_open = false;
+        batched_draws = 0;
+    }
+}
+
+// Whether a draw in the current batch can change the framebuffer
+// rectangle [x0, x1) × [y0, y1), so that drawing there directly must wait
+// until the batch is flushed.
+static bool batch_overlaps(int x0, int y0, int x1, int y1)
+{
+    if (!frame_open)
+        return false;
+    SWNVGcontext *gl = (SWNVGcontext *)nvgInternalParams(vg)->userPtr;
+    for (int i = 0; i < gl->ncalls; i++) {
+        int cx0, cy0, cx1, cy1;
+        nanovg_call_bounds(gl, &gl->calls[i], &cx0, &cy0, &cx1, &cy1);
+        if (cx0 < x1 && x0 < cx1 && cy0 < y1 && y0 < cy1)
+            return true;
+    }
+    return false;
+}
+
+static void end_draw(void)
+{
+    need_window = true;
+    if (++batched_draws >= MAX_BATCHED_DRAWS)
+        flush_draws();
+}
+
+// Convert a colour to a framebuffer pixel, as nanovg does.
+static Uint32 color_to_pixel(NVGcolor color)
+{
+    return (Uint32)color.r << fmt->Rshift | (Uint32)color.g << fmt->Gshift | (Uint32)color.b << fmt->Bshift | (Uint32)color.a << 24;
+}
+
+// Fill a rectangle given in display coordinates with an opaque colour by
+// writing straight to the framebuffer. This gives the same pixels as
+// nanovg, which writes opaque colours with full coverage unblended.
+static void fill_rect_direct(sam_uword_t x, sam_uword_t y, sam_uword_t width, sam_uword_t height, NVGcolor color)
+{
+    flush_draws();
+    need_window = true;
+    if (x >= sam_display_width || y >= sam_display_height)
+        return;
+    if (width > sam_display_width - x)
+        width = sam_display_width - x;
+    if (height > sam_display_height - y)
+        height = sam_display_height - y;
+
+    mark_dirty(x * PIXEL_SIZE, y * PIXEL_SIZE, (x + width) * PIXEL_SIZE, (y + height) * PIXEL_SIZE);
+    Uint32 pixel = color_to_pixel(color);
+    Uint8 *row = (Uint8 *)framebuffer + y * PIXEL_SIZE * framebuffer_pitch + x * PIXEL_SIZE * bytes_per_pixel;
+    for (sam_uword_t i = 0; i < height * PIXEL_SIZE; i++, row += framebuffer_pitch)
+        SDL_memset4(row, pixel, width * PIXEL_SIZE);
+}
+
+// Text run cache. HUD-style programs draw the same strings at the same
+// places every frame, so TEXT and TEXTBOX keep the coverage masks that
+// nanovg computes for each run, keyed by the string, font, size and
+// position, and blend them straight into the framebuffer with nanovg's
+// own blending, giving the same pixels.
+//
+// Masks are captured by drawing the run in opaque white into a scratch
+// framebuffer, where each pixel's alpha is then its coverage. nanovg
+// also blends pixels with no coverage within each row's span, which can
+// change dark pixels, so the spans are recorded too: the scratch
+// framebuffer is filled with a colour that such blending changes.
+#define TEXT_CACHE_RUNS 64
+#define TEXT_CACHE_MAX_RUN_BYTES (256 * 1024)
+#define SCRATCH_PIXEL 0x00010101
+
+// The coverage of one nanovg fill call (one line of text)
+typedef struct {
+    int x0, y0, width, height; // bounds in framebuffer pixels
+    int *spans; // start and end (inclusive) of each row's span, or -1
+    uint8_t *cover; // width × height coverage values
+} text_layer_t;
+
+typedef struct {
+    bool used;
+    bool uncacheable; // too large, so drawn by nanovg
+    unsigned long last_use;
+    uint32_t hash;
+    sam_uword_t font;
+    double size;
+    sam_word_t x, y, width; // width is -1 for TEXT
+    char *str;
+    sam_uword_t len;
+    float next_x;
+    unsigned nlayers;
+    text_layer_t *layers;
+} text_run_t;
+
+static text_run_t text_runs[TEXT_CACHE_RUNS];
+static unsigned long text_cache_clock;
+static unsigned long text_cache_hits, text_cache_misses, text_cache_evictions;
+static Uint32 *text_scratch;
+
+void sam_text_cache_stats(unsigned long *hits, unsigned long *misses, unsigned long *evictions)
+{
+    *hits = text_cache_hits;
+    *misses = text_cache_misses;
+    *evictions = text_cache_evictions;
+}
+
+static void load_fonts(void)
+{
+    fonts[FONT_MONO] = nvgCreateFontMem(vg, "Mono", font_mono, sizeof(font_mono), 0);
+    fonts[FONT_MONO_BOLD] = nvgCreateFontMem(vg, "Mono Bold", font_mono_bold, sizeof(font_mono_bold), 0);
+    fonts[FONT_REGULAR] = nvgCreateFontMem(vg, "Regular", font_regular, sizeof(font_regular), 0);
+    fonts[FONT_ITALIC] = nvgCreateFontMem(vg, "Italic", font_italic, sizeof(font_italic), 0);
+    fonts[FONT_BOLD] = nvgCreateFontMem(vg, "Bold", font_bold, sizeof(font_bold), 0);
+    fonts[FONT_BOLDITALIC] = nvgCreateFontMem(vg, "BoldItalic", font_bolditalic, sizeof(font_bolditalic), 0);
+    fonts[FONT_EMOJI] = nvgCreateFontMem(vg, "Emoji", font_emoji, sizeof(font_emoji), 0);
+    nvgAddFallbackFontId(vg, fonts[FONT_REGULAR], fonts[FONT_EMOJI]);
+    // Use Emoji font as fallback for all the rest.
+    for (int i = 0; i < FONT_NUM_FONTS; i++)
+        nvgAddFallbackFontId(vg, fonts[i], fonts[FONT_EMOJI]);
+    fonts_loaded = true;
+}
+
+static void set_text_style(sam_uword_t font, NVGcolor color)
+{
+    if (!fonts_loaded)
+        load_fonts();
+    nvgFontFaceId(vg, fonts[font]);
+    nvgFontSize(vg, text_size * PIXEL_SIZE);
+    nvgFillColor(vg, color);
+}
+
+static uint32_t text_run_hash(sam_uword_t font, sam_word_t x, sam_word_t y, sam_word_t width, const char *str, sam_uword_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (sam_uword_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t)str[i]) * 16777619u;
+    hash = (hash ^ font) * 16777619u;
+    hash = (hash ^ (uint32_t)x) * 16777619u;
+    hash = (hash ^ (uint32_t)y) * 16777619u;
+    return (hash ^ (uint32_t)width) * 16777619u;
+}
+
+static void free_text_layers(text_run_t *run)
+{
+    for (unsigned i = 0; i < run->nlayers; i++)
+        free(run->layers[i].spans);
+    free(run->layers);
+    run->layers = NULL;
+    run->nlayers = 0;
+}
+
+static void free_text_run(text_run_t *run)
+{
+    free_text_layers(run);
+    free(run->str);
+    memset(run, 0, sizeof(text_run_t));
+}
+
+// Draw one line of text into the scratch framebuffer, and move its
+// coverage into `layer`. Returns false if the line cannot be captured.
+static bool capture_text_layer(sam_uword_t font, float x, float y, const char *start, const char *end, text_layer_t *layer, float *next_x)
+{
+    SWNVGcontext *gl = (SWNVGcontext *)nvgInternalParams(vg)->userPtr;
+    nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
+    set_text_style(font, nvgRGBA(255, 255, 255, 255));
+    nvgBeginPath(vg);
+    float nx = nvgText(vg, x, y, start, end);
+    nvgClosePath(vg);
+    int ncalls = gl->ncalls, bounds[4];
+    if (ncalls > 0)
+        memcpy(bounds, gl->calls[0].bounds, sizeof(bounds));
+    for (int i = 1; i < ncalls; i++) {
+        bounds[0] = swnvg__mini(bounds[0], gl->calls[i].bounds[0]);
+        bounds[1] = swnvg__mini(bounds[1], gl->calls[i].bounds[1]);
+        bounds[2] = swnvg__maxi(bounds[2], gl->calls[i].bounds[2]);
+        bounds[3] = swnvg__maxi(bounds[3], gl->calls[i].bounds[3]);
+    }
+    nvgEndFrame(vg);
+    if (next_x != NULL)
+        *next_x = nx;
+    memset(layer, 0, sizeof(text_layer_t));
+    if (ncalls == 0)
+        return true; // Nothing drawn
+
+    int fb_width = sam_display_width * PIXEL_SIZE;
+    if (ncalls > 1) {
+        // Not one fill, so calls may overlap: clear what was drawn.
+        for (int row = bounds[1]; row <= bounds[3]; row++)
+            SDL_memset4(text_scratch + row * fb_width + bounds[0], SCRATCH_PIXEL, bounds[2] - bounds[0] + 1);
+        return false;
+    }
+    layer->x0 = bounds[0];
+    layer->y0 = bounds[1];
+    layer->width = bounds[2] - bounds[0] + 1;
+    layer->height = bounds[3] - bounds[1] + 1;
+    size_t size = layer->height * 2 * sizeof(int) + (size_t)layer->width * layer->height;
+    if (size <= TEXT_CACHE_MAX_RUN_BYTES)
+        layer->spans = malloc(size);
+    if (layer->spans != NULL)
+        layer->cover = (uint8_t *)(layer->spans + layer->height * 2);
+    for (int row = 0; row < layer->height; row++) {
+        Uint32 *p = text_scratch + (layer->y0 + row) * fb_width + layer->x0;
+        int span_start = -1, span_end = -1;
+        for (int i = 0; i < layer->width; i++) {
+            if (p[i] != SCRATCH_PIXEL) {
+                if (span_start < 0)
+                    span_start = i;
+                span_end = i;
+            }
+            if (layer->cover != NULL)
+                layer->cover[row * layer->width + i] = p[i] >> 24;
+        }
+        SDL_memset4(p, SCRATCH_PIXEL, layer->width);
+        if (layer->spans != NULL) {
+            layer->spans[row * 2] = span_start;
+            layer->spans[row * 2 + 1] = span_end;
+        }
+    }
+    return layer->spans != NULL;
+}
+
+// Capture the layers of a run whose key has been filled in.
+static bool capture_text_run(text_run_t *run)
+{
+    int fb_width = sam_display_width * PIXEL_SIZE, fb_height = sam_display_height * PIXEL_SIZE;
+    if (text_scratch == NULL) {
+        text_scratch = malloc((size_t)fb_width * fb_height * bytes_per_pixel);
+        if (text_scratch == NULL)
+            return false;
+        SDL_memset4(text_scratch, SCRATCH_PIXEL, (size_t)fb_width * fb_height);
+    }
+
+    // Split a text box into lines as nvgTextBox does.
+    const char *text_end = run->str + run->len;
+    struct { const char *start, *end; } *lines = NULL;
+    unsigned nlines = 0;
+    float lineh = 0;
+    bool ok = true;
+    if (run->width < 0) {
+        if ((lines = malloc(sizeof(*lines))) == NULL)
+            return false;
+        lines[nlines].start = run->str;
+        lines[nlines++].end = text_end;
+    } else {
+        nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
+        set_text_style(run->font, nvgRGBA(255, 255, 255, 255));
+        nvgTextMetrics(vg, NULL, NULL, &lineh);
+        FONStextRow rows[2];
+        int nrows;
+        const char *string = run->str;
+        while (ok && (nrows = nvgTextBreakLines(vg, string, text_end, run->width * PIXEL_SIZE, rows, 2))) {
+            void *new_lines = realloc(lines, (nlines + nrows) * sizeof(*lines));
+            if (new_lines == NULL)
+                ok = false;
+            else {
+                lines = new_lines;
+                for (int i = 0; i < nrows; i++) {
+                    lines[nlines].start = rows[i].start;
+                    lines[nlines++].end = rows[i].end;
+                }
+                string = rows[nrows - 1].next;
+            }
+        }
+        nvgEndFrame(vg);
+    }
+
+    if (ok && nlines > 0)
+        ok = (run->layers = calloc(nlines, sizeof(text_layer_t))) != NULL;
+    nvgswSetFramebuffer(vg, text_scratch, fb_width, fb_height, fmt->Rshift, fmt->Gshift, fmt->Bshift, 24);
+    size_t bytes = 0;
+    float y = run->y * PIXEL_SIZE;
+    for (unsigned i = 0; ok && i < nlines; i++, y += lineh) {
+        text_layer_t *layer = &run->layers[run->nlayers++];
+        ok = capture_text_layer(run->font, run->x * PIXEL_SIZE, y, lines[i].start, lines[i].end, layer, &run->next_x);
+        bytes += (size_t)layer->width * layer->height;
+        if (bytes > TEXT_CACHE_MAX_RUN_BYTES)
+            ok = false;
+    }
+    nvgswSetFramebuffer(vg, framebuffer, fb_width, fb_height, fmt->Rshift, fmt->Gshift, fmt->Bshift, 24);
+    free(lines);
+    return ok;
+}
+
+// Blend a captured layer in `color` into the framebuffer, as nanovg's
+// scanlineSolid does.
+static void draw_text_layer(const text_layer_t *layer, NVGcolor color)
+{
+    SWNVGcontext *gl = (SWNVGcontext *)nvgInternalParams(vg)->userPtr;
+    int linear = gl->flags & NVG_SRGB ? 1 : 0;
+    rgba32_t c = color_to_pixel(color);
+    for (int row = 0; row < layer->height; row++) {
+        int span_start = layer->spans[row * 2], span_end = layer->spans[row * 2 + 1];
+        if (span_start < 0)
+            continue;
+        unsigned char *dst = (unsigned char *)framebuffer + (layer->y0 + row) * framebuffer_pitch + (layer->x0 + span_start) * bytes_per_pixel;
+        const uint8_t *cover = &layer->cover[row * layer->width + span_start];
+        if (RGBA32_IS_OPAQUE(c))
+            for (int i = span_start; i <= span_end; i++, dst += 4)
+                swnvg__blendOpaque(dst, *cover++, c, linear);
+        else
+            for (int i = span_start; i <= span_end; i++, dst += 4)
+                swnvg__blend(dst, *cover++, COLOR0(c), COLOR1(c), COLOR2(c), COLOR3(c), linear);
+    }
+    mark_dirty(layer->x0, layer->y0, layer->x0 + layer->width, layer->y0 + layer->height);
+}
+
+// Draw `str` from the cache, capturing it first if needed. `width` is
+// the width of the text box, or -1 for a single line. Returns false if
+// the text cannot be cached, in which case nothing is drawn.
+// Runs that cannot be captured are remembered, so they are not tried
+// again.
+static bool draw_cached_text(sam_uword_t font, NVGcolor color, sam_word_t x, sam_word_t y, sam_word_t width, sam_string_t *str, float *next_x)
+{
+    uint32_t hash = text_run_hash(font, x, y, width, str->str, str->len);
+    text_run_t *run = NULL, *oldest = &text_runs[0];
+    for (unsigned i = 0; i < TEXT_CACHE_RUNS; i++) {
+        text_run_t *r = &text_runs[i];
+        if (r->used && r->hash == hash && r->font == font && r->size == text_size &&
+            r->x == x && r->y == y && r->width == width &&
+            r->len == str->len && memcmp(r->str, str->str, str->len) == 0) {
+            run = r;
+            break;
+        }
+        if (!r->used || (oldest->used && r->last_use < oldest->last_use))
+            oldest = r;
+    }
+
+    if (run != NULL && !run->uncacheable)
+        text_cache_hits++;
+    else if (run != NULL) {
+        text_cache_misses++;
+        run->last_use = ++text_cache_clock;
+        return false;
+    } else {
+        text_cache_misses++;
+        run = oldest;
+        if (run->used) {
+            text_cache_evictions++;
+            free_text_run(run);
+        }
+        run->str = malloc(str->len);
+        if (run->str == NULL)
+            return false;
+        memcpy(run->str, str->str, str->len);
+        run->len = str->len;
+        run->hash = hash;
+        run->font = font;
+        run->size = text_size;
+        run->x = x;
+        run->y = y;
+        run->width = width;
+        run->used = true;
+        flush_draws(); // Capturing uses its own nanovg frame
+        if (!capture_text_run(run)) {
+            free_text_layers(run);
+            run->uncacheable = true;
+            run->last_use = ++text_cache_clock;
+            return false;
+        }
+    }
+
+    run->last_use = ++text_cache_clock;
+    need_window = true;
+    // The layers must be drawn after batched draws that they overlap.
+    for (unsigned i = 0; i < run->nlayers; i++) {
+        text_layer_t *layer = &run->layers[i];
+        if (layer->spans != NULL && batch_overlaps(layer->x0, layer->y0, layer->x0 + layer->width, layer->y0 + layer->height)) {
+            flush_draws();
+            break;
+        }
+    }
+    for (unsigned i = 0; i < run->nlayers; i++)
+        if (run->layers[i].spans != NULL)
+            draw_text_layer(&run->layers[i], color);
+    if (next_x != NULL)
+        *next_x = run->next_x;
+    return true;
+}
+
+static void free_text_cache(void)
+{
+    for (unsigned i = 0; i < TEXT_CACHE_RUNS; i++)
+        free_text_run(&text_runs[i]);
+    free(text_scratch);
+    text_scratch = NULL;
+}
+
+// Convert row `y` of the display to 8-bit RGB, or RGBA if `alpha`,
+// taking the top-left framebuffer pixel of each display pixel.
+static void get_display_row(unsigned y, uint8_t *out, bool alpha)
+{
+    const Uint32 *p = (const Uint32 *)((const Uint8 *)framebuffer + y * PIXEL_SIZE * framebuffer_pitch);
+    for (unsigned x = 0; x < sam_display_width; x++, p += PIXEL_SIZE) {
+        *out++ = (*p >> fmt->Rshift) & 0xff;
+        *out++ = (*p >> fmt->Gshift) & 0xff;
+        *out++ = (*p >> fmt->Bshift) & 0xff;
+        if (alpha)
+            *out++ = *p >> 24;
+    }
+}
+
+static void record_frame(void)
+{
+    uint8_t *frame = sam_record_begin_frame();
+    for (unsigned y = 0; y < sam_display_height; y++)
+        get_display_row(y, frame + y * sam_display_width * 4, true);
+    sam_record_end_frame();
+}
+
+// Optional presenter thread: when SAM_PRESENT_THREAD is non-zero, drawing
+// goes to a back buffer. On each update, the VM thread copies the changed
+// rectangles to the window surface, and the presenter thread presents them
+// with SDL_UpdateWindowSurfaceRects, so the VM does not wait for the window
+// system. macOS only allows window calls on the main thread, so there the
+// presenter thread is never used.
+static SDL_Thread *presenter;
+static SDL_mutex *present_lock; // held while presenting
+static SDL_cond *present_ready;
+static SDL_Rect present_rects[MAX_DIRTY_RECTS];
+static int npresent; // rectangles waiting to be presented
+static bool presenter_quit;
+
+static int presenter_loop(void *data)
+{
+    (void)data;
+    SDL_LockMutex(present_lock);
+    for (;;) {
+        while (npresent == 0 && !presenter_quit)
+            SDL_CondWait(present_ready, present_lock);
+        if (presenter_quit)
+            break;
+        SDL_UpdateWindowSurfaceRects(win, present_rects, npresent);
+        npresent = 0;
+    }
+    SDL_UnlockMutex(present_lock);
+    return 0;
+}
+
+// Copy the dirty rectangles to the window surface and pass them to the
+// presenter thread. Must be called with present_lock held; releases it.
+static void hand_off_frame(void)
+{
+    for (int i = 0; i < ndirty; i++) {
+        SDL_Rect *r = &dirty_rects[i];
+        for (int y = r->y; y < r->y + r->h; y++)
+            memcpy((Uint8 *)srf->pixels + y * srf->pitch + r->x * bytes_per_pixel,
+                   (Uint8 *)framebuffer + y * framebuffer_pitch + r->x * bytes_per_pixel,
+                   r->w * bytes_per_pixel);
+        present_rects[i] = *r;
+    }
+    npresent = ndirty;
+    SDL_CondSignal(present_ready);
+    SDL_UnlockMutex(present_lock);
+}
+
+static sam_word_t init_presenter(void)
+{
+    framebuffer_pitch = sam_display_width * PIXEL_SIZE * bytes_per_pixel;
+    framebuffer = calloc(sam_display_height * PIXEL_SIZE, framebuffer_pitch);
+    framebuffer_allocated = true;
+    present_lock = SDL_CreateMutex();
+    present_ready = SDL_CreateCond();
+    if (framebuffer == NULL || present_lock == NULL || present_ready == NULL)
+        return SAM_ERROR_NO_MEMORY;
+    presenter = SDL_CreateThread(presenter_loop, "sam-present", NULL);
+    if (presenter == NULL)
+        return SAM_ERROR_TRAP_INIT;
+    return SAM_ERROR_OK;
+}
+
+static void finish_presenter(void)
+{
+    SDL_LockMutex(present_lock);
+    presenter_quit = true;
+    SDL_CondSignal(present_ready);
+    SDL_UnlockMutex(present_lock);
+    SDL_WaitThread(presenter, NULL);
+    presenter = NULL;
+    SDL_DestroyCond(present_ready);
+    SDL_DestroyMutex(present_lock);
+}
 
 void sam_update_screen(void)
 {
-    SDL_ShowWindow(win);
-    SDL_UpdateWindowSurface(win);
+    flush_draws();
+    if (ndirty == 0)
+        return; // Nothing has changed
+    if (presenter != NULL && SDL_TryLockMutex(present_lock) != 0)
+        return; // Still presenting the last update; try again next time
+    if (sam_record_file != NULL)
+        record_frame();
+    if (presenter != NULL) {
+        SDL_ShowWindow(win);
+        hand_off_frame();
+    } else if (win != NULL) {
+        SDL_ShowWindow(win);
+        SDL_UpdateWindowSurfaceRects(win, dirty_rects, ndirty);
+    }
+    ndirty = 0;
 }
 
 int sam_sdl_process_events(void)
 {
     SDL_bool quit = 0;
     SDL_Event event;
-    while (SDL_PollEvent(&event)) {
+    while (!sam_headless && SDL_PollEvent(&event)) {
         switch (event.type) {
         case SDL_WINDOWEVENT:
-            if (event.window.event == SDL_WINDOWEVENT_CLOSE) {
+            if (event.window.event == SDL_WINDOWEVENT_EXPOSED)
+                mark_dirty(0, 0, sam_display_width * PIXEL_SIZE, sam_display_height * PIXEL_SIZE);
+            else if (event.window.event == SDL_WINDOWEVENT_CLOSE) {
                 if (win != NULL) {
+                    if (presenter != NULL)
+                        finish_presenter();
                     SDL_DestroyWindow(win);
                     win = NULL;
                     quit = 1;
@@ -207,9 +890,22 @@ int sam_sdl_process_events(void)
                 quit = 1;
                 break;
             }
+            if (!event.key.repeat)
+                keys_down.keys[queue_add(&keys_down.first, &keys_down.count)] = event.key.keysym.scancode;
+            break;
+        case SDL_KEYUP:
+            keys_up.keys[queue_add(&keys_up.first, &keys_up.count)] = event.key.keysym.scancode;
+            break;
+        case SDL_TEXTINPUT:
+            memcpy(text_input.text[queue_add(&text_input.first, &text_input.count)], event.text.text, SDL_TEXTINPUTEVENT_TEXT_SIZE);
             break;
         }
     }
+    if (!sam_headless) {
+        int numkeys;
+        const Uint8 *state = SDL_GetKeyboardState(&numkeys);
+        memcpy(keymap, state, numkeys < SDL_NUM_SCANCODES ? numkeys : SDL_NUM_SCANCODES);
+    }
 
     if (need_window) {
         Uint64 now = SDL_GetTicks64();
@@ -222,6 +918,18 @@ int sam_sdl_process_events(void)
     return quit;
 }
 
+// Process events if at least POLL_INTERVAL ms have passed since last time.
+#define POLL_INTERVAL 5
+void sam_sdl_poll(void)
+{
+    static Uint64 last_poll_time;
+    Uint64 now = SDL_GetTicks64();
+    if (now - last_poll_time >= POLL_INTERVAL) {
+        last_poll_time = now;
+        sam_sdl_process_events();
+    }
+}
+
 int sam_sdl_window_used(void)
 {
     return need_window;
@@ -230,10 +938,49 @@ int sam_sdl_window_used(void)
 // Code adapted from https://stackoverflow.com/questions/53033971/how-to-get-the-color-of-a-specific-pixel-from-sdl-surface
 uint32_t sam_getpixel(int x, int y)
 {
-    Uint32 *p = (Uint32 *)((Uint8 *)srf->pixels + y * srf->pitch * PIXEL_SIZE + x * bytes_per_pixel * PIXEL_SIZE);
+    flush_draws();
+    Uint32 *p = (Uint32 *)((Uint8 *)framebuffer + y * framebuffer_pitch * PIXEL_SIZE + x * bytes_per_pixel * PIXEL_SIZE);
     return *p;
 }
 
+// Dump the screen as a binary PPM, or as a PNG if `filename` ends in
+// ".png". Returns 0 on success, or -1 on error.
+int sam_dump_screen(const char *filename)
+{
+    flush_draws();
+    size_t row_size = sam_display_width * 3;
+    size_t len = strlen(filename);
+    if (len >= 4 && strcmp(filename + len - 4, ".png") == 0) {
+        uint8_t *image = malloc(row_size * sam_display_height);
+        if (image == NULL)
+            return -1;
+        for (unsigned y = 0; y < sam_display_height; y++)
+            get_display_row(y, image + y * row_size, false);
+        int ok = stbi_write_png(filename, sam_display_width, sam_display_height, 3, image, row_size);
+        free(image);
+        return ok ? 0 : -1;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    uint8_t *row = malloc(row_size);
+    int res = -1;
+    if (fp != NULL && row != NULL) {
+        fprintf(fp, "P6\n# SAM screen dump\n%u %u\n255\n", sam_display_width, sam_display_height);
+        unsigned y;
+        for (y = 0; y < sam_display_height; y++) {
+            get_display_row(y, row, false);
+            if (fwrite(row, 1, row_size, fp) != row_size)
+                break;
+        }
+        if (y == sam_display_height)
+            res = 0;
+    }
+    free(row);
+    if (fp != NULL && fclose(fp) != 0)
+        res = -1;
+    return res;
+}
+
 // Set display dimensions to those of largest possible window
 static sam_word_t set_largest_window(void) {
     sam_word_t error = SAM_ERROR_OK;
@@ -266,11 +1013,12 @@ unsigned parse_dimension(char *var, unsigned default_val) {
     return default_val;
 }
 
-sam_word_t sam_sdl_init(void)
+// Set up the framebuffer in a window
+static sam_word_t init_window(void)
 {
     sam_word_t error = SAM_ERROR_OK;
 
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0)
+    if (SDL_Init(SDL_INIT_VIDEO) != 0)
         return SAM_ERROR_TRAP_INIT;
 
     set_largest_window();
@@ -282,36 +1030,69 @@ sam_word_t sam_sdl_init(void)
         HALT(SAM_ERROR_TRAP_INIT);
 
     srf = SDL_GetWindowSurface(win);
-    vg = nvgswCreate(NVG_SRGB | NVG_AUTOW_DEFAULT);
     fmt = srf->format;
-    nvgswSetFramebuffer(vg, srf->pixels, srf->w, srf->h, fmt->Rshift, fmt->Gshift, fmt->Bshift, 24);
+#ifdef __APPLE__
+    bool present_thread = false;
+#else
+    bool present_thread = parse_dimension("SAM_PRESENT_THREAD", 0) != 0;
+#endif
+    if (present_thread)
+        HALT_IF_ERROR(init_presenter());
+    else {
+        framebuffer = srf->pixels;
+        framebuffer_pitch = srf->pitch;
+    }
 
-    fonts[FONT_MONO] = nvgCreateFontMem(vg, "Mono", font_mono, sizeof(font_mono), 0);
-    fonts[FONT_MONO_BOLD] = nvgCreateFontMem(vg, "Mono Bold", font_mono_bold, sizeof(font_mono_bold), 0);
-    fonts[FONT_REGULAR] = nvgCreateFontMem(vg, "Regular", font_regular, sizeof(font_regular), 0);
-    fonts[FONT_ITALIC] = nvgCreateFontMem(vg, "Italic", font_italic, sizeof(font_italic), 0);
-    fonts[FONT_BOLD] = nvgCreateFontMem(vg, "Bold", font_bold, sizeof(font_bold), 0);
-    fonts[FONT_BOLDITALIC] = nvgCreateFontMem(vg, "BoldItalic", font_bolditalic, sizeof(font_bolditalic), 0);
-    fonts[FONT_EMOJI] = nvgCreateFontMem(vg, "Emoji", font_emoji, sizeof(font_emoji), 0);
-    nvgAddFallbackFontId(vg, fonts[FONT_REGULAR], fonts[FONT_EMOJI]);
-    // Use Emoji font as fallback for all the rest.
-    for (int i = 0; i < FONT_NUM_FONTS; i++)
-        nvgAddFallbackFontId(vg, fonts[i], fonts[FONT_EMOJI]);
+ error:
+    return error;
+}
 
-    Mix_Init(0);
-    if (Mix_OpenAudio(48000, MIX_DEFAULT_FORMAT, 2, 4096) != 0)
-        HALT(SAM_ERROR_TRAP_INIT);
-    HALT_IF_ERROR(load_audio_memory(sound_applause, sizeof(sound_applause), &sounds[SOUND_APPLAUSE]));
-    HALT_IF_ERROR(load_audio_memory(sound_beep, sizeof(sound_beep), &sounds[SOUND_BEEP]));
-    HALT_IF_ERROR(load_audio_memory(sound_bell, sizeof(sound_bell), &sounds[SOUND_BELL]));
-    HALT_IF_ERROR(load_audio_memory(sound_cow, sizeof(sound_cow), &sounds[SOUND_COW]));
-    HALT_IF_ERROR(load_audio_memory(sound_explosion, sizeof(sound_explosion), &sounds[SOUND_EXPLOSION]));
-    HALT_IF_ERROR(load_audio_memory(sound_gong, sizeof(sound_gong), &sounds[SOUND_GONG]));
-    HALT_IF_ERROR(load_audio_memory(sound_horse, sizeof(sound_horse), &sounds[SOUND_HORSE]));
-    HALT_IF_ERROR(load_audio_memory(sound_laser, sizeof(sound_laser), &sounds[SOUND_LASER]));
-    HALT_IF_ERROR(load_audio_memory(sound_oops, sizeof(sound_oops), &sounds[SOUND_OOPS]));
-
-    keymap = SDL_GetKeyboardState(&numkeys);
+// Set up the framebuffer in memory, without initialising SDL video
+static sam_word_t init_headless(void)
+{
+    sam_display_width = parse_dimension("SAM_DISPLAY_WIDTH", sam_display_width);
+    sam_display_height = parse_dimension("SAM_DISPLAY_HEIGHT", sam_display_height);
+
+    fmt = &headless_fmt;
+    framebuffer_pitch = sam_display_width * PIXEL_SIZE * bytes_per_pixel;
+    framebuffer = calloc(sam_display_height * PIXEL_SIZE, framebuffer_pitch);
+    if (framebuffer == NULL)
+        return SAM_ERROR_NO_MEMORY;
+
+    return SAM_ERROR_OK;
+}
+
+// Rasterise in horizontal bands on a thread pool; the calling thread
+// works on a band too. SAM_RENDER_TILES=1 disables threading.
+static sam_word_t init_render_threads(void)
+{
+    unsigned tiles = parse_dimension("SAM_RENDER_TILES", SDL_GetCPUCount());
+    if (tiles < 2)
+        return SAM_ERROR_OK;
+    unsigned cpus = SDL_GetCPUCount();
+    sam_word_t error = sam_threadpool_init((tiles < cpus ? tiles : cpus) - 1);
+    if (error == SAM_ERROR_OK)
+        nvgswSetThreading(vg, 1, tiles, sam_threadpool_submit, sam_threadpool_wait);
+    return error;
+}
+
+sam_word_t sam_sdl_init(void)
+{
+    sam_word_t error = SAM_ERROR_OK;
+
+    if (sam_headless)
+        HALT_IF_ERROR(init_headless());
+    else
+        HALT_IF_ERROR(init_window());
+
+    if (sam_record_file != NULL)
+        HALT_IF_ERROR(sam_record_start(sam_record_file, sam_record_delta, sam_display_width, sam_display_height));
+
+    vg = nvgswCreate(NVG_SRGB | NVG_AUTOW_DEFAULT);
+    HALT_IF_ERROR(init_render_threads());
+    nvgswSetFramebuffer(vg, framebuffer, sam_display_width * PIXEL_SIZE, sam_display_height * PIXEL_SIZE, fmt->Rshift, fmt->Gshift, fmt->Bshift, 24);
+
+    // Fonts and sounds are loaded when first used.
 
     last_update_time = 0;
 
@@ -321,13 +1102,26 @@ error:
 
 void sam_sdl_finish(void)
 {
-    // Wait for sounds playing to finish
-    while (Mix_PlayingMusic()) {
-        SDL_Delay(100);
+    if (presenter != NULL)
+        finish_presenter();
+    if (sam_record_file != NULL) {
+        sam_update_screen(); // Record the final screen
+        if (sam_record_finish() != 0)
+            fprintf(stderr, "error writing recording %s\n", sam_record_file);
+    }
+    sam_threadpool_finish();
+    free_text_cache();
+    if (audio_open)
+        sam_audio_finish(); // Waits for sounds playing to finish
+    if (sam_headless) {
+        free(framebuffer);
+        return;
     }
 
     SDL_DestroyWindow(win);
     SDL_Quit();
+    if (framebuffer_allocated)
+        free(framebuffer);
 }
 
 sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
@@ -461,14 +1255,23 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
         {
             NVGcolor color;
             POP_COLOR(color);
-            nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
+            if (color.a == 255) {
+                // Nothing drawn so far will be visible, so discard it.
+                if (frame_open) {
+                    nvgCancelFrame(vg);
+                    frame_open = false;
+                    batched_draws = 0;
+                }
+                fill_rect_direct(0, 0, sam_display_width, sam_display_height, color);
+                break;
+            }
+            begin_draw();
             nvgBeginPath(vg);
             nvgFillColor(vg, color);
             nvgRect(vg, 0, 0, sam_display_width * PIXEL_SIZE, sam_display_height * PIXEL_SIZE);
             nvgFill(vg);
             nvgClosePath(vg);
-            nvgEndFrame(vg);
-            need_window = true;
+            end_draw();
         }
         break;
     case TRAP_GRAPHICS_SETDOT:
@@ -478,15 +1281,18 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
             POP_COLOR(color);
             POP_UINT(y);
             POP_UINT(x);
-            nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
+            if (color.a == 255) {
+                fill_rect_direct(x, y, 1, 1, color);
+                break;
+            }
+            begin_draw();
             nvgBeginPath(vg);
             nvgFillColor(vg, color);
             nvgLineTo(vg, x * PIXEL_SIZE, y * PIXEL_SIZE);
             nvgRect(vg, x * PIXEL_SIZE, y * PIXEL_SIZE, PIXEL_SIZE, PIXEL_SIZE);
             nvgFill(vg);
             nvgClosePath(vg);
-            nvgEndFrame(vg);
-            need_window = true;
+            end_draw();
         }
         break;
     case TRAP_GRAPHICS_DRAWLINE:
@@ -498,7 +1304,7 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
             POP_UINT(x2);
             POP_UINT(y1);
             POP_UINT(x1);
-            nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
+            begin_draw();
             nvgBeginPath(vg);
             nvgStrokeColor(vg, color);
             nvgMoveTo(vg, x1 * PIXEL_SIZE, y1 * PIXEL_SIZE);
@@ -506,8 +1312,7 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
             nvgStrokeWidth(vg, PIXEL_SIZE);
             nvgStroke(vg);
             nvgClosePath(vg);
-            nvgEndFrame(vg);
-            need_window = true;
+            end_draw();
         }
         break;
     case TRAP_GRAPHICS_DRAWRECT:
@@ -519,15 +1324,14 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
             POP_UINT(width);
             POP_UINT(y);
             POP_UINT(x);
-            nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
+            begin_draw();
             nvgBeginPath(vg);
             nvgStrokeColor(vg, color);
             nvgRect(vg, x * PIXEL_SIZE, y * PIXEL_SIZE, width * PIXEL_SIZE, height * PIXEL_SIZE);
             nvgStrokeWidth(vg, PIXEL_SIZE);
             nvgStroke(vg);
             nvgClosePath(vg);
-            nvgEndFrame(vg);
-            need_window = true;
+            end_draw();
         }
         break;
     case TRAP_GRAPHICS_DRAWROUNDRECT:
@@ -540,15 +1344,14 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
             POP_UINT(width);
             POP_UINT(y);
             POP_UINT(x);
-            nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
+            begin_draw();
             nvgBeginPath(vg);
             nvgStrokeColor(vg, color);
             nvgRoundedRect(vg, x * PIXEL_SIZE, y * PIXEL_SIZE, width * PIXEL_SIZE, height * PIXEL_SIZE, radius * PIXEL_SIZE);
             nvgStrokeWidth(vg, PIXEL_SIZE);
             nvgStroke(vg);
             nvgClosePath(vg);
-            nvgEndFrame(vg);
-            need_window = true;
+            end_draw();
         }
         break;
     case TRAP_GRAPHICS_FILLRECT:
@@ -560,14 +1363,17 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
             POP_UINT(width);
             POP_UINT(y);
             POP_UINT(x);
-            nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
+            if (color.a == 255) {
+                fill_rect_direct(x, y, width, height, color);
+                break;
+            }
+            begin_draw();
             nvgBeginPath(vg);
             nvgFillColor(vg, color);
             nvgRect(vg, x * PIXEL_SIZE, y * PIXEL_SIZE, width * PIXEL_SIZE, height * PIXEL_SIZE);
             nvgFill(vg);
             nvgClosePath(vg);
-            nvgEndFrame(vg);
-            need_window = true;
+            end_draw();
         }
         break;
     case TRAP_GRAPHICS_DRAWCIRCLE:
@@ -578,15 +1384,14 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
             POP_UINT(radius);
             POP_UINT(yCenter);
             POP_UINT(xCenter);
-            nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
+            begin_draw();
             nvgBeginPath(vg);
             nvgStrokeColor(vg, color);
             nvgCircle(vg, xCenter * PIXEL_SIZE, yCenter * PIXEL_SIZE, radius * PIXEL_SIZE);
             nvgStrokeWidth(vg, PIXEL_SIZE);
             nvgStroke(vg);
             nvgClosePath(vg);
-            nvgEndFrame(vg);
-            need_window = true;
+            end_draw();
         }
         break;
     case TRAP_GRAPHICS_FILLCIRCLE:
@@ -597,26 +1402,63 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
             POP_UINT(radius);
             POP_UINT(yCenter);
             POP_UINT(xCenter);
-            nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
+            begin_draw();
             nvgBeginPath(vg);
             nvgFillColor(vg, color);
             nvgCircle(vg, xCenter * PIXEL_SIZE, yCenter * PIXEL_SIZE, radius * PIXEL_SIZE);
             nvgFill(vg);
             nvgClosePath(vg);
-            nvgEndFrame(vg);
-            need_window = true;
+            end_draw();
         }
         break;
     case TRAP_GRAPHICS_DRAWBITMAP:
         {
-            sam_word_t bitmap, x, y;
-            NVGcolor color;
-            POP_COLOR(color);
+            // Draw an array of colours, `width` to a row, at (x, y).
+            // Opaque colours are copied, and others blended as nanovg
+            // blends them.
+            sam_uword_t x, y, width;
+            POP_UINT(width);
             POP_UINT(y);
             POP_UINT(x);
-            POP_UINT(bitmap);
-            // TODO
+            sam_blob_t *blob;
+            POP_BLOB(blob);
+            sam_array_t *bitmap;
+            EXTRACT_BLOB(blob, SAM_BLOB_ARRAY, sam_array_t, bitmap);
+            flush_draws();
             need_window = true;
+            if (width == 0 || x >= sam_display_width)
+                break;
+
+            sam_uword_t visible_width = width < sam_display_width - x ? width : sam_display_width - x;
+            sam_uword_t rows = (bitmap->sp + width - 1) / width;
+            if (y >= sam_display_height)
+                rows = 0;
+            else if (rows > sam_display_height - y)
+                rows = sam_display_height - y;
+            mark_dirty(x * PIXEL_SIZE, y * PIXEL_SIZE, (x + visible_width) * PIXEL_SIZE, (y + rows) * PIXEL_SIZE);
+            for (sam_uword_t row = 0; row < rows; row++) {
+                sam_word_t *colors = &bitmap->data[row * width];
+                sam_uword_t ncolors = bitmap->sp - row * width;
+                if (ncolors > visible_width)
+                    ncolors = visible_width;
+                for (sam_uword_t i = 0; i < ncolors; i++) {
+                    sam_word_t color_word = colors[i];
+                    CHECK_TYPE(color_word, SAM_INT_TAG_MASK, SAM_INT_TAG);
+                    NVGcolor color = {.c = (unsigned int)LRSHIFT(color_word, SAM_INT_SHIFT)};
+                    if (color.a == 0)
+                        continue;
+                    Uint32 pixel = color_to_pixel(color);
+                    for (unsigned dy = 0; dy < PIXEL_SIZE; dy++) {
+                        Uint8 *dst = (Uint8 *)framebuffer + ((y + row) * PIXEL_SIZE + dy) * framebuffer_pitch + (x + i) * PIXEL_SIZE * bytes_per_pixel;
+                        for (unsigned dx = 0; dx < PIXEL_SIZE; dx++, dst += bytes_per_pixel) {
+                            if (color.a == 255)
+                                *(Uint32 *)dst = pixel;
+                            else
+                                swnvg__blend(dst, 255, COLOR0(pixel), COLOR1(pixel), COLOR2(pixel), COLOR3(pixel), 1);
+                        }
+                    }
+                }
+            }
         }
         break;
     case TRAP_GRAPHICS_FONT_MONO:
@@ -664,16 +1506,16 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
             EXTRACT_BLOB(blob, SAM_BLOB_STRING, sam_string_t, str);
 
             // FIXME: make the following parameters or state
-            nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
-            nvgFontFaceId(vg, fonts[font]);
-            nvgFontSize(vg, text_size * PIXEL_SIZE);
-            nvgFillColor(vg, color);
-            nvgBeginPath(vg);
-            float new_x = nvgText(vg, x * PIXEL_SIZE, y * PIXEL_SIZE, str->str, str->str + str->len);
-            nvgClosePath(vg);
-            nvgEndFrame(vg);
+            float new_x;
+            if (!draw_cached_text(font, color, x, y, -1, str, &new_x)) {
+                begin_draw();
+                set_text_style(font, color);
+                nvgBeginPath(vg);
+                new_x = nvgText(vg, x * PIXEL_SIZE, y * PIXEL_SIZE, str->str, str->str + str->len);
+                nvgClosePath(vg);
+                end_draw();
+            }
             PUSH_FLOAT(new_x);
-            need_window = true;
         }
         break;
     case TRAP_GRAPHICS_TEXTBOX:
@@ -694,15 +1536,14 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
             EXTRACT_BLOB(blob, SAM_BLOB_STRING, sam_string_t, str);
 
             // FIXME: make the following parameters or state
-            nvgBeginFrame(vg, sam_display_width, sam_display_height, (float)PIXEL_SIZE);
-            nvgFontFaceId(vg, fonts[font]);
-            nvgFontSize(vg, text_size * PIXEL_SIZE);
-            nvgFillColor(vg, color);
-            nvgBeginPath(vg);
-            nvgTextBox(vg, x * PIXEL_SIZE, y * PIXEL_SIZE, width * PIXEL_SIZE, str->str, str->str + str->len);
-            nvgClosePath(vg);
-            nvgEndFrame(vg);
-            need_window = true;
+            if (!draw_cached_text(font, color, x, y, width, str, NULL)) {
+                begin_draw();
+                set_text_style(font, color);
+                nvgBeginPath(vg);
+                nvgTextBox(vg, x * PIXEL_SIZE, y * PIXEL_SIZE, width * PIXEL_SIZE, str->str, str->str + str->len);
+                nvgClosePath(vg);
+                end_draw();
+            }
         }
         break;
     case TRAP_GRAPHICS_FPS:
@@ -715,6 +1556,9 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
     case TRAP_GRAPHICS_WAIT:
         sam_sdl_wait();
         break;
+    case TRAP_GRAPHICS_FLUSH:
+        flush_draws();
+        break;
      default:
         error = SAM_ERROR_INVALID_TRAP;
         break;
@@ -726,6 +1570,8 @@ sam_word_t sam_graphics_trap(sam_state_t *state, sam_uword_t function)
 
 void sam_sdl_wait(void)
 {
+    if (sam_headless)
+        return; // There is no window to close
     while (sam_sdl_process_events() == 0) {
         SDL_Delay(sam_update_interval);
     }
@@ -851,6 +1697,8 @@ char *sam_graphics_trap_name(sam_word_t function)
         return "TEXT_SIZE";
     case TRAP_GRAPHICS_TEXT:
         return "TEXT";
+    case TRAP_GRAPHICS_FLUSH:
+        return "FLUSH";
     default:
         return NULL;
     }
@@ -866,13 +1714,37 @@ sam_word_t sam_input_trap(sam_state_t *state, sam_uword_t function)
         {
             sam_word_t key;
             POP_INT(key);
-            if (key >= numkeys)
+            if (key < 0 || key >= SDL_NUM_SCANCODES)
                 HALT(SAM_ERROR_WRONG_TYPE);
-            SDL_PumpEvents();
             PUSH_BOOL(keymap[key] != 0);
             need_window = true;
         }
         break;
+    case TRAP_INPUT_KEYDOWN:
+        if (keys_down.count == 0)
+            PUSH_WORD(SAM_VALUE_NULL);
+        else
+            PUSH_INT(keys_down.keys[queue_remove(&keys_down.first, &keys_down.count)]);
+        need_window = true;
+        break;
+    case TRAP_INPUT_KEYUP:
+        if (keys_up.count == 0)
+            PUSH_WORD(SAM_VALUE_NULL);
+        else
+            PUSH_INT(keys_up.keys[queue_remove(&keys_up.first, &keys_up.count)]);
+        need_window = true;
+        break;
+    case TRAP_INPUT_TEXTINPUT:
+        if (text_input.count == 0)
+            PUSH_WORD(SAM_VALUE_NULL);
+        else {
+            const char *text = text_input.text[queue_remove(&text_input.first, &text_input.count)];
+            sam_blob_t *str;
+            HALT_IF_ERROR(sam_string_new(&str, text, strlen(text)));
+            PUSH_BLOB(str);
+        }
+        need_window = true;
+        break;
     case TRAP_INPUT_KEY_A:
         PUSH_INT(SDL_SCANCODE_A);
         break;
@@ -1622,6 +2494,12 @@ char *sam_input_trap_name(sam_word_t function)
     switch (function) {
     case TRAP_INPUT_KEYPRESSED:
       return "KEYPRESSED";
+    case TRAP_INPUT_KEYDOWN:
+      return "KEYDOWN";
+    case TRAP_INPUT_KEYUP:
+      return "KEYUP";
+    case TRAP_INPUT_TEXTINPUT:
+      return "TEXTINPUT";
     case TRAP_INPUT_KEY_A:
       return "KEY_A";
     case TRAP_INPUT_KEY_B:
@@ -2117,6 +2995,27 @@ char *sam_input_trap_name(sam_word_t function)
     }
 }
 
+#define POP_AUDIOFILE(var)                                              \
+    do {                                                                \
+        sam_blob_t *_blob;                                              \
+        POP_BLOB(_blob);                                                \
+        EXTRACT_BLOB(_blob, SAM_BLOB_AUDIOFILE, sam_audiofile_t, var);  \
+    } while (0)
+
+// Envelope used for new synthesiser notes
+static sam_synth_note_t synth_envelope = {
+    .attack = 0.005f,
+    .decay = 0.0f,
+    .sustain = 1.0f,
+    .release = 0.05f,
+};
+
+static unsigned long seconds_to_frame(sam_audiofile_t *audio, sam_float_t time)
+{
+    double frame = time * sam_audio_rate();
+    return frame < 0 ? 0 : (frame > audio->frames ? audio->frames : (unsigned long)frame);
+}
+
 sam_word_t sam_audio_trap(sam_state_t *state, sam_uword_t function)
 {
 #define s ((sam_array_t *)state->s0->data)
@@ -2127,61 +3026,190 @@ sam_word_t sam_audio_trap(sam_state_t *state, sam_uword_t function)
         // FIXME
         break;
     case TRAP_AUDIO_VOL:
+        {
+            // Set the volume of a sound, from 0 to 1.
+            sam_float_t volume;
+            POP_FLOAT(volume);
+            sam_audiofile_t *audio;
+            POP_AUDIOFILE(audio);
+            sam_audio_lock();
+            audio->volume = volume < 0 ? 0 : (volume > 1 ? 1 : volume);
+            sam_audio_unlock();
+        }
         break;
     case TRAP_AUDIO_PITCH:
+        {
+            // Set the pitch of a sound, in semitones from normal. This
+            // also changes its speed.
+            sam_float_t semitones;
+            POP_FLOAT(semitones);
+            sam_audiofile_t *audio;
+            POP_AUDIOFILE(audio);
+            sam_audio_lock();
+            audio->speed = pow(2.0, semitones / 12.0);
+            sam_audio_unlock();
+        }
         break;
     case TRAP_AUDIO_CUE:
+        {
+            // Set the time in seconds at which a sound starts playing.
+            sam_float_t time;
+            POP_FLOAT(time);
+            sam_audiofile_t *audio;
+            POP_AUDIOFILE(audio);
+            sam_audio_lock();
+            audio->cue = seconds_to_frame(audio, time);
+            sam_audio_unlock();
+        }
         break;
     case TRAP_AUDIO_PLAY:
         {
-            sam_blob_t *blob;
-            POP_BLOB(blob);
             sam_audiofile_t *audio;
-            EXTRACT_BLOB(blob, SAM_BLOB_AUDIOFILE, sam_audiofile_t, audio);
-            Mix_PlayMusic(audio->audio, 0); // FIXME: check error
+            POP_AUDIOFILE(audio);
+            sam_audio_play(audio);
         }
         break;
     case TRAP_AUDIO_DURATION:
+        {
+            sam_audiofile_t *audio;
+            POP_AUDIOFILE(audio);
+            PUSH_FLOAT(audio->frames / sam_audio_rate());
+        }
         break;
     case TRAP_AUDIO_ISPLAYING:
+        {
+            sam_audiofile_t *audio;
+            POP_AUDIOFILE(audio);
+            PUSH_BOOL(sam_audio_is_playing(audio));
+        }
         break;
     case TRAP_AUDIO_JUMP:
+        {
+            // Move a playing sound to the given time in seconds.
+            sam_float_t time;
+            POP_FLOAT(time);
+            sam_audiofile_t *audio;
+            POP_AUDIOFILE(audio);
+            sam_audio_jump(audio, seconds_to_frame(audio, time));
+        }
         break;
     case TRAP_AUDIO_LOOP:
+        {
+            sam_uword_t loop;
+            POP_BOOL(loop);
+            sam_audiofile_t *audio;
+            POP_AUDIOFILE(audio);
+            sam_audio_lock();
+            audio->loop = loop;
+            sam_audio_unlock();
+        }
         break;
     case TRAP_AUDIO_PAN:
+        {
+            // Set the position of a sound, from -1 (left) to 1 (right).
+            sam_float_t pan;
+            POP_FLOAT(pan);
+            sam_audiofile_t *audio;
+            POP_AUDIOFILE(audio);
+            sam_audio_lock();
+            audio->pan = pan < -1 ? -1 : (pan > 1 ? 1 : pan);
+            sam_audio_unlock();
+        }
         break;
     case TRAP_AUDIO_PAUSE:
+        {
+            // Pause a sound; AUDIO_PLAY resumes it.
+            sam_audiofile_t *audio;
+            POP_AUDIOFILE(audio);
+            sam_audio_pause(audio);
+        }
         break;
     case TRAP_AUDIO_SPEED:
+        {
+            // Return the speed of a sound, 1 being normal speed.
+            sam_audiofile_t *audio;
+            POP_AUDIOFILE(audio);
+            PUSH_FLOAT(audio->speed);
+        }
         break;
 
     case TRAP_AUDIO_APPLAUSE:
-        PUSH_BLOB(sounds[SOUND_APPLAUSE]);
-        break;
     case TRAP_AUDIO_BEEP:
-        PUSH_BLOB(sounds[SOUND_BEEP]);
-        break;
     case TRAP_AUDIO_BELL:
-        PUSH_BLOB(sounds[SOUND_BEEP]);
-        break;
     case TRAP_AUDIO_COW:
-        PUSH_BLOB(sounds[SOUND_COW]);
-        break;
     case TRAP_AUDIO_EXPLOSION:
-        PUSH_BLOB(sounds[SOUND_EXPLOSION]);
-        break;
     case TRAP_AUDIO_GONG:
-        PUSH_BLOB(sounds[SOUND_GONG]);
-        break;
     case TRAP_AUDIO_HORSE:
-        PUSH_BLOB(sounds[SOUND_HORSE]);
-        break;
     case TRAP_AUDIO_LASER:
-        PUSH_BLOB(sounds[SOUND_LASER]);
-        break;
     case TRAP_AUDIO_OOPS:
-        PUSH_BLOB(sounds[SOUND_OOPS]);
+        {
+            // The sounds are in the same order as their traps.
+            sam_blob_t *sound;
+            HALT_IF_ERROR(get_sound(SOUND_APPLAUSE + (function - TRAP_AUDIO_APPLAUSE), &sound));
+            PUSH_BLOB(sound);
+        }
+        break;
+
+    case TRAP_AUDIO_SYNTH_SINE:
+        PUSH_INT(SAM_SYNTH_SINE);
+        break;
+    case TRAP_AUDIO_SYNTH_SQUARE:
+        PUSH_INT(SAM_SYNTH_SQUARE);
+        break;
+    case TRAP_AUDIO_SYNTH_SAW:
+        PUSH_INT(SAM_SYNTH_SAW);
+        break;
+    case TRAP_AUDIO_SYNTH_TRIANGLE:
+        PUSH_INT(SAM_SYNTH_TRIANGLE);
+        break;
+    case TRAP_AUDIO_SYNTH_NOISE:
+        PUSH_INT(SAM_SYNTH_NOISE);
+        break;
+    case TRAP_AUDIO_SYNTH_ENVELOPE:
+        {
+            // Set the envelope of later notes: attack, decay and release
+            // times in seconds, and sustain level from 0 to 1.
+            sam_float_t attack, decay, sustain, release;
+            POP_FLOAT(release);
+            POP_FLOAT(sustain);
+            POP_FLOAT(decay);
+            POP_FLOAT(attack);
+            synth_envelope.attack = attack > 0 ? attack : 0;
+            synth_envelope.decay = decay > 0 ? decay : 0;
+            synth_envelope.sustain = sustain < 0 ? 0 : (sustain > 1 ? 1 : sustain);
+            synth_envelope.release = release > 0 ? release : 0;
+        }
+        break;
+    case TRAP_AUDIO_SYNTH_NOTE:
+        {
+            // Play a note with the given waveform, frequency in Hz and
+            // volume from 0 to 1, starting at the given time on the
+            // synthesiser clock and held for the given duration, both in
+            // seconds. If the ring of notes is full, the note is dropped.
+            sam_synth_note_t note = synth_envelope;
+            sam_float_t frequency, volume, start, duration;
+            sam_uword_t waveform;
+            POP_FLOAT(duration);
+            POP_FLOAT(start);
+            POP_FLOAT(volume);
+            POP_FLOAT(frequency);
+            POP_UINT(waveform);
+            HALT_IF_ERROR(init_audio());
+            note.waveform = waveform;
+            note.frequency = frequency;
+            note.volume = volume < 0 ? 0 : (volume > 1 ? 1 : volume);
+            note.start = start;
+            note.duration = duration > 0 ? duration : 0;
+            sam_synth_note(&note);
+        }
+        break;
+    case TRAP_AUDIO_SYNTH_TIME:
+        // Return the synthesiser clock in seconds.
+        HALT_IF_ERROR(init_audio());
+        PUSH_FLOAT(sam_synth_time());
+        break;
+    case TRAP_AUDIO_SYNTH_STOP:
+        sam_synth_stop();
         break;
 
     default:
@@ -2240,6 +3268,25 @@ char *sam_audio_trap_name(sam_word_t function)
     case TRAP_AUDIO_OOPS:
         return "OOPS";
 
+    case TRAP_AUDIO_SYNTH_SINE:
+        return "SYNTH_SINE";
+    case TRAP_AUDIO_SYNTH_SQUARE:
+        return "SYNTH_SQUARE";
+    case TRAP_AUDIO_SYNTH_SAW:
+        return "SYNTH_SAW";
+    case TRAP_AUDIO_SYNTH_TRIANGLE:
+        return "SYNTH_TRIANGLE";
+    case TRAP_AUDIO_SYNTH_NOISE:
+        return "SYNTH_NOISE";
+    case TRAP_AUDIO_SYNTH_ENVELOPE:
+        return "SYNTH_ENVELOPE";
+    case TRAP_AUDIO_SYNTH_NOTE:
+        return "SYNTH_NOTE";
+    case TRAP_AUDIO_SYNTH_TIME:
+        return "SYNTH_TIME";
+    case TRAP_AUDIO_SYNTH_STOP:
+        return "SYNTH_STOP";
+
     default:
         return NULL;
     }
@@ -8,9 +8,65 @@
 // THIS PROGRAM IS PROVIDED AS IS, WITH NO WARRANTY. USE IS AT THE USER’S
 // RISK.
 
-#include <SDL_mixer.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Thread pool
+typedef void (*sam_task_fn_t)(void *);
+int sam_threadpool_init(unsigned nworkers);
+void sam_threadpool_finish(void);
+void sam_threadpool_submit(sam_task_fn_t fn, void *arg);
+void sam_threadpool_wait(void);
+
+// Screen recording
+int sam_record_start(const char *filename, bool delta_rows, unsigned width, unsigned height);
+uint8_t *sam_record_begin_frame(void);
+void sam_record_end_frame(void);
+int sam_record_finish(void);
 
 // Structs
 typedef struct sam_audiofile {
-    Mix_Music *audio;
+    float *samples; // interleaved stereo, at the output rate
+    unsigned long frames;
+    float volume; // 0 to 1
+    float pan; // -1 (left) to 1 (right)
+    double speed; // 1 is normal speed
+    unsigned long cue; // frame at which the sound starts playing
+    bool loop;
 } sam_audiofile_t;
+
+// Audio mixer
+int sam_audio_init(bool open_device);
+void sam_audio_finish(void);
+int sam_audio_decode(const unsigned char *mem, size_t size, sam_audiofile_t *sound);
+double sam_audio_rate(void);
+void sam_audio_play(sam_audiofile_t *sound);
+void sam_audio_pause(sam_audiofile_t *sound);
+void sam_audio_jump(sam_audiofile_t *sound, unsigned long frame);
+bool sam_audio_is_playing(sam_audiofile_t *sound);
+void sam_audio_lock(void);
+void sam_audio_unlock(void);
+
+// Synthesiser
+enum {
+    SAM_SYNTH_SINE,
+    SAM_SYNTH_SQUARE,
+    SAM_SYNTH_SAW,
+    SAM_SYNTH_TRIANGLE,
+    SAM_SYNTH_NOISE,
+};
+
+typedef struct {
+    int waveform;
+    double frequency; // Hz
+    float volume; // 0 to 1
+    double start, duration; // seconds on the synthesiser clock
+    float attack, decay, sustain, release; // envelope; sustain is a level
+} sam_synth_note_t;
+
+void sam_synth_init(int rate);
+double sam_synth_time(void);
+bool sam_synth_note(const sam_synth_note_t *note);
+void sam_synth_stop(void);
+void sam_synth_render(float *out, unsigned frames);
@@ -0,0 +1,186 @@
+// Sound synthesiser.
+//
+// (c) Reuben Thomas 2026
+//
+// The package is distributed under the GNU Public License version 3, or,
+// at your option, any later version.
+//
+// THIS PROGRAM IS PROVIDED AS IS, WITH NO WARRANTY. USE IS AT THE USER’S
+// RISK.
+
+// Notes are synthesised in the audio callback. The VM sends them through a
+// lock-free ring with one writer (the VM) and one reader (the audio
+// callback), so the VM never waits for the audio thread. Each note has a
+// start time on the synthesiser's clock, which counts output frames, so
+// notes play at the right time however fast the VM runs.
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sam.h"
+#include "private.h"
+#include "sdl_private.h"
+
+#define RING_LENGTH 256 // must be a power of 2
+#define MAX_NOTES 64
+
+enum {
+    COMMAND_NOTE,
+    COMMAND_STOP,
+};
+
+typedef struct {
+    int command;
+    sam_synth_note_t note;
+} command_t;
+
+static command_t ring[RING_LENGTH];
+static atomic_uint ring_head; // next command to read; written by the reader
+static atomic_uint ring_tail; // next command to write; written by the writer
+
+typedef struct {
+    bool active;
+    sam_synth_note_t note;
+    uint64_t start, gate_off, end; // frames on the synthesiser clock
+    double phase; // oscillator phase, from 0 to 1
+    uint32_t noise; // noise generator state
+} note_t;
+
+static int rate;
+static note_t notes[MAX_NOTES]; // used only by the audio callback
+static atomic_uint_fast64_t clock_frames; // frames synthesised so far
+
+void sam_synth_init(int output_rate)
+{
+    rate = output_rate;
+}
+
+double sam_synth_time(void)
+{
+    return rate == 0 ? 0.0 : (double)atomic_load_explicit(&clock_frames, memory_order_relaxed) / rate;
+}
+
+static bool send_command(int command, const sam_synth_note_t *note)
+{
+    if (rate == 0)
+        return false; // No audio device
+    unsigned tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring_head, memory_order_acquire) == RING_LENGTH)
+        return false; // Ring full
+    command_t *c = &ring[tail % RING_LENGTH];
+    c->command = command;
+    if (note != NULL)
+        c->note = *note;
+    atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool sam_synth_note(const sam_synth_note_t *note)
+{
+    return send_command(COMMAND_NOTE, note);
+}
+
+void sam_synth_stop(void)
+{
+    send_command(COMMAND_STOP, NULL);
+}
+
+// Start a note, replacing the one that ends soonest if all are in use.
+static void start_note(const sam_synth_note_t *note, uint64_t now)
+{
+    note_t *n = &notes[0];
+    for (unsigned i = 0; i < MAX_NOTES; i++) {
+        if (!notes[i].active) {
+            n = &notes[i];
+            break;
+        }
+        if (notes[i].end < n->end)
+            n = &notes[i];
+    }
+    double start = note->start * rate;
+    n->active = true;
+    n->note = *note;
+    n->start = start > (double)now ? (uint64_t)start : now;
+    n->gate_off = n->start + (uint64_t)(note->duration * rate);
+    n->end = n->gate_off + (uint64_t)(note->release * rate);
+    n->phase = 0.0;
+    n->noise = 0x12345678;
+}
+
+// Envelope level `t` frames into a note whose gate is still open.
+static float envelope_held(const sam_synth_note_t *note, double t)
+{
+    double attack = note->attack * rate, decay = note->decay * rate;
+    if (t < attack)
+        return (float)(t / attack);
+    if (t < attack + decay)
+        return (float)(1.0 - (1.0 - note->sustain) * (t - attack) / decay);
+    return note->sustain;
+}
+
+static float envelope(const note_t *n, uint64_t frame)
+{
+    if (frame < n->gate_off)
+        return envelope_held(&n->note, (double)(frame - n->start));
+    float level = envelope_held(&n->note, (double)(n->gate_off - n->start));
+    return level * (1.0f - (float)(frame - n->gate_off) / (float)(n->end - n->gate_off));
+}
+
+static float oscillator(note_t *n)
+{
+    double phase = n->phase;
+    n->phase += n->note.frequency / rate;
+    n->phase -= floor(n->phase);
+    switch (n->note.waveform) {
+    case SAM_SYNTH_SQUARE:
+        return phase < 0.5 ? 1.0f : -1.0f;
+    case SAM_SYNTH_SAW:
+        return (float)(2.0 * phase - 1.0);
+    case SAM_SYNTH_TRIANGLE:
+        return (float)(4.0 * fabs(phase - 0.5) - 1.0);
+    case SAM_SYNTH_NOISE:
+        // xorshift32
+        n->noise ^= n->noise << 13;
+        n->noise ^= n->noise >> 17;
+        n->noise ^= n->noise << 5;
+        return (float)n->noise / 2147483648.0f - 1.0f;
+    default: // SAM_SYNTH_SINE
+        return sinf((float)(2.0 * M_PI * phase));
+    }
+}
+
+void sam_synth_render(float *out, unsigned frames)
+{
+    uint64_t now = atomic_load_explicit(&clock_frames, memory_order_relaxed);
+
+    // Take new commands.
+    unsigned head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    for (; head != tail; head++) {
+        command_t *c = &ring[head % RING_LENGTH];
+        if (c->command == COMMAND_NOTE)
+            start_note(&c->note, now);
+        else
+            memset(notes, 0, sizeof(notes));
+    }
+    atomic_store_explicit(&ring_head, head, memory_order_release);
+
+    for (unsigned i = 0; i < MAX_NOTES; i++) {
+        note_t *n = &notes[i];
+        if (!n->active || n->start >= now + frames)
+            continue;
+        unsigned j = n->start > now ? (unsigned)(n->start - now) : 0;
+        for (; j < frames && now + j < n->end; j++) {
+            float sample = oscillator(n) * envelope(n, now + j) * n->note.volume;
+            out[j * 2] += sample;
+            out[j * 2 + 1] += sample;
+        }
+        if (now + frames >= n->end)
+            n->active = false;
+    }
+
+    atomic_store_explicit(&clock_frames, now + frames, memory_order_relaxed);
+}
@@ -0,0 +1,190 @@
+// Work-stealing thread pool, used for parallel rasterisation.
+//
+// (c) Reuben Thomas 2026
+//
+// The package is distributed under the GNU Public License version 3, or,
+// at your option, any later version.
+//
+// THIS PROGRAM IS PROVIDED AS IS, WITH NO WARRANTY. USE IS AT THE USER’S
+// RISK.
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+
+#include "sam.h"
+#include "private.h"
+#include "sdl_private.h"
+
+// Each worker owns a deque of tasks. The owner takes tasks from the back,
+// and idle threads steal from the front of other workers' deques.
+#define MAX_TASKS 64
+
+typedef struct {
+    sam_task_fn_t fn;
+    void *arg;
+} task_t;
+
+typedef struct {
+    SDL_mutex *lock;
+    task_t tasks[MAX_TASKS];
+    unsigned front, back; // tasks[front .. back-1], modulo MAX_TASKS
+    SDL_Thread *thread;
+} worker_t;
+
+static worker_t *workers;
+static unsigned nworkers;
+static unsigned next_worker; // round-robin target for sam_threadpool_submit
+static SDL_sem *work_available; // posted once per submitted task
+static SDL_atomic_t pending; // tasks submitted but not yet finished
+static SDL_mutex *done_lock;
+static SDL_cond *done;
+static SDL_atomic_t quit;
+
+static bool pop_back(worker_t *w, task_t *task)
+{
+    bool found = false;
+    SDL_LockMutex(w->lock);
+    if (w->back != w->front) {
+        *task = w->tasks[--w->back % MAX_TASKS];
+        found = true;
+    }
+    SDL_UnlockMutex(w->lock);
+    return found;
+}
+
+static bool pop_front(worker_t *w, task_t *task)
+{
+    bool found = false;
+    SDL_LockMutex(w->lock);
+    if (w->back != w->front) {
+        *task = w->tasks[w->front++ % MAX_TASKS];
+        found = true;
+    }
+    SDL_UnlockMutex(w->lock);
+    return found;
+}
+
+// Take a task, preferring worker `self`'s own deque.
+static bool take_task(unsigned self, task_t *task)
+{
+    if (self < nworkers && pop_back(&workers[self], task))
+        return true;
+    for (unsigned i = 1; i <= nworkers; i++)
+        if (pop_front(&workers[(self + i) % nworkers], task))
+            return true;
+    return false;
+}
+
+static void run_task(task_t *task)
+{
+    task->fn(task->arg);
+    if (SDL_AtomicDecRef(&pending)) {
+        SDL_LockMutex(done_lock);
+        SDL_CondBroadcast(done);
+        SDL_UnlockMutex(done_lock);
+    }
+}
+
+static int worker_loop(void *data)
+{
+    unsigned self = (unsigned)(uintptr_t)data;
+    for (;;) {
+        SDL_SemWait(work_available);
+        if (SDL_AtomicGet(&quit))
+            break;
+        // The task for this wake-up may already have been taken by the
+        // waiting thread, in which case there is nothing to do.
+        task_t task;
+        if (take_task(self, &task))
+            run_task(&task);
+    }
+    return 0;
+}
+
+int sam_threadpool_init(unsigned n)
+{
+    if (n == 0)
+        return SAM_ERROR_OK;
+    workers = calloc(n, sizeof(worker_t));
+    work_available = SDL_CreateSemaphore(0);
+    done_lock = SDL_CreateMutex();
+    done = SDL_CreateCond();
+    if (workers == NULL || work_available == NULL || done_lock == NULL || done == NULL)
+        return SAM_ERROR_NO_MEMORY;
+    SDL_AtomicSet(&pending, 0);
+    SDL_AtomicSet(&quit, 0);
+    for (nworkers = 0; nworkers < n; nworkers++) {
+        worker_t *w = &workers[nworkers];
+        w->lock = SDL_CreateMutex();
+        if (w->lock == NULL)
+            return SAM_ERROR_NO_MEMORY;
+        w->thread = SDL_CreateThread(worker_loop, "sam-render", (void *)(uintptr_t)nworkers);
+        if (w->thread == NULL) {
+            SDL_DestroyMutex(w->lock);
+            break;
+        }
+    }
+    return SAM_ERROR_OK;
+}
+
+void sam_threadpool_finish(void)
+{
+    if (workers == NULL)
+        return;
+    SDL_AtomicSet(&quit, 1);
+    for (unsigned i = 0; i < nworkers; i++)
+        SDL_SemPost(work_available);
+    for (unsigned i = 0; i < nworkers; i++) {
+        SDL_WaitThread(workers[i].thread, NULL);
+        SDL_DestroyMutex(workers[i].lock);
+    }
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+    SDL_DestroySemaphore(work_available);
+    SDL_DestroyCond(done);
+    SDL_DestroyMutex(done_lock);
+}
+
+void sam_threadpool_submit(sam_task_fn_t fn, void *arg)
+{
+    task_t task = {fn, arg};
+    if (nworkers == 0) {
+        fn(arg);
+        return;
+    }
+
+    worker_t *w = &workers[next_worker];
+    next_worker = (next_worker + 1) % nworkers;
+    bool queued = false;
+    SDL_AtomicIncRef(&pending);
+    SDL_LockMutex(w->lock);
+    if (w->back - w->front < MAX_TASKS) {
+        w->tasks[w->back++ % MAX_TASKS] = task;
+        queued = true;
+    }
+    SDL_UnlockMutex(w->lock);
+
+    if (queued)
+        SDL_SemPost(work_available);
+    else
+        run_task(&task); // Deque full: run the task on this thread.
+}
+
+void sam_threadpool_wait(void)
+{
+    if (nworkers == 0)
+        return;
+
+    // Help with outstanding tasks, then wait for the workers to finish theirs.
+    task_t task;
+    while (take_task(nworkers, &task))
+        run_task(&task);
+
+    SDL_LockMutex(done_lock);
+    while (SDL_AtomicGet(&pending) > 0)
+        SDL_CondWait(done, done_lock);
+    SDL_UnlockMutex(done_lock);
+}
@@ -41,6 +41,16 @@ enum SAM_TRAP_AUDIO {
   TRAP_AUDIO_HORSE,
   TRAP_AUDIO_LASER,
   TRAP_AUDIO_OOPS,
+
+  TRAP_AUDIO_SYNTH_SINE,
+  TRAP_AUDIO_SYNTH_SQUARE,
+  TRAP_AUDIO_SYNTH_SAW,
+  TRAP_AUDIO_SYNTH_TRIANGLE,
+  TRAP_AUDIO_SYNTH_NOISE,
+  TRAP_AUDIO_SYNTH_ENVELOPE,
+  TRAP_AUDIO_SYNTH_NOTE,
+  TRAP_AUDIO_SYNTH_TIME,
+  TRAP_AUDIO_SYNTH_STOP,
 };
 
 #endif
@@ -316,6 +316,53 @@ sam_word_t sam_basic_trap(sam_state_t *state, sam_uword_t function)
         break;
     case TRAP_BASIC_RANDOM:
         PUSH_FLOAT(drand48());
+        break;
+    case TRAP_BASIC_TAIL_CALL:
+        {
+            // Call a closure, reusing the current frame: keep the saved s0
+            // and p0, and replace the context and arguments.
+            sam_blob_t *blob;
+            POP_BLOB(blob);
+            sam_closure_t *cl;
+            EXTRACT_BLOB(blob, SAM_BLOB_CLOSURE, sam_closure_t, cl);
+            sam_uword_t nargs;
+            POP_UINT(nargs);
+            if (s->sp < nargs + 3)
+                HALT(SAM_ERROR_ARRAY_UNDERFLOW);
+            sam_word_t inst;
+            HALT_IF_ERROR(sam_make_inst_blob(&inst, cl->context));
+            HALT_IF_ERROR(sam_array_poke(state->s0, 2, inst));
+            sam_uword_t base = s->sp - nargs;
+            for (sam_uword_t i = 0; i < nargs; i++) {
+                sam_uword_t val;
+                HALT_IF_ERROR(sam_array_peek(state->s0, base + i, &val));
+                HALT_IF_ERROR(sam_array_poke(state->s0, 3 + i, val));
+            }
+            sam_word_t val;
+            while (s->sp > nargs + 3)
+                POP_WORD(&val);
+            state->p0 = cl->code;
+            state->pc = 0;
+        }
+        break;
+    case TRAP_BASIC_COUNT:
+        {
+            // Advance a loop counter, kept under the loop's value with the
+            // loop's limit under it.
+            sam_word_t offset;
+            POP_INT(offset);
+            if (s->sp < 3)
+                HALT(SAM_ERROR_ARRAY_UNDERFLOW);
+            sam_word_t count, limit;
+            PEEK_INT(count, s->sp - 2);
+            PEEK_INT(limit, s->sp - 3);
+            if (++count < limit) {
+                HALT_IF_ERROR(sam_array_poke(state->s0, s->sp - 2, SAM_INT_TAG | LSHIFT(count, SAM_INT_SHIFT)));
+                PUSH_INT(count);
+            } else
+                state->pc += offset;
+        }
+        break;
     }
 error:
     return error;
@@ -364,6 +411,10 @@ char *sam_basic_trap_name(sam_word_t function)
         return "SEED";
     case TRAP_BASIC_RANDOM:
         return "RANDOM";
+    case TRAP_BASIC_TAIL_CALL:
+        return "TAIL_CALL";
+    case TRAP_BASIC_COUNT:
+        return "COUNT";
     default:
         return NULL;
     }
@@ -41,6 +41,8 @@ enum SAM_TRAP_BASIC {
     TRAP_BASIC_LOG,
     TRAP_BASIC_SEED,
     TRAP_BASIC_RANDOM,
+    TRAP_BASIC_TAIL_CALL,
+    TRAP_BASIC_COUNT,
 };
 
 #endif
@@ -93,6 +93,7 @@ enum SAM_TRAP_GRAPHICS {
     TRAP_GRAPHICS_FONT_EMOJI,
     TRAP_GRAPHICS_FPS,
     TRAP_GRAPHICS_WAIT,
+    TRAP_GRAPHICS_FLUSH,
 };
 
 #endif
@@ -266,6 +266,9 @@ enum SAM_TRAP_INPUT {
   TRAP_INPUT_KEY_SOFTRIGHT,
   TRAP_INPUT_KEY_CALL,
   TRAP_INPUT_KEY_ENDCALL,
+  TRAP_INPUT_KEYDOWN,
+  TRAP_INPUT_KEYUP,
+  TRAP_INPUT_TEXTINPUT,
 };
 
 #endif
@@ -0,0 +1,332 @@
+// Verify SAM code, so that it can run with fewer checks.
+package libsam
+
+// The verifier follows every path through a code array, keeping track of
+// the items that the code has pushed on its stack, and checks that:
+//
+//   - control cannot run off the end of the array, and every jump lands in
+//     it;
+//   - no instruction pops an item that the code did not push, so the stack
+//     cannot underflow;
+//   - the code cannot get a reference to a stack, so no other verified code
+//     can change its stack under it: it does not use S0, read or write the
+//     saved S0 and P0 of its frame, or RESUME anything but a new frame.
+//
+// Code that passes is marked, and the interpreter runs it without those
+// checks. Code that cannot be shown to be safe, for example because it
+// computes a jump offset or stack address, is left unmarked and runs with
+// all checks. Stack effects are taken from StackDifference and
+// TrapStackEffect, so those tables must be exact.
+
+// An item pushed by the code being verified.
+type verifyItem struct {
+	known bool // whether the item is a known integer
+	value Word
+}
+
+// The state of the stack before a word of code.
+type verifyState struct {
+	stack []verifyItem
+	call  int // how much of "new zero over append", which makes a frame for RESUME, has just run
+}
+
+// The call sequence before RESUME.
+var verifyCall = []string{"new", "zero", "over", "append"}
+
+// The number of items that each instruction takes from the stack.
+var instInputs = map[string]int{
+	"nop": 0, "new": 0, "s0": 0, "drop": 1, "sget": 1, "sset": 2,
+	"dup": 1, "swap": 2, "over": 2, "get": 2, "set": 3, "extract": 2,
+	"insert": 2, "pop": 1, "shift": 1, "append": 2, "prepend": 2,
+	"not": 1, "and": 2, "or": 2, "xor": 2, "eq": 2, "lt": 2,
+	"neg": 1, "add": 2, "mul": 2,
+	"zero": 0, "one": 0, "_one": 0, "two": 0, "_two": 0,
+}
+
+var instValues = map[string]Word{"zero": 0, "one": 1, "_one": -1, "two": 2, "_two": -2}
+
+var instNames = make(map[Uword]string)
+var trapNames = make(map[uint]string)
+
+func init() {
+	for name, inst := range Instructions {
+		if set, opcode := inst.SetAndOpcode(); inst.Tag == INSTS_TAG && set == INST_SET_ANY {
+			instNames[opcode] = name
+		}
+	}
+	for name, function := range Traps {
+		if _, ok := TrapStackEffect[name]; ok {
+			trapNames[function] = name
+		}
+	}
+}
+
+type verifier struct {
+	words  []Word
+	length int
+	frame  bool // the code runs in a frame made by RESUME
+	states []*verifyState
+	work   []int
+}
+
+// Verify a code array, and mark it if it passes. frame says whether the
+// code is the code of a closure, rather than top-level code. Returns true
+// if the code was marked.
+func (code *Blob) Verify(frame bool) bool {
+	words := make([]Word, code.Sp())
+	for i := range words {
+		_, w := code.Peek(Uword(i))
+		words[i] = Word(w)
+	}
+	if !VerifyWords(words, frame) {
+		return false
+	}
+	code.SetVerified()
+	return true
+}
+
+// Verify code that has not yet been made into an array. Returns true if
+// the array made from it can be marked.
+func VerifyWords(words []Word, frame bool) bool {
+	v := verifier{words: words, length: len(words), frame: frame}
+	v.states = make([]*verifyState, v.length)
+	if !v.flow(0, verifyState{}) {
+		return false
+	}
+	for len(v.work) > 0 {
+		pc := v.work[len(v.work)-1]
+		v.work = v.work[:len(v.work)-1]
+		if !v.word(pc, v.states[pc].copy()) {
+			return false
+		}
+	}
+	return true
+}
+
+func (st *verifyState) copy() verifyState {
+	return verifyState{append([]verifyItem(nil), st.stack...), st.call}
+}
+
+func (st *verifyState) push(item verifyItem) {
+	st.stack = append(st.stack, item)
+}
+
+// Pop n items, returning false if the code did not push that many.
+func (st *verifyState) pop(n int) bool {
+	if n > len(st.stack) {
+		return false
+	}
+	st.stack = st.stack[:len(st.stack)-n]
+	return true
+}
+
+// Pop an item that must be a known integer.
+func (st *verifyState) popKnown() (Word, bool) {
+	if len(st.stack) == 0 || !st.stack[len(st.stack)-1].known {
+		return 0, false
+	}
+	item := st.stack[len(st.stack)-1]
+	st.pop(1)
+	return item.value, true
+}
+
+// Record that control can reach word pc with stack st. Returns false if pc
+// is outside the code, or st does not match another path to pc.
+func (v *verifier) flow(pc int, st verifyState) bool {
+	if pc < 0 || pc >= v.length {
+		return false
+	}
+	old := v.states[pc]
+	if old == nil {
+		v.states[pc] = &st
+		v.work = append(v.work, pc)
+		return true
+	}
+	if len(old.stack) != len(st.stack) {
+		return false
+	}
+	changed := false
+	for i := range old.stack {
+		if old.stack[i].known && old.stack[i] != st.stack[i] {
+			old.stack[i].known = false
+			changed = true
+		}
+	}
+	if old.call != st.call && old.call != 0 {
+		old.call = 0
+		changed = true
+	}
+	if changed {
+		v.work = append(v.work, pc)
+	}
+	return true
+}
+
+// Verify the word at pc, and follow control from it.
+func (v *verifier) word(pc int, st verifyState) bool {
+	w := v.words[pc]
+	uw := Uword(w)
+	next := pc + 1
+	switch {
+	case w&INT_TAG_MASK == INT_TAG:
+		st.call = 0
+		st.push(verifyItem{true, w >> INT_SHIFT})
+	case w&FLOAT_TAG_MASK == FLOAT_TAG, w&BLOB_TAG_MASK == BLOB_TAG, w&ATOM_TAG_MASK == ATOM_TAG:
+		st.call = 0
+		st.push(verifyItem{})
+	case w&TRAP_TAG_MASK == TRAP_TAG:
+		st.call = 0
+		return v.trap(uint(uw>>Uword(TRAP_FUNCTION_SHIFT)), next, st)
+	case w&INSTS_TAG_MASK == INSTS_TAG:
+		for opcodes := uw >> Uword(INSTS_SHIFT); opcodes != 0; opcodes >>= Uword(ONE_INST_SHIFT) {
+			name := instNames[opcodes&Uword(INST_MASK)]
+			if name == "resume" {
+				// RESUME ends the word.
+				return v.resume(&st) && v.flow(next, st)
+			} else if !v.inst(name, &st) {
+				return false
+			}
+		}
+	}
+	return v.flow(next, st)
+}
+
+func (v *verifier) inst(name string, st *verifyState) bool {
+	if st.call < len(verifyCall) && name == verifyCall[st.call] {
+		st.call++
+	} else if name == "new" {
+		st.call = 1
+	} else {
+		st.call = 0
+	}
+	switch name {
+	case "s0":
+		return false
+	case "zero", "one", "_one", "two", "_two":
+		st.push(verifyItem{true, instValues[name]})
+	case "dup", "over":
+		n := instInputs[name]
+		if len(st.stack) < n {
+			return false
+		}
+		st.push(st.stack[len(st.stack)-n])
+	case "swap":
+		if len(st.stack) < 2 {
+			return false
+		}
+		d := len(st.stack)
+		st.stack[d-1], st.stack[d-2] = st.stack[d-2], st.stack[d-1]
+	case "sget":
+		pos, ok := st.popKnown()
+		if !ok {
+			return false
+		}
+		if pos < 0 {
+			if int(-pos) > len(st.stack) {
+				return false
+			}
+			st.push(st.stack[len(st.stack)+int(pos)])
+		} else {
+			if v.frame && pos < 2 {
+				return false
+			}
+			st.push(verifyItem{})
+		}
+	case "sset":
+		pos, ok := st.popKnown()
+		if !ok || len(st.stack) < 1 {
+			return false
+		}
+		item := st.stack[len(st.stack)-1]
+		if pos < 0 {
+			if int(-pos) > len(st.stack) {
+				return false
+			}
+			st.stack[len(st.stack)+int(pos)] = item
+			st.pop(1)
+		} else {
+			if v.frame && pos < 3 {
+				return false
+			}
+			// The item changed is not known, so forget all known values.
+			st.pop(1)
+			for i := range st.stack {
+				st.stack[i].known = false
+			}
+		}
+	default:
+		n, ok := instInputs[name]
+		if !ok || !st.pop(n) {
+			return false
+		}
+		for range n + StackDifference[name] {
+			st.push(verifyItem{})
+		}
+	}
+	return true
+}
+
+// RESUME must be given a new frame, made by the call sequence, so that
+// nothing else can refer to the callee's stack, and a known number of
+// arguments. The callee leaves one item, its result.
+func (v *verifier) resume(st *verifyState) bool {
+	if st.call != len(verifyCall) || !st.pop(2) {
+		return false
+	}
+	nargs, ok := st.popKnown()
+	if !ok || nargs < 0 || !st.pop(int(nargs)) {
+		return false
+	}
+	st.call = 0
+	st.push(verifyItem{})
+	return true
+}
+
+func (v *verifier) trap(function uint, next int, st verifyState) bool {
+	name, ok := trapNames[function]
+	if !ok {
+		return false
+	}
+	switch name {
+	case "HALT", "YIELD":
+		// The code ends here; YIELD pops only the result from this stack.
+		return st.pop(1)
+	case "TAIL_CALL":
+		return st.pop(2)
+	case "JUMP":
+		offset, ok := st.popKnown()
+		return ok && v.flow(next+int(offset), st)
+	case "JUMP_IF_FALSE":
+		offset, ok := st.popKnown()
+		return ok && st.pop(1) && v.flow(next+int(offset), st.copy()) && v.flow(next, st)
+	case "COUNT":
+		offset, ok := st.popKnown()
+		if !ok || !v.flow(next+int(offset), st.copy()) {
+			return false
+		}
+		st.push(verifyItem{})
+		return v.flow(next, st)
+	case "QUOTE":
+		// Skip the quoted word.
+		st.push(verifyItem{})
+		return v.flow(next+1, st)
+	case "NEW_CLOSURE":
+		if !st.pop(1) {
+			return false
+		}
+		nitems, ok := st.popKnown()
+		if !ok || nitems < 0 || !st.pop(int(nitems)) {
+			return false
+		}
+		st.push(verifyItem{})
+	default:
+		effect := TrapStackEffect[name]
+		if !st.pop(int(effect.In)) {
+			return false
+		}
+		for range effect.Out {
+			st.push(verifyItem{})
+		}
+	}
+	return v.flow(next, st)
+}
@@ -0,0 +1,111 @@
+// Tests for the verifier.
+package libsam
+
+import (
+	"strings"
+	"testing"
+
+	"github.com/alecthomas/assert/v2"
+)
+
+// Assemble code from items: an int is an integer, nil is null, a name in
+// capitals is a trap, and other strings are words of instructions
+// separated by spaces.
+func assemble(items ...any) []Word {
+	words := make([]Word, 0, len(items))
+	for _, item := range items {
+		switch x := item.(type) {
+		case nil:
+			words = append(words, MakeInstAtom(ATOM_NULL, 0))
+		case int:
+			words = append(words, MakeInstInt(Word(x)))
+		case string:
+			if function, ok := Traps[x]; ok {
+				words = append(words, MakeInstTrap(Uword(function)))
+				break
+			}
+			set, insts := INST_SET_ANY, Uword(0)
+			for i, name := range strings.Fields(x) {
+				instSet, opcode := Instructions[name].SetAndOpcode()
+				if IsTypedOpcode(opcode) {
+					set = instSet
+				}
+				insts |= opcode << (Uword(i) * Uword(ONE_INST_SHIFT))
+			}
+			words = append(words, MakeInstInsts(set, insts))
+		default:
+			panic("bad item")
+		}
+	}
+	return words
+}
+
+type verifyCase struct {
+	name  string
+	frame bool
+	code  []any
+}
+
+// Code of the form the compiler emits.
+var verifiedCases = []verifyCase{
+	// Top-level code calling a closure with one argument.
+	{"call", false, []any{nil, 42, 3, 1, 1, "sget new zero over append resume", -3, "sset drop", "HALT"}},
+	// loop { if n == 0 { break t } t := t + n; n := n - 1 }, as a closure
+	// with one argument.
+	{"loop", true, []any{
+		0, nil, 3, "sget", 0, "eq", 9, "JUMP_IF_FALSE",
+		nil, 4, "sget", -3, "sset drop", 18, "JUMP", 1, "JUMP",
+		nil, "drop", 4, "sget", 3, "sget add_int dup", 4, "sset drop",
+		3, "sget", 1, "neg_int add_int dup", 3, "sset drop", -31, "JUMP",
+		"YIELD",
+	}},
+	// for i in 5 { if i == 2 { continue } t := g(t, i) }, calling g, the
+	// closure's argument.
+	{"count", true, []any{
+		0, 5, -1, nil, 26, "COUNT",
+		8, "sget", 2, "eq", 6, "JUMP_IF_FALSE", nil, "drop drop", -12, "JUMP", 1, "JUMP",
+		nil, "drop", 4, "sget", 8, "sget", 2, 3, "sget new zero over append resume",
+		"dup", 4, "sset drop drop", -28, "JUMP",
+		-3, "sset drop drop", 4, "sget", "YIELD",
+	}},
+	// fn(a, b) { fn() { a + b } }, with null for the inner closure's code.
+	{"new closure", true, []any{3, "sget", 4, "sget", 2, nil, "NEW_CLOSURE", "YIELD"}},
+	// The inner closure, reading its context.
+	{"context", true, []any{0, "two sget get", 1, "two sget get add", "YIELD"}},
+	// fn(n) { if n == 0 { return 0 } return down(n - 1) }, where down is
+	// captured.
+	{"tail call", true, []any{
+		3, "sget", 0, "eq", 5, "JUMP_IF_FALSE", nil, 0, "YIELD", 1, "JUMP",
+		nil, "drop", 3, "sget", 1, "neg add", 1, "zero", 0, "two sget get get", "TAIL_CALL",
+	}},
+}
+
+// Code that the verifier must reject.
+var unverifiedCases = []verifyCase{
+	{"pop below entry", false, []any{"drop", 0, "HALT"}},
+	{"pop below entry in instruction", false, []any{1, "add", "HALT"}},
+	{"s0", false, []any{"s0", "HALT"}},
+	{"sget 0", true, []any{0, "sget", "YIELD"}},
+	{"sget 1", true, []any{1, "sget", "YIELD"}},
+	{"sset 0", true, []any{nil, 0, "sset", nil, "YIELD"}},
+	{"sset 1", true, []any{nil, 1, "sset", nil, "YIELD"}},
+	{"sset 2", true, []any{nil, 2, "sset", nil, "YIELD"}},
+	{"sget below entry", false, []any{-1, "sget", "HALT"}},
+	{"unknown sget", false, []any{1, 1, "add", "sget", "HALT"}},
+	{"jump past end", false, []any{5, "JUMP", 0, "HALT"}},
+	{"jump before start", false, []any{-3, "JUMP", 0, "HALT"}},
+	{"run off end", false, []any{0}},
+	{"unknown jump", false, []any{1, 1, "add", "JUMP", 0, "HALT"}},
+	{"merge at different depths", false, []any{nil, 3, "JUMP_IF_FALSE", 1, 1, "JUMP", "nop", 0, "HALT"}},
+	{"resume without new frame", false, []any{nil, 42, 3, 1, 1, "sget", "dup", "resume", "HALT"}},
+	{"resume with unknown arguments", false, []any{nil, 42, 3, 1, 1, "add", 1, "sget new zero over append resume", "HALT"}},
+}
+
+func TestVerify(t *testing.T) {
+	for _, c := range verifiedCases {
+		assert.True(t, VerifyWords(assemble(c.code...), c.frame), c.name)
+	}
+	for _, c := range unverifiedCases {
+		assert.False(t, VerifyWords(assemble(c.code...), c.frame), c.name)
+	}
+}
@@ -23,6 +23,7 @@ import (
 	"os"
 	"path/filepath"
 	"runtime"
+	"strings"
 
 	"github.com/rrthomas/sam/libsam"
 	"github.com/spf13/cobra"
@@ -46,30 +47,19 @@ var rootCmd = &cobra.Command{
 		libsam.SetDebug(debug)
 		progFile := args[0]
 
-		var code libsam.Blob
-		{
-			ext := filepath.Ext(progFile)
-			var err error
-			switch ext {
-
-			case ".sal":
-				var source []byte
-				if source, err = os.ReadFile(progFile); err == nil {
-					code = Sal(string(source), printAst)
-				}
-
-			default:
-				return fmt.Errorf("unknown program file type %v", ext)
-			}
-			if err != nil {
-				return fmt.Errorf("error reading program %v", progFile)
-			}
+		code, err := compileProgram(progFile)
+		if err != nil {
+			return err
 		}
 
 		// Assemble and run the program
 		if err := libsam.BasicInit(); err != libsam.ERROR_OK {
 			os.Exit(int(err))
 		}
+		libsam.SetHeadless(headless)
+		if recordFile != "" {
+			libsam.SetRecord(recordFile, recordDelta)
+		}
 		if err := libsam.SdlInit(); err != libsam.ERROR_OK {
 			os.Exit(int(err))
 		}
@@ -83,11 +73,22 @@ var rootCmd = &cobra.Command{
 		}
 
 		if libsam.SdlWindowUsed() {
-			if pbmFile != "" {
-				libsam.DumpScreen(pbmFile)
+			if screenFile != "" {
+				if err := libsam.DumpScreen(screenFile); err != nil {
+					return err
+				}
 			}
 		}
 
+		if textStats {
+			hits, misses, evictions := libsam.TextCacheStats()
+			rate := 0.0
+			if hits+misses > 0 {
+				rate = 100 * float64(hits) / float64(hits+misses)
+			}
+			fmt.Fprintf(os.Stderr, "text cache: %d hits, %d misses (%.1f%% hit rate), %d evictions\n", hits, misses, rate, evictions)
+		}
+
 		if wait && libsam.SdlWindowUsed() {
 			libsam.SdlWait()
 		}
@@ -100,11 +101,63 @@ var rootCmd = &cobra.Command{
 	},
 }
 
+// Compile a program file.
+func compileProgram(progFile string) (libsam.Blob, error) {
+	var code libsam.Blob
+	ext := filepath.Ext(progFile)
+	var err error
+	switch ext {
+
+	case ".sal":
+		var source []byte
+		if source, err = os.ReadFile(progFile); err == nil {
+			code = compileSal(source)
+		}
+
+	default:
+		return code, fmt.Errorf("unknown program file type %v", ext)
+	}
+	if err != nil {
+		return code, fmt.Errorf("error reading program %v", progFile)
+	}
+	return code, nil
+}
+
+// buildCmd compiles a program to C
+var buildCmd = &cobra.Command{
+	Use:   "build [OPTION...] PROGRAM",
+	Short: "Compile a program to C",
+	Long:  "Compile a program to a C file, to be compiled and linked with libsam.",
+	Args:  cobra.ExactArgs(1),
+	RunE: func(cmd *cobra.Command, args []string) error {
+		progFile := args[0]
+		code, err := compileProgram(progFile)
+		if err != nil {
+			return err
+		}
+		src, err := BuildC(code)
+		if err != nil {
+			return err
+		}
+		if outputFile == "" {
+			outputFile = strings.TrimSuffix(progFile, filepath.Ext(progFile)) + ".c"
+		}
+		return os.WriteFile(outputFile, []byte(src), 0644)
+	},
+}
+
 var (
-	debug    bool
-	wait     bool
-	printAst bool
-	pbmFile  string
+	debug       bool
+	wait        bool
+	printAst    bool
+	headless    bool
+	screenFile  string
+	recordFile  string
+	recordDelta bool
+	textStats   bool
+	optimize    bool
+	noCache     bool
+	outputFile  string
 )
 
 // Execute adds all child commands to the root command and sets flags appropriately.
@@ -125,7 +178,17 @@ func init() {
 	rootCmd.Flags().BoolVar(&debug, "debug", false, "output debug information to standard error")
 	rootCmd.Flags().BoolVar(&wait, "wait", false, "wait for user to close window on termination")
 	rootCmd.Flags().BoolVar(&printAst, "ast", false, "print SAL abstract syntax tree")
-	rootCmd.Flags().StringVar(&pbmFile, "dump-screen", "", "output screen to PBM file `FILE`")
+	rootCmd.Flags().BoolVar(&optimize, "optimize", false, "optimize compiled SAL code")
+	rootCmd.Flags().BoolVar(&noCache, "no-cache", false, "do not use or update the compiled code cache")
+	rootCmd.Flags().BoolVar(&headless, "headless", false, "render off-screen, without opening a window or audio device")
+	rootCmd.Flags().StringVar(&screenFile, "dump-screen", "", "output screen to PPM, or PNG if named *.png, file `FILE`")
+	rootCmd.Flags().StringVar(&recordFile, "record", "", "record every frame shown to raw RGBA file `FILE`")
+	rootCmd.Flags().BoolVar(&recordDelta, "record-delta", false, "record only the rows that change in each frame")
+	rootCmd.Flags().BoolVar(&textStats, "text-stats", false, "print text cache statistics to standard error on exit")
+	buildCmd.Flags().BoolVar(&optimize, "optimize", false, "optimize compiled SAL code")
+	buildCmd.Flags().BoolVar(&noCache, "no-cache", false, "do not use or update the compiled code cache")
+	buildCmd.Flags().StringVarP(&outputFile, "output", "o", "", "write C to `FILE` (default: PROGRAM with .c suffix)")
+	rootCmd.AddCommand(buildCmd)
 	rootCmd.SetVersionTemplate(`{{.DisplayName}} {{.Version}}
 
 Copyright (C) 2025-2026 Reuben Thomas <rrt@sc3d.org>
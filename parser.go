@@ -0,0 +1,791 @@
+/*
+SAL hand-written lexer and parser
+
+Copyright © 2025-2026 Reuben Thomas <rrt@sc3d.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+package main
+
+// The lexer and parser accept the language described by the lexer rules
+// in lexer.go and the grammar in the struct tags in sal.go, and build the
+// same syntax tree, with the same positions, as the participle parser, but
+// without reflection or backtracking. The grammar only needs a little
+// lookahead, mostly to tell a word such as "let" or "gen" used as a
+// keyword from the same word used as a variable.
+
+import (
+	"fmt"
+	"strconv"
+	"strings"
+	"unicode/utf8"
+
+	"github.com/alecthomas/participle/v2/lexer"
+)
+
+type tokenKind int
+
+const (
+	tokenEOF tokenKind = iota
+	tokenSkip
+	tokenKeyword
+	tokenIdent
+	tokenFloat
+	tokenInt
+	tokenString
+	tokenNewline
+	tokenOperator
+	tokenAssignment
+	tokenSingleOperator
+	tokenPunct
+	tokenEscaped
+	tokenStringEnd
+	tokenChars
+	tokenSemicolon // inserted by the lexer
+)
+
+type salToken struct {
+	kind  tokenKind
+	value string
+	pos   lexer.Position
+}
+
+// Lexer
+
+var keywords = map[string]bool{
+	"if": true, "fn": true, "loop": true, "then": true, "else": true,
+	"break": true, "continue": true, "return": true,
+}
+
+// Operators, longest first where one is a prefix of another.
+var operators = []string{">=", "<=", "&&", "||", "==", "!=", "<<<", ">>>", "<<", ">>"}
+
+func isDigit(c byte) bool {
+	return '0' <= c && c <= '9'
+}
+
+func isAlpha(c byte) bool {
+	return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z')
+}
+
+func isWordByte(c byte) bool {
+	return isAlpha(c) || isDigit(c) || c == '_'
+}
+
+// The length of the run of bytes at the start of s that satisfy f.
+func span(s string, f func(byte) bool) int {
+	n := 0
+	for n < len(s) && f(s[n]) {
+		n++
+	}
+	return n
+}
+
+type salLexer struct {
+	src      string
+	pos      lexer.Position
+	inString bool
+}
+
+// Match a token in the Root state.
+func matchRoot(s string) (tokenKind, int) {
+	if strings.HasPrefix(s, "//") {
+		if n := strings.IndexByte(s, '\n'); n >= 0 {
+			return tokenSkip, n
+		}
+		return tokenSkip, len(s)
+	} else if s[0] == '\\' {
+		return tokenSkip, 1
+	} else if n := span(s, func(c byte) bool { return c == '\r' || c == '\t' || c == ' ' }); n > 0 {
+		return tokenSkip, n
+	}
+
+	word := span(s, isWordByte)
+	if keywords[s[:word]] {
+		return tokenKeyword, word
+	} else if isAlpha(s[0]) || s[0] == '_' {
+		return tokenIdent, word
+	}
+
+	// A number may have a sign, and must not run into a word.
+	sign := 0
+	if s[0] == '-' || s[0] == '+' {
+		sign = 1
+	}
+	if digits := span(s[sign:], isDigit); digits > 0 {
+		n := sign + digits
+		if n < len(s) && s[n] == '.' {
+			if frac := span(s[n+1:], isDigit); frac > 0 {
+				if m := n + 1 + frac; m == len(s) || !isWordByte(s[m]) {
+					return tokenFloat, m
+				}
+			}
+		}
+		if n == len(s) || !isWordByte(s[n]) {
+			return tokenInt, n
+		}
+	}
+
+	switch s[0] {
+	case '"':
+		return tokenString, 1
+	case '\n':
+		return tokenNewline, 1
+	}
+	for _, op := range operators {
+		if strings.HasPrefix(s, op) {
+			return tokenOperator, len(op)
+		}
+	}
+	if s[0] == '=' {
+		return tokenAssignment, 1
+	} else if strings.HasPrefix(s, ":=") {
+		return tokenAssignment, 2
+	} else if strings.IndexByte("-+*/<>%^!|&", s[0]) >= 0 {
+		return tokenSingleOperator, 1
+	} else if strings.IndexByte("]`~[()@#${}:;?.,", s[0]) >= 0 {
+		return tokenPunct, 1
+	}
+	return tokenEOF, 0
+}
+
+// Match a token in the String state.
+func matchString(s string) (tokenKind, int) {
+	if s[0] == '\\' {
+		if r, n := utf8.DecodeRuneInString(s[1:]); n > 0 && r != '\n' {
+			return tokenEscaped, 1 + n
+		}
+	} else if s[0] == '"' {
+		return tokenStringEnd, 1
+	}
+	if n := span(s, func(c byte) bool { return c != '{' && c != '"' && c != '\\' }); n > 0 {
+		return tokenChars, n
+	}
+	return tokenEOF, 0
+}
+
+// Return the next token, skipping comments and white space.
+func (l *salLexer) next() (salToken, error) {
+	for l.pos.Offset < len(l.src) {
+		s := l.src[l.pos.Offset:]
+		var kind tokenKind
+		var n int
+		if l.inString {
+			kind, n = matchString(s)
+		} else {
+			kind, n = matchRoot(s)
+		}
+		if n == 0 {
+			return salToken{}, fmt.Errorf("%d:%d: invalid input text %q", l.pos.Line, l.pos.Column, s[:min(len(s), 10)])
+		}
+		token := salToken{kind, s[:n], l.pos}
+		l.advance(token.value)
+		switch kind {
+		case tokenSkip:
+			continue
+		case tokenString:
+			l.inString = true
+		case tokenStringEnd:
+			l.inString = false
+		}
+		return token, nil
+	}
+	return salToken{kind: tokenEOF, pos: l.pos}, nil
+}
+
+func (l *salLexer) advance(text string) {
+	l.pos.Offset += len(text)
+	lines := strings.Count(text, "\n")
+	l.pos.Line += lines
+	if lines == 0 {
+		l.pos.Column += utf8.RuneCountInString(text)
+	} else {
+		l.pos.Column = utf8.RuneCountInString(text[strings.LastIndex(text, "\n"):])
+	}
+}
+
+// Split src into tokens. Like fixupLexer, newlines that can end a
+// statement become semi-colons, and a semi-colon is inserted before "}"
+// and the end of the input if there is not one already.
+func lexSAL(src string) ([]salToken, error) {
+	l := salLexer{src: src, pos: lexer.Position{Line: 1, Column: 1}}
+	tokens := make([]salToken, 0, len(src)/4)
+	var last salToken
+	for {
+		token, err := l.next()
+		if err != nil {
+			return nil, err
+		}
+		if token.value == "\n" {
+			if last.value == ";" {
+				continue
+			}
+			switch last.value {
+			case ")", "}", "]", ">>>":
+			default:
+				switch last.kind {
+				case tokenInt, tokenFloat, tokenStringEnd, tokenIdent:
+				default:
+					last = token
+					continue
+				}
+			}
+			token.kind, token.value = tokenSemicolon, ";"
+		} else if token.value == "}" || token.kind == tokenEOF {
+			if last.value != ";" {
+				tokens = append(tokens, salToken{tokenSemicolon, ";", token.pos})
+				token.pos = lexer.Position{}
+			}
+		}
+		tokens = append(tokens, token)
+		last = token
+		if token.kind == tokenEOF {
+			return tokens, nil
+		}
+	}
+}
+
+// Parser
+
+type salParser struct {
+	tokens []salToken
+	i      int
+}
+
+// A parse error, which is panicked and recovered by parseSAL.
+type parseError struct{ error }
+
+// Parse a SAL program.
+func parseSAL(src string) (body *Body, err error) {
+	tokens, err := lexSAL(src)
+	if err != nil {
+		return nil, err
+	}
+	defer func() {
+		if r := recover(); r != nil {
+			e, ok := r.(parseError)
+			if !ok {
+				panic(r)
+			}
+			body, err = nil, e.error
+		}
+	}()
+	p := salParser{tokens: tokens}
+	body = p.body()
+	if p.peek().kind != tokenEOF {
+		p.fail()
+	}
+	return body, nil
+}
+
+func (p *salParser) peek() *salToken {
+	return &p.tokens[p.i]
+}
+
+// Return the token n tokens after the next one.
+func (p *salParser) peekN(n int) *salToken {
+	return &p.tokens[min(p.i+n, len(p.tokens)-1)]
+}
+
+func (p *salParser) next() *salToken {
+	token := &p.tokens[p.i]
+	if token.kind != tokenEOF {
+		p.i++
+	}
+	return token
+}
+
+func (p *salParser) errorf(format string, a ...any) {
+	pos := p.peek().pos
+	panic(parseError{fmt.Errorf("%d:%d: %s", pos.Line, pos.Column, fmt.Sprintf(format, a...))})
+}
+
+func (p *salParser) fail() {
+	if token := p.peek(); token.kind == tokenEOF {
+		p.errorf("unexpected token \"<EOF>\"")
+	} else {
+		p.errorf("unexpected token %q", token.value)
+	}
+}
+
+// If the next token is value, consume it and return true.
+func (p *salParser) accept(value string) bool {
+	if p.peek().value == value {
+		p.next()
+		return true
+	}
+	return false
+}
+
+func (p *salParser) expect(value string) {
+	if !p.accept(value) {
+		p.fail()
+	}
+}
+
+func (p *salParser) ident() string {
+	if p.peek().kind != tokenIdent {
+		p.fail()
+	}
+	return p.next().value
+}
+
+// If the next token is one of ops, consume it and return it; otherwise
+// return "".
+func (p *salParser) acceptOp(ops ...string) string {
+	value := p.peek().value
+	for _, op := range ops {
+		if value == op {
+			p.next()
+			return op
+		}
+	}
+	return ""
+}
+
+// Whether token can start a UnaryExp.
+func startsUnary(token *salToken) bool {
+	switch token.kind {
+	case tokenIdent, tokenInt, tokenFloat:
+		return true
+	}
+	switch token.value {
+	case "~", "+", "-", "#", "<<<", "\"", "[", "{", "fn", "(":
+		return true
+	}
+	return false
+}
+
+// Whether token can start an Expression.
+func startsExpression(token *salToken) bool {
+	return startsUnary(token) || token.value == "if" || token.value == "loop"
+}
+
+func (p *salParser) body() *Body {
+	b := &Body{Pos: p.peek().pos}
+	for p.peek().value == ";" || startsExpression(p.peek()) {
+		if b.Statements == nil {
+			b.Statements = &[]Statement{}
+		}
+		*b.Statements = append(*b.Statements, p.statement())
+	}
+	switch p.peek().value {
+	case "return", "break", "continue":
+		b.Terminator = p.terminator()
+	}
+	return b
+}
+
+func (p *salParser) block() *Block {
+	b := &Block{Pos: p.peek().pos}
+	p.expect("{")
+	b.Body = p.body()
+	p.expect("}")
+	return b
+}
+
+func (p *salParser) statement() Statement {
+	s := Statement{Pos: p.peek().pos}
+	word := p.peek().value
+	switch {
+	case p.accept(";"):
+		s.Empty = true
+	case word == "use" && p.peekN(1).kind == tokenIdent:
+		s.Use = p.use()
+		p.expect(";")
+	case word == "let" && p.peekN(1).kind == tokenIdent:
+		declarations := []Declaration{}
+		for p.peek().value == "let" && p.peekN(1).kind == tokenIdent {
+			declarations = append(declarations, p.declaration())
+			p.expect(";")
+		}
+		s.Declarations = &declarations
+	default:
+		s.Assignment = p.assignment()
+		p.expect(";")
+	}
+	return s
+}
+
+func (p *salParser) use() *Use {
+	u := &Use{Pos: p.peek().pos}
+	p.expect("use")
+	path := []string{p.ident()}
+	for p.peek().value == "." && p.peekN(1).kind == tokenIdent {
+		p.next()
+		path = append(path, p.ident())
+	}
+	u.Path = &path
+	return u
+}
+
+func (p *salParser) declaration() Declaration {
+	d := Declaration{Pos: p.peek().pos}
+	p.expect("let")
+	variable := p.ident()
+	d.Variable = &variable
+	p.expect("=")
+	d.Value = p.expression()
+	return d
+}
+
+func (p *salParser) assignment() *Assignment {
+	a := &Assignment{Pos: p.peek().pos}
+	a.Lvalue = p.expression()
+	if p.accept(":=") {
+		a.Expression = p.expression()
+	}
+	return a
+}
+
+func (p *salParser) terminator() *Terminator {
+	t := &Terminator{}
+	switch p.next().value {
+	case "return":
+		t.Return = p.expression()
+	case "break":
+		if startsExpression(p.peek()) {
+			t.BreakExp = p.expression()
+		} else {
+			t.Break = true
+		}
+	case "continue":
+		t.Continue = true
+	}
+	p.expect(";")
+	return t
+}
+
+func (p *salParser) expression() *Expression {
+	e := &Expression{Pos: p.peek().pos}
+	word := p.peek().value
+	switch {
+	case word == "if":
+		e.Ifs = p.ifs()
+	case word == "loop":
+		p.next()
+		e.Loop = p.block()
+	case word == "asm" && p.peekN(1).value == "{":
+		p.next()
+		p.next()
+		var statements []AsmStatement
+		for p.peek().value != "}" {
+			statements = append(statements, p.asmStatement())
+		}
+		p.next()
+		if statements != nil {
+			e.Asm = &statements
+		}
+	case word == "for" && p.peekN(1).kind == tokenIdent:
+		p.next()
+		e.ForVar = p.ident()
+		p.expect("in")
+		e.Iter = p.expression()
+		e.Body = p.block()
+	default:
+		e.Expression = p.logicExp()
+	}
+	return e
+}
+
+func (p *salParser) ifs() *Ifs {
+	i := &Ifs{Pos: p.peek().pos}
+	ifList := []If{p.ifClause()}
+	for p.peek().value == "else" && p.peekN(1).value == "if" {
+		p.next()
+		ifList = append(ifList, p.ifClause())
+	}
+	i.IfList = &ifList
+	if p.peek().value == "else" && p.peekN(1).value == "{" {
+		p.next()
+		i.FinalElse = p.block()
+	}
+	return i
+}
+
+func (p *salParser) ifClause() If {
+	i := If{Pos: p.peek().pos}
+	p.expect("if")
+	i.Cond = p.expression()
+	i.Then = p.block()
+	return i
+}
+
+func (p *salParser) asmStatement() AsmStatement {
+	a := AsmStatement{Pos: p.peek().pos}
+	word, arg := p.peek().value, p.peekN(1)
+	isArg := arg.kind == tokenIdent && p.peekN(2).value == ";"
+	switch {
+	case word == "trap" && isArg:
+		p.next()
+		trap := p.ident()
+		a.Trap = &trap
+	case word == "single" && isArg:
+		p.next()
+		single := p.ident()
+		a.Single = &single
+	case word == "quote" && isArg:
+		p.next()
+		quote := p.ident()
+		a.Quote = &quote
+	case word == "quote" && arg.value == "trap" && p.peekN(2).kind == tokenIdent && p.peekN(3).value == ";":
+		p.next()
+		p.next()
+		trap := p.ident()
+		a.QuoteTrap = &trap
+	default:
+		a.Expression = p.primaryExp()
+	}
+	p.expect(";")
+	return a
+}
+
+// The binary operators have one function per level of precedence, from
+// lowest to highest. Each level is right-recursive, like the grammar, so
+// that the syntax tree has the same shape.
+
+func (p *salParser) logicExp() *LogicExp {
+	e := &LogicExp{Pos: p.peek().pos}
+	e.Left = p.logicNotExp()
+	if e.Op = p.acceptOp("and", "or"); e.Op != "" {
+		e.Right = p.logicExp()
+	}
+	return e
+}
+
+func (p *salParser) logicNotExp() *LogicNotExp {
+	e := &LogicNotExp{Pos: p.peek().pos}
+	if p.peek().value == "not" && startsUnary(p.peekN(1)) {
+		p.next()
+		e.LogicNotExp = p.logicNotExp()
+	} else {
+		e.PushExp = p.pushExp()
+	}
+	return e
+}
+
+func (p *salParser) pushExp() *PushExp {
+	e := &PushExp{Pos: p.peek().pos}
+	e.Left = p.bitwiseExp()
+	if e.Op = p.acceptOp("<<", ">>"); e.Op != "" {
+		e.Right = p.pushExp()
+	}
+	return e
+}
+
+func (p *salParser) bitwiseExp() *BitwiseExp {
+	e := &BitwiseExp{Pos: p.peek().pos}
+	e.Left = p.compareExp()
+	if e.Op = p.acceptOp("&", "^", "|"); e.Op != "" {
+		e.Right = p.bitwiseExp()
+	}
+	return e
+}
+
+func (p *salParser) compareExp() *CompareExp {
+	e := &CompareExp{Pos: p.peek().pos}
+	e.Left = p.sumExp()
+	if e.Op = p.acceptOp("==", "!=", "<", "<=", ">", ">="); e.Op != "" {
+		e.Right = p.compareExp()
+	}
+	return e
+}
+
+func (p *salParser) sumExp() *SumExp {
+	e := &SumExp{Pos: p.peek().pos}
+	e.Left = p.productExp()
+	if e.Op = p.acceptOp("+", "-"); e.Op != "" {
+		e.Right = p.sumExp()
+	}
+	return e
+}
+
+func (p *salParser) productExp() *ProductExp {
+	e := &ProductExp{Pos: p.peek().pos}
+	e.Left = p.exponentExp()
+	if e.Op = p.acceptOp("*", "/", "%"); e.Op != "" {
+		e.Right = p.productExp()
+	}
+	return e
+}
+
+func (p *salParser) exponentExp() *ExponentExp {
+	e := &ExponentExp{Pos: p.peek().pos}
+	e.Left = p.unaryExp()
+	if p.accept("**") {
+		e.Right = p.exponentExp()
+	}
+	return e
+}
+
+func (p *salParser) unaryExp() *UnaryExp {
+	e := &UnaryExp{Pos: p.peek().pos}
+	if e.PreOp = p.acceptOp("~", "+", "-", "#", "<<<"); e.PreOp != "" {
+		e.PrefixUnaryExp = p.unaryExp()
+	} else {
+		e.PostfixExp = p.callExp()
+		if p.accept(">>>") {
+			op := ">>>"
+			e.PostOp = &op
+		}
+	}
+	return e
+}
+
+func (p *salParser) callExp() *CallExp {
+	e := &CallExp{Pos: p.peek().pos}
+	e.Function = p.indexedExp()
+	for p.peek().value == "(" {
+		if e.Calls == nil {
+			e.Calls = &[]Args{}
+		}
+		*e.Calls = append(*e.Calls, p.args())
+	}
+	return e
+}
+
+func (p *salParser) args() Args {
+	a := Args{Pos: p.peek().pos}
+	p.expect("(")
+	if p.peek().value != ")" {
+		arguments := []Expression{*p.expression()}
+		for p.peek().value == "," && startsExpression(p.peekN(1)) {
+			p.next()
+			arguments = append(arguments, *p.expression())
+		}
+		p.accept(",")
+		a.Arguments = &arguments
+	}
+	p.expect(")")
+	return a
+}
+
+func (p *salParser) indexedExp() *IndexedExp {
+	e := &IndexedExp{Pos: p.peek().pos}
+	e.Object = p.primaryExp()
+	for p.accept("[") {
+		if e.Indexes == nil {
+			e.Indexes = &[]Expression{}
+		}
+		*e.Indexes = append(*e.Indexes, *p.expression())
+		p.expect("]")
+	}
+	return e
+}
+
+func (p *salParser) primaryExp() *PrimaryExp {
+	e := &PrimaryExp{Pos: p.peek().pos}
+	token := p.peek()
+	switch {
+	case token.value == "null":
+		p.next()
+		e.Null = true
+	case token.value == "false" || token.value == "true":
+		p.next()
+		b := Boolean(token.value == "true")
+		e.Bool = &b
+	case token.kind == tokenInt:
+		n, err := strconv.ParseInt(token.value, 0, 64)
+		if err != nil {
+			p.errorf("%v", err)
+		}
+		p.next()
+		e.Int = &n
+	case token.kind == tokenFloat:
+		f, err := strconv.ParseFloat(token.value, 64)
+		if err != nil {
+			p.errorf("%v", err)
+		}
+		p.next()
+		e.Float = &f
+	case token.value == "\"":
+		e.String = p.stringLiteral()
+	case token.value == "[" && p.peekN(1).value == ":":
+		p.next()
+		p.next()
+		p.expect("]")
+		e.EmptyMap = true
+	case token.value == "[":
+		p.next()
+		if p.peek().value != "]" {
+			pairs := []Pair{p.pair()}
+			for p.peek().value == "," && startsExpression(p.peekN(1)) {
+				p.next()
+				pairs = append(pairs, p.pair())
+			}
+			p.accept(",")
+			e.Container = &pairs
+		}
+		p.expect("]")
+	case token.value == "{":
+		e.Block = p.block()
+	case (token.value == "fn" || token.value == "gen") && p.peekN(1).value == "(":
+		e.Function = p.function()
+	case token.kind == tokenIdent:
+		variable := p.next().value
+		e.Variable = &variable
+	case token.value == "(":
+		p.next()
+		e.Paren = p.expression()
+		p.expect(")")
+	default:
+		p.fail()
+	}
+	return e
+}
+
+func (p *salParser) pair() Pair {
+	pair := Pair{Pos: p.peek().pos}
+	pair.Key = p.expression()
+	if p.accept(":") {
+		pair.Value = p.expression()
+	}
+	return pair
+}
+
+func (p *salParser) stringLiteral() *String {
+	s := &String{Pos: p.peek().pos}
+	p.expect("\"")
+	for {
+		token := p.peek()
+		if token.kind == tokenEscaped {
+			s.Fragments = append(s.Fragments, &StringFragment{Pos: token.pos, Escaped: token.value})
+		} else if token.kind == tokenChars {
+			s.Fragments = append(s.Fragments, &StringFragment{Pos: token.pos, String: token.value})
+		} else {
+			break
+		}
+		p.next()
+	}
+	p.expect("\"")
+	return s
+}
+
+func (p *salParser) function() *Function {
+	f := &Function{Pos: p.peek().pos}
+	f.FnType = p.next().value
+	p.expect("(")
+	if p.peek().kind == tokenIdent {
+		parameters := []string{p.ident()}
+		for p.peek().value == "," && p.peekN(1).kind == tokenIdent {
+			p.next()
+			parameters = append(parameters, p.ident())
+		}
+		p.accept(",")
+		f.Parameters = &parameters
+	}
+	p.expect(")")
+	f.Body = p.block()
+	return f
+}
@@ -0,0 +1,106 @@
+/*
+Tests for SAL parser
+
+Copyright © 2025-2026 Reuben Thomas <rrt@sc3d.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+package main
+
+import (
+	"os"
+	"path/filepath"
+	"strings"
+	"testing"
+
+	"github.com/alecthomas/assert/v2"
+	"github.com/alecthomas/participle/v2"
+)
+
+// The participle parser built from the grammar in the syntax tree's struct
+// tags, against which the hand-written parser is checked. It is only built
+// for the tests, as building it is slow.
+var parser = participle.MustBuild[Body](
+	participle.Lexer(&fixupLexerDefinition{}),
+	participle.UseLookahead(1),
+)
+
+// The hand-written parser must build the same syntax tree as the
+// participle parser, and reject the same programs.
+func TestParser(t *testing.T) {
+	files, err := filepath.Glob("test/*.sal")
+	assert.NoError(t, err)
+	assert.True(t, len(files) > 0)
+	for _, file := range files {
+		src, err := os.ReadFile(file)
+		assert.NoError(t, err)
+		expected, expectedErr := parser.ParseString("", string(src))
+		actual, err := parseSAL(string(src))
+		if expectedErr != nil {
+			assert.True(t, err != nil, file)
+		} else {
+			assert.NoError(t, err, file)
+			assert.Equal(t, expected, actual, file)
+		}
+	}
+}
+
+func TestParserErrors(t *testing.T) {
+	for _, src := range []string{"a := (1", "let x = ", "\"abc{\"", "f(,)", "1abc"} {
+		_, err := parser.ParseString("", src)
+		assert.True(t, err != nil, src)
+		_, err = parseSAL(src)
+		assert.True(t, err != nil, src)
+	}
+}
+
+// A large program, made of the test programs that parse, each in a block.
+func benchmarkSource(b *testing.B) string {
+	files, err := filepath.Glob("test/*.sal")
+	assert.NoError(b, err)
+	var src strings.Builder
+	for range 20 {
+		for _, file := range files {
+			text, err := os.ReadFile(file)
+			assert.NoError(b, err)
+			if _, err := parseSAL(string(text)); err != nil {
+				continue
+			}
+			src.WriteString("{\n")
+			src.Write(text)
+			src.WriteString("\n}\n")
+		}
+	}
+	return src.String()
+}
+
+func BenchmarkParser(b *testing.B) {
+	src := benchmarkSource(b)
+	b.SetBytes(int64(len(src)))
+	b.ResetTimer()
+	for range b.N {
+		_, err := parseSAL(src)
+		assert.NoError(b, err)
+	}
+}
+
+func BenchmarkParticiple(b *testing.B) {
+	src := benchmarkSource(b)
+	b.SetBytes(int64(len(src)))
+	b.ResetTimer()
+	for range b.N {
+		_, err := parser.ParseString("", src)
+		assert.NoError(b, err)
+	}
+}
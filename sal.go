@@ -20,6 +20,7 @@ along with this program. If not, see <https://www.gnu.org/licenses/>.
 package main
 
 import (
+	"crypto/sha256"
 	"encoding/json"
 	"fmt"
 	"os"
@@ -381,7 +382,7 @@ func (e *UnaryExp) Compile(ctx *Scope) {
 		case "+":
 			break // no-op
 		case "-":
-			ctx.compileInst("neg")
+			ctx.compileInst("neg" + ctx.frame.typedInst(e.PrefixUnaryExp))
 		case "#":
 			ctx.compileTrap("size")
 		case "<<<":
@@ -407,12 +408,24 @@ func (e *UnaryExp) Compile(ctx *Scope) {
 }
 
 func (e *CallExp) Compile(ctx *Scope) {
-	// Check whether the first call is a trap
-	haveTrap := false
+	e.compileCall(ctx, false)
+}
+
+// Check whether the first call is a trap
+func (e *CallExp) startsWithTrap(ctx *Scope) bool {
 	maybeId := e.Function.Object.Variable
-	if maybeId != nil {
-		haveTrap = ctx.isTrap(*maybeId)
-	}
+	return maybeId != nil && ctx.isTrap(*maybeId)
+}
+
+// Check whether the last call can be made as a tail call
+func (e *CallExp) canTailCall(ctx *Scope) bool {
+	return ctx.frame.tailCalls && e.Calls != nil && !(len(*e.Calls) == 1 && e.startsWithTrap(ctx))
+}
+
+// Compile a call; if tail is true, the last call is a tail call, which
+// replaces the current function's frame and does not return.
+func (e *CallExp) compileCall(ctx *Scope, tail bool) {
+	haveTrap := e.startsWithTrap(ctx)
 
 	// Argument lists
 	if e.Calls != nil {
@@ -438,6 +451,11 @@ func (e *CallExp) Compile(ctx *Scope) {
 		for i, args := range *e.Calls {
 			if i == 0 && haveTrap {
 				ctx.compileTrapCall(*e.Function.Object.Variable, args.Arguments)
+			} else if tail && i == len(*e.Calls)-1 {
+				ctx.compileTrap("tail_call")
+				if args.Arguments != nil {
+					ctx.adjustSp(-(len(*args.Arguments)))
+				}
 			} else {
 				ctx.compileInst("new")
 				ctx.compileInst("zero")
@@ -479,7 +497,7 @@ func (e *ProductExp) Compile(ctx *Scope) {
 		e.Right.Compile(ctx)
 		switch e.Op {
 		case "*":
-			ctx.compileInst("mul")
+			ctx.compileInst("mul" + ctx.frame.typedInst(e.Left, e.Right))
 		case "/":
 			ctx.compileTrap("div")
 		case "%":
@@ -494,12 +512,13 @@ func (e *SumExp) Compile(ctx *Scope) {
 	e.Left.Compile(ctx)
 	if e.Right != nil {
 		e.Right.Compile(ctx)
+		typed := ctx.frame.typedInst(e.Left, e.Right)
 		switch e.Op {
 		case "+":
-			ctx.compileInst("add")
+			ctx.compileInst("add" + typed)
 		case "-":
-			ctx.compileInst("neg")
-			ctx.compileInst("add")
+			ctx.compileInst("neg" + typed)
+			ctx.compileInst("add" + typed)
 		default:
 			panic(fmt.Errorf("unknown SumExp.Op %s", e.Op))
 		}
@@ -510,6 +529,7 @@ func (e *CompareExp) Compile(ctx *Scope) {
 	e.Left.Compile(ctx)
 	if e.Right != nil {
 		e.Right.Compile(ctx)
+		lt := "lt" + ctx.frame.typedInst(e.Left, e.Right)
 		switch e.Op {
 		case "==":
 			ctx.compileInst("eq")
@@ -517,16 +537,16 @@ func (e *CompareExp) Compile(ctx *Scope) {
 			ctx.compileInst("eq")
 			ctx.compileInst("not")
 		case "<":
-			ctx.compileInst("lt")
+			ctx.compileInst(lt)
 		case "<=":
 			ctx.compileInst("swap")
-			ctx.compileInst("lt")
+			ctx.compileInst(lt)
 			ctx.compileInst("not")
 		case ">":
 			ctx.compileInst("swap")
-			ctx.compileInst("lt")
+			ctx.compileInst(lt)
 		case ">=":
-			ctx.compileInst("lt")
+			ctx.compileInst(lt)
 			ctx.compileInst("not")
 		default:
 			panic(fmt.Errorf("unknown SumExp.Op %s", e.Op))
@@ -611,23 +631,29 @@ func (e *Expression) Compile(ctx *Scope) {
 	if e.Ifs != nil {
 		e.Ifs.Compile(ctx)
 	} else if e.Loop != nil {
+		nhoisted := ctx.hoistClosures(e.Loop, "")
 		ctx.compileNull()
 		blockCtx := e.Loop.Compile(ctx, true)
 		ctx.compileLoop(&blockCtx)
+		ctx.dropUnder(nhoisted)
 	} else if e.Asm != nil {
 		for _, s := range *e.Asm {
 			s.Compile(ctx)
 		}
+	} else if e.ForVar != "" && ctx.compileCountedFor(e) {
+		// Done
 	} else if e.ForVar != "" {
 		// Initialize iterator
 		ctx.locals = append(ctx.locals, Local{id: "$iter", pos: int(ctx.frame.sp)})
 		e.Iter.Compile(ctx)
 		ctx.compileTrap("iter")
+		nhoisted := ctx.hoistClosures(e.Body, e.ForVar)
 		// Loop body
 		ctx.compileNull()
 		blockCtx := ctx.newBlock(true)
 		// Call iterator and test for termination
-		blockCtx.locals = append(blockCtx.locals, Local{id: e.ForVar, pos: int(blockCtx.frame.sp)})
+		forVar := Local{id: e.ForVar, pos: int(blockCtx.frame.sp), cell: ctx.frame.isLoopCell(e.ForVar)}
+		blockCtx.locals = append(blockCtx.locals, forVar)
 		blockCtx.compileGetVar("$iter")
 		blockCtx.compileTrap("next")
 		blockCtx.compileNull() // return value
@@ -638,10 +664,16 @@ func (e *Expression) Compile(ctx *Scope) {
 				ctx.compileInst("eq")
 			},
 			func(ctx *Scope) { ctx.compileBreak() },
-			func(ctx *Scope) { ctx.compileBlock(e.Body) },
+			func(ctx *Scope) {
+				if forVar.cell {
+					ctx.compileMakeCell(forVar.pos)
+				}
+				ctx.compileBlock(e.Body)
+			},
 		)
 		// Complete the loop body and add to the current context
 		ctx.compileLoop(&blockCtx)
+		ctx.dropUnder(nhoisted)
 	} else if e.Expression != nil {
 		e.Expression.Compile(ctx)
 	} else {
@@ -657,16 +689,16 @@ func (ctx *Scope) compileIf(cond compiler, then compiler, else_ compiler) {
 	}
 	cond(ctx)
 	ctx.compileInt(0) // space for jump target
-	ifJumpAddr := libsam.Uword(ctx.frame.asm.array.Sp() - 1)
+	ifJumpAddr := ctx.frame.asm.sp() - 1
 	ctx.compileTrap("jump_if_false")
 	ifJumpSp := ctx.frame.sp
 	then(ctx)
 	var thenJumpAddr libsam.Uword
 	ctx.compileInt(0) // space for jump target
-	thenJumpAddr = libsam.Uword(ctx.frame.asm.array.Sp() - 1)
+	thenJumpAddr = ctx.frame.asm.sp() - 1
 	ctx.compileTrap("jump")
 	ctx.frame.asm.flushInstructions()
-	ctx.frame.asm.array.Poke(ifJumpAddr, libsam.Uword(libsam.MakeInstInt(libsam.Word(ctx.frame.asm.array.Sp()-ifJumpAddr-2))))
+	ctx.frame.asm.pokeInt(ifJumpAddr, libsam.Word(ctx.frame.asm.sp()-ifJumpAddr-2))
 	ctx.frame.sp = ifJumpSp
 	if else_ != nil {
 		else_(ctx)
@@ -674,7 +706,7 @@ func (ctx *Scope) compileIf(cond compiler, then compiler, else_ compiler) {
 		ctx.compileNull()
 	}
 	ctx.frame.asm.flushInstructions()
-	ctx.frame.asm.array.Poke(thenJumpAddr, libsam.Uword(libsam.MakeInstInt(libsam.Word(ctx.frame.asm.array.Sp()-thenJumpAddr-2))))
+	ctx.frame.asm.pokeInt(thenJumpAddr, libsam.Word(ctx.frame.asm.sp()-thenJumpAddr-2))
 }
 
 func (ctx *Scope) compileIfs(il *[]If, fe *Block) {
@@ -760,8 +792,17 @@ func (ctx *Scope) compileTrapCall(function string, args *[]Expression) {
 }
 
 func (d *Declaration) Compile(ctx *Scope) {
-	ctx.locals = append(ctx.locals, Local{id: *d.Variable, pos: int(ctx.frame.sp)})
-	d.Value.Compile(ctx)
+	cell := ctx.frame.isCell(*d.Variable)
+	ctx.locals = append(ctx.locals, Local{id: *d.Variable, pos: int(ctx.frame.sp), cell: cell})
+	if cell {
+		// Make the cell first, so the value can capture it.
+		ctx.compileInst("new")
+		d.Value.Compile(ctx)
+		ctx.compileInst("over")
+		ctx.compileInst("append")
+	} else {
+		d.Value.Compile(ctx)
+	}
 }
 
 func (s *Statement) Compile(ctx *Scope) {
@@ -774,13 +815,7 @@ func (s *Statement) Compile(ctx *Scope) {
 			d.Compile(ctx)
 		}
 	} else if s.Use != nil {
-		filename := strings.Join(*s.Use.Path, ".")
-		if src, err := os.ReadFile(filename); err == nil {
-			body := parseSource(string(src))
-			body.Compile(ctx)
-		} else {
-			panic(fmt.Errorf("bad use path %s", filename))
-		}
+		usedBody(s.Use).Compile(ctx)
 	} else {
 		panic("invalid Statement")
 	}
@@ -788,8 +823,12 @@ func (s *Statement) Compile(ctx *Scope) {
 
 func (t *Terminator) Compile(ctx *Scope) {
 	if t.Return != nil {
-		t.Return.Compile(ctx)
-		ctx.compileTrap("yield")
+		if call := expToCall(t.Return); call != nil && call.canTailCall(ctx) {
+			call.compileCall(ctx, true)
+		} else {
+			t.Return.Compile(ctx)
+			ctx.compileTrap("yield")
+		}
 	} else if t.BreakExp != nil || t.Break {
 		if ctx.loop == nil {
 			panic("'break' used outside a loop")
@@ -814,7 +853,7 @@ func (t *Terminator) Compile(ctx *Scope) {
 		for range ctx.frame.sp - ctx.loop.baseSp {
 			ctx.compileInst("drop")
 		}
-		ctx.compileInt(int(ctx.loop.initialPc - ctx.frame.asm.array.Sp() - 3))
+		ctx.compileInt(int(ctx.loop.initialPc - ctx.frame.asm.sp() - 3))
 		ctx.compileTrap("jump")
 	} else {
 		panic("invalid Terminator")
@@ -842,14 +881,55 @@ func (b *Block) Compile(ctx *Scope, loop bool) Scope {
 }
 
 func (f *Function) Compile(ctx *Scope) {
+	// If the closure was made before the loop it is in, use that.
+	if pos, ok := ctx.frame.hoisted[f]; ok {
+		ctx.compileInt(pos)
+		ctx.compileInst("sget")
+		return
+	}
+
+	// A tail call reuses the frame, so if a closure captures the frame,
+	// compile the function again without tail calls.
+	tailCalls := ctx.frame.optimize && f.FnType == "fn"
+	blockCtx := f.compileBody(ctx, tailCalls)
+	if tailCalls && blockCtx.frame.captured {
+		blockCtx = f.compileBody(ctx, false)
+	}
+
+	// The code is generated, and verified so that it can run with fewer
+	// checks, once the whole program has been compiled.
+	ctx.frame.asm.children = append(ctx.frame.asm.children, blockCtx.frame.asm)
+	if ctx.frame.optimize {
+		blockCtx.frame.asm.verify = true
+		blockCtx.frame.asm.frame = true
+	}
+
+	// Construct closure. Without captures, it is made once, with its code.
+	if ctx.frame.optimize && len(*blockCtx.captures) == 0 {
+		ctx.compileCode(blockCtx.frame.asm, true)
+		return
+	}
+	nitems := ctx.compileCaptures(&blockCtx)
+	ctx.compileCode(blockCtx.frame.asm, false)
+	ctx.compileTrap("new_closure")
+	ctx.adjustSp(-nitems)
+}
+
+func (f *Function) compileBody(ctx *Scope, tailCalls bool) Scope {
 	nargs := libsam.Uword(0)
 	if f.Parameters != nil {
 		nargs = libsam.Uword(len(*f.Parameters))
 	}
 	captures := make([]Capture, 0)
 	frame := Frame{
-		asm: &assembler{array: libsam.NewArray()},
-		sp:  libsam.Word(nargs) + 3,
+		asm:       &assembler{},
+		sp:        libsam.Word(nargs) + 3,
+		optimize:  ctx.frame.optimize,
+		tailCalls: tailCalls,
+	}
+	frame.captureInfo = analyzeCaptures(f.Body.Body)
+	if frame.optimize {
+		frame.types = inferTypes(f.Body.Body, frame.captureInfo)
 	}
 	innerCtx := Scope{
 		frame:     &frame,
@@ -861,7 +941,11 @@ func (f *Function) Compile(ctx *Scope) {
 	}
 	if f.Parameters != nil {
 		for i, p := range *f.Parameters {
-			innerCtx.locals = append(innerCtx.locals, Local{id: p, pos: i + 3})
+			cell := frame.isCell(p)
+			innerCtx.locals = append(innerCtx.locals, Local{id: p, pos: i + 3, cell: cell})
+			if cell {
+				innerCtx.compileMakeCell(i + 3)
+			}
 		}
 	}
 
@@ -870,21 +954,196 @@ func (f *Function) Compile(ctx *Scope) {
 	}
 
 	// Compile function body
-	blockCtx := f.Body.Compile(&innerCtx, false)
-	if f.Body.Body.Terminator == nil {
+	body := f.Body
+	if tailCalls {
+		body = &Block{Pos: body.Pos, Body: tailBody(body.Body)}
+	}
+	blockCtx := body.Compile(&innerCtx, false)
+	if body.Body.Terminator == nil {
 		blockCtx.compileTrap("yield")
 	}
+	return blockCtx
+}
 
-	// Construct closure
-	ctx.compileCaptures(&blockCtx)
-	ctx.compileCode(blockCtx.frame.asm)
-	ctx.compileTrap("new_closure")
-	ctx.adjustSp(-(len(*blockCtx.captures) * 2))
+// Return a copy of a function body in which the final expression, or the
+// final expression of each branch of a final if, is returned explicitly,
+// so that calls in tail position are compiled as tail calls.
+func tailBody(b *Body) *Body {
+	if b.Terminator != nil || b.Statements == nil || len(*b.Statements) == 0 {
+		return b
+	}
+	statements := *b.Statements
+	last := statements[len(statements)-1]
+	if last.Assignment == nil || last.Assignment.Expression != nil {
+		return b
+	}
+	e := last.Assignment.Lvalue
+	if expToCall(e) != nil {
+		rest := slices.Clone(statements[:len(statements)-1])
+		return &Body{Pos: b.Pos, Statements: &rest, Terminator: &Terminator{Return: e}}
+	} else if e.Ifs != nil {
+		ifList := make([]If, len(*e.Ifs.IfList))
+		for i, branch := range *e.Ifs.IfList {
+			ifList[i] = If{Pos: branch.Pos, Cond: branch.Cond, Then: tailBlock(branch.Then)}
+		}
+		ifs := Ifs{Pos: e.Ifs.Pos, IfList: &ifList}
+		if e.Ifs.FinalElse != nil {
+			ifs.FinalElse = tailBlock(e.Ifs.FinalElse)
+		}
+		newStatements := slices.Clone(statements)
+		newStatements[len(newStatements)-1] = Statement{
+			Pos:        last.Pos,
+			Assignment: &Assignment{Pos: last.Assignment.Pos, Lvalue: &Expression{Pos: e.Pos, Ifs: &ifs}},
+		}
+		return &Body{Pos: b.Pos, Statements: &newStatements}
+	}
+	return b
+}
+
+func tailBlock(b *Block) *Block {
+	return &Block{Pos: b.Pos, Body: tailBody(b.Body)}
+}
+
+// Before a loop, make the closures in its body that capture only
+// variables declared outside it, so they are made once rather than on each
+// iteration. forVar is the loop variable, if any. Return the number of
+// closures made.
+func (ctx *Scope) hoistClosures(body *Block, forVar string) int {
+	if !ctx.frame.optimize {
+		return 0
+	}
+	n := 0
+	declared := variablesDeclared(body)
+	if forVar != "" {
+		declared[forVar] = true
+	}
+	walk(body, func(node any) bool {
+		f, ok := node.(*Function)
+		if !ok {
+			return true
+		}
+		captures, invariant := false, true
+		for id := range variablesUsed(f.Body) {
+			if declared[id] {
+				invariant = false
+			} else if ctx.isVisible(id) {
+				captures = true
+			}
+		}
+		// A closure with no captures is a constant anyway.
+		if captures && invariant {
+			if ctx.frame.hoisted == nil {
+				ctx.frame.hoisted = make(map[*Function]int)
+			}
+			pos := int(ctx.frame.sp)
+			f.Compile(ctx)
+			ctx.frame.hoisted[f] = pos
+			n++
+		}
+		return false // Closures inside f are made when f runs
+	})
+	return n
+}
+
+// Drop the n items under the top of the stack, for example the closures
+// made before a loop, leaving the loop's value.
+func (ctx *Scope) dropUnder(n int) {
+	if n > 0 {
+		ctx.compileInt(-(n + 1))
+		ctx.compileInst("sset")
+		for range n - 1 {
+			ctx.compileInst("drop")
+		}
+	}
+}
+
+// Compile a for loop over an integer or list literal using a counter in
+// a stack slot, advanced and tested by the COUNT trap, rather than an
+// iterator. Return false if the loop is not of this form.
+func (ctx *Scope) compileCountedFor(e *Expression) bool {
+	if !ctx.frame.optimize {
+		return false
+	}
+	p := expToPrimary(e.Iter)
+	if p == nil || !(p.Int != nil || (p.Container != nil && isNonNullList(*p.Container))) {
+		return false
+	}
+	nslots := ctx.hoistClosures(e.Body, e.ForVar)
+	listPos := -1
+	if p.Int != nil {
+		ctx.compileInt(int(*p.Int))
+	} else {
+		listPos = int(ctx.frame.sp)
+		p.Compile(ctx)
+		ctx.compileInt(len(*p.Container))
+		nslots++
+	}
+	ctx.compileInt(-1) // counter
+	nslots += 2
+	ctx.compileNull() // value of loop
+	blockCtx := ctx.newBlock(true)
+
+	// Advance the counter, leaving the loop if it has reached the limit
+	blockCtx.compileInt(0) // space for jump target
+	blockCtx.loop.exitJumps = append(blockCtx.loop.exitJumps, blockCtx.frame.asm.sp()-1)
+	blockCtx.compileTrap("count")
+
+	// The counter is the loop variable, or indexes the list
+	forVar := Local{id: e.ForVar, pos: int(blockCtx.frame.sp - 1), cell: ctx.frame.isLoopCell(e.ForVar)}
+	blockCtx.locals = append(blockCtx.locals, forVar)
+	if listPos >= 0 {
+		blockCtx.compileInt(listPos)
+		blockCtx.compileInst("sget")
+		blockCtx.compileInst("get")
+	}
+	if forVar.cell {
+		blockCtx.compileMakeCell(forVar.pos)
+	}
+
+	// The body's value is not used, so compile it in the loop's scope, as
+	// for `loop`
+	e.Body.Body.Compile(&blockCtx)
+	ctx.compileLoop(&blockCtx)
+	ctx.dropUnder(nslots)
+	return true
+}
+
+// Check whether a container literal is a list whose elements are literals
+// other than null. An iterator stops at a null element, so a loop over a
+// list that might contain one cannot simply count.
+func isNonNullList(pairs []Pair) bool {
+	for _, p := range pairs {
+		if p.Value != nil {
+			return false
+		}
+		e := expToPrimary(p.Key)
+		if e == nil || (e.Int == nil && e.Float == nil && e.Bool == nil && e.String == nil && e.Container == nil && !e.EmptyMap && e.Function == nil) {
+			return false
+		}
+	}
+	return true
+}
+
+// Check whether a variable is visible in the current scope, without
+// capturing it.
+func (ctx *Scope) isVisible(id string) bool {
+	for s := ctx; s != nil; s = s.parent {
+		if s.findLocal(id) != nil {
+			return true
+		}
+		for _, c := range *s.captures {
+			if c.id == id {
+				return true
+			}
+		}
+	}
+	return false
 }
 
 type Local struct {
-	id  string
-	pos int // relative to base of stack frame
+	id   string
+	pos  int  // relative to base of stack frame
+	cell bool // the stack slot holds a cell containing the value
 }
 
 const (
@@ -894,9 +1153,10 @@ const (
 )
 
 type Capture struct {
-	id  string
-	ty  int
-	pos uint
+	id   string
+	ty   int
+	pos  uint
+	cell bool // the captured value is a cell
 }
 
 func (ctx *Scope) adjustSp(delta int) {
@@ -925,9 +1185,9 @@ func (ctx *Scope) findCapture(id string) *uint {
 	if parent := ctx.parent; parent != nil {
 		var capture *Capture = nil
 		if l := parent.findLocal(id); l != nil {
-			capture = &Capture{id: id, ty: CaptureLocal, pos: uint(l.pos)}
+			capture = &Capture{id: id, ty: CaptureLocal, pos: uint(l.pos), cell: l.cell}
 		} else if i := parent.findCapture(id); i != nil {
-			capture = &Capture{id: id, ty: CaptureParent, pos: *i}
+			capture = &Capture{id: id, ty: CaptureParent, pos: *i, cell: (*parent.captures)[*i].cell}
 		}
 		if capture != nil {
 			newCaptureIndex := uint(len(*ctx.captures))
@@ -938,12 +1198,40 @@ func (ctx *Scope) findCapture(id string) *uint {
 	return nil
 }
 
-func (ctx *Scope) compileCaptures(blockCtx *Scope) {
+// Push the context of a new closure, and return the number of items pushed.
+//
+// Without optimization, each captured variable is a pair of items, the
+// stack frame that holds it and its position there, or for a cell, the
+// cell and 0. With optimization closures are flat: each captured variable
+// is one item, either its value or, if it is a cell, the cell.
+func (ctx *Scope) compileCaptures(blockCtx *Scope) int {
+	if ctx.frame.optimize {
+		for _, c := range *blockCtx.captures {
+			switch c.ty {
+			case CaptureLocal:
+				ctx.compileInt(int(c.pos))
+				ctx.compileInst("sget")
+			case CaptureParent:
+				ctx.compileContextItem(c.pos)
+			default:
+				panic(fmt.Errorf("invalid capture %+v", c))
+			}
+		}
+		ctx.compileInt(len(*blockCtx.captures))
+		return len(*blockCtx.captures)
+	}
 	for _, c := range *blockCtx.captures {
 		switch c.ty {
 		case CaptureLocal:
-			ctx.compileInst("s0")
-			ctx.compileInt(int(c.pos))
+			if c.cell {
+				ctx.compileInt(int(c.pos))
+				ctx.compileInst("sget")
+				ctx.compileInst("zero")
+			} else {
+				ctx.frame.captured = true
+				ctx.compileInst("s0")
+				ctx.compileInt(int(c.pos))
+			}
 		case CaptureParent:
 			ctx.compileCaptureAddr(c.pos)
 		default:
@@ -951,6 +1239,27 @@ func (ctx *Scope) compileCaptures(blockCtx *Scope) {
 		}
 	}
 	ctx.compileInt(len(*blockCtx.captures) * 2)
+	return len(*blockCtx.captures) * 2
+}
+
+// Push item i of the current closure's context, which is item 2 of the
+// stack frame.
+func (ctx *Scope) compileContextItem(i uint) {
+	ctx.compileInt(int(i))
+	ctx.compileInst("two")
+	ctx.compileInst("sget")
+	ctx.compileInst("get")
+}
+
+// Replace the value in stack slot pos with a cell containing it.
+func (ctx *Scope) compileMakeCell(pos int) {
+	ctx.compileInst("new")
+	ctx.compileInt(pos)
+	ctx.compileInst("sget")
+	ctx.compileInst("over")
+	ctx.compileInst("append")
+	ctx.compileInt(pos)
+	ctx.compileInst("sset")
 }
 
 func (ctx *Scope) compileCaptureAddr(i uint) {
@@ -977,11 +1286,25 @@ func (ctx *Scope) isTrap(id string) bool {
 
 func (ctx *Scope) compileGetVar(id string) {
 	if l := ctx.findLocal(id); l != nil {
+		if l.cell {
+			ctx.compileInst("zero")
+		}
 		ctx.compileInt(l.pos)
 		ctx.compileInst("sget")
+		if l.cell {
+			ctx.compileInst("get")
+		}
 	} else if c := ctx.findCapture(id); c != nil {
-		ctx.compileCaptureAddr(*c)
-		ctx.compileInst("get")
+		if !ctx.frame.optimize {
+			ctx.compileCaptureAddr(*c)
+			ctx.compileInst("get")
+		} else if (*ctx.captures)[*c].cell {
+			ctx.compileInst("zero")
+			ctx.compileContextItem(*c)
+			ctx.compileInst("get")
+		} else {
+			ctx.compileContextItem(*c)
+		}
 	} else if _, ok := libsam.TrapStackEffect[strings.ToUpper(id)]; ok {
 		ctx.compileTrap(id)
 	} else {
@@ -991,10 +1314,24 @@ func (ctx *Scope) compileGetVar(id string) {
 
 func (ctx *Scope) compileSetVar(id string) {
 	if l := ctx.findLocal(id); l != nil {
-		ctx.compileInt(l.pos)
-		ctx.compileInst("sset")
+		if l.cell {
+			ctx.compileInst("zero")
+			ctx.compileInt(l.pos)
+			ctx.compileInst("sget")
+			ctx.compileInst("set")
+		} else {
+			ctx.compileInt(l.pos)
+			ctx.compileInst("sset")
+		}
 	} else if c := ctx.findCapture(id); c != nil {
-		ctx.compileCaptureAddr(*c)
+		if !ctx.frame.optimize {
+			ctx.compileCaptureAddr(*c)
+		} else if (*ctx.captures)[*c].cell {
+			ctx.compileInst("zero")
+			ctx.compileContextItem(*c)
+		} else {
+			panic(fmt.Errorf("captured variable %s is not a cell", id))
+		}
 		ctx.compileInst("set")
 	} else {
 		panic(fmt.Errorf("no such variable %s", id))
@@ -1052,6 +1389,41 @@ func expToLvalue(e *Expression) Lvalue {
 	panic("invalid lvalue")
 }
 
+// Return the unary expression that an expression consists of, or nil if it
+// has a binary operator.
+func expToUnary(e *Expression) *UnaryExp {
+	if e.Expression == nil || e.Expression.Right != nil || e.Expression.Left.LogicNotExp != nil {
+		return nil
+	}
+	push := e.Expression.Left.PushExp
+	if push.Right != nil || push.Left.Right != nil || push.Left.Left.Right != nil {
+		return nil
+	}
+	sum := push.Left.Left.Left
+	if sum.Right != nil || sum.Left.Right != nil || sum.Left.Left.Right != nil {
+		return nil
+	}
+	return sum.Left.Left.Left
+}
+
+// If e is a call (or chain of calls), return it.
+func expToCall(e *Expression) *CallExp {
+	unary := expToUnary(e)
+	if unary == nil || unary.PostfixExp == nil || unary.PostOp != nil || unary.PostfixExp.Calls == nil {
+		return nil
+	}
+	return unary.PostfixExp
+}
+
+// If e is a primary expression, such as a literal, return it.
+func expToPrimary(e *Expression) *PrimaryExp {
+	unary := expToUnary(e)
+	if unary == nil || unary.PostfixExp == nil || unary.PostOp != nil || unary.PostfixExp.Calls != nil || unary.PostfixExp.Function.Indexes != nil {
+		return nil
+	}
+	return unary.PostfixExp.Function.Object
+}
+
 func (ctx *Scope) compileAssignLvalue(e *Expression) {
 	lv := expToLvalue(e)
 	if lv.IndexedExp == nil {
@@ -1062,8 +1434,50 @@ func (ctx *Scope) compileAssignLvalue(e *Expression) {
 }
 
 type Frame struct {
-	asm *assembler
-	sp  libsam.Word
+	asm         *assembler
+	sp          libsam.Word
+	optimize    bool                 // enable optimizations
+	tailCalls   bool                 // compile calls in tail position as tail calls
+	captured    bool                 // a closure has captured a local of this frame
+	captureInfo *captureInfo         // how locals are captured
+	hoisted     map[*Function]int    // stack slots of closures made before loops
+	types       map[string]valueType // types of locals, when optimizing
+}
+
+func (f *Frame) isCell(id string) bool {
+	return f.optimize && f.captureInfo.isCell(id)
+}
+
+// Each iteration of a for loop has its own loop variable, so a closure
+// made in the loop sees the value of its own iteration. Without
+// optimization, other captured variables are referred to by their stack
+// slots, so a captured loop variable, whose slot the next iteration
+// overwrites, is kept in a cell.
+func (f *Frame) isLoopCell(id string) bool {
+	if f.optimize {
+		return f.isCell(id)
+	}
+	return f.captureInfo.captured[id]
+}
+
+// Return the suffix of the typed version of an arithmetic or comparison
+// instruction whose operands are the given expressions, or "" if their
+// type is not known.
+func (f *Frame) typedInst(operands ...any) string {
+	if f.types == nil {
+		return ""
+	}
+	t := typeNone
+	for _, o := range operands {
+		t = joinTypes(t, typeOf(o, f.types))
+	}
+	switch t {
+	case typeInt:
+		return "_int"
+	case typeFloat:
+		return "_float"
+	}
+	return ""
 }
 
 type Scope struct {
@@ -1128,9 +1542,12 @@ func (ctx *Scope) compileBlob(s libsam.Blob) {
 	ctx.adjustSp(1)
 }
 
-func (ctx *Scope) compileCode(asm *assembler) {
+// Compile a reference to the code of a function, or to a closure of it
+// with no captures, which is made once.
+func (ctx *Scope) compileCode(asm *assembler, closure bool) {
 	asm.flushInstructions()
-	ctx.compileBlob(asm.array)
+	ctx.frame.asm.addCode(asm, closure)
+	ctx.adjustSp(1)
 }
 
 func (ctx *Scope) compileQuote(inst string) {
@@ -1168,10 +1585,9 @@ func (ctx *Scope) compileTrap(trapName string) {
 }
 
 func (ctx *Scope) resolveExitJumps() {
-	jumpAddr := ctx.frame.asm.array.Sp()
+	jumpAddr := ctx.frame.asm.sp()
 	for _, addr := range ctx.exitJumps {
-		jumpInst := libsam.Uword(libsam.MakeInstInt(libsam.Word(jumpAddr - addr - 2)))
-		ctx.frame.asm.array.Poke(addr, jumpInst)
+		ctx.frame.asm.pokeInt(addr, libsam.Word(jumpAddr-addr-2))
 	}
 }
 
@@ -1181,7 +1597,7 @@ func (ctx *Scope) compileBreak() {
 		ctx.compileInst("drop")
 	}
 	ctx.compileInt(0) // space for jump target
-	ctx.loop.exitJumps = append(ctx.loop.exitJumps, ctx.frame.asm.array.Sp()-1)
+	ctx.loop.exitJumps = append(ctx.loop.exitJumps, ctx.frame.asm.sp()-1)
 	ctx.compileTrap("jump")
 }
 
@@ -1193,7 +1609,7 @@ func (ctx *Scope) newBlock(isLoop bool) Scope {
 		captures:  ctx.captures,
 		baseSp:    ctx.frame.sp,
 		loop:      ctx.loop,
-		initialPc: ctx.frame.asm.array.Sp(),
+		initialPc: ctx.frame.asm.sp(),
 		exitJumps: make([]libsam.Uword, 0),
 	}
 	if isLoop {
@@ -1206,20 +1622,43 @@ func (ctx *Scope) compileLoop(bodyCtx *Scope) {
 	for range bodyCtx.frame.sp - bodyCtx.baseSp {
 		ctx.compileInst("drop")
 	}
-	ctx.compileInt(int(bodyCtx.initialPc - ctx.frame.asm.array.Sp() - 3))
+	ctx.compileInt(int(bodyCtx.initialPc - ctx.frame.asm.sp() - 3))
 	ctx.compileTrap("jump")
 	bodyCtx.loop.resolveExitJumps()
 }
 
+// Files named by `use`, parsed once so that analysis and compilation see
+// the same syntax tree.
+var usedFiles = make(map[string]*Body)
+
+// The hashes of the files named by `use`, which a cached compilation of the
+// program depends on.
+var usedHashes = make(map[string][sha256.Size]byte)
+
+func usedBody(u *Use) *Body {
+	filename := strings.Join(*u.Path, ".")
+	if body, ok := usedFiles[filename]; ok {
+		return body
+	}
+	src, err := os.ReadFile(filename)
+	if err != nil {
+		panic(fmt.Errorf("bad use path %s", filename))
+	}
+	body := parseSource(string(src))
+	usedFiles[filename] = body
+	usedHashes[filename] = sha256.Sum256(src)
+	return body
+}
+
 func parseSource(src string) *Body {
-	body, err := parser.ParseString("", src)
+	body, err := parseSAL(src)
 	if err != nil {
 		panic(fmt.Errorf("error in source %v", err))
 	}
 	return body
 }
 
-func Sal(src string, ast bool) libsam.Blob {
+func Sal(src string, ast bool, optimize bool) libsam.Blob {
 	body := parseSource(src)
 
 	if ast {
@@ -1232,7 +1671,12 @@ func Sal(src string, ast bool) libsam.Blob {
 	block := Block{Pos: body.Pos, Body: body}
 	captures := make([]Capture, 0)
 	frame := Frame{
-		asm: &assembler{array: libsam.NewArray()},
+		asm:      &assembler{},
+		optimize: optimize,
+	}
+	frame.captureInfo = analyzeCaptures(body)
+	if optimize {
+		frame.types = inferTypes(body, frame.captureInfo)
 	}
 	ctx := Scope{
 		frame:     &frame,
@@ -1242,6 +1686,9 @@ func Sal(src string, ast bool) libsam.Blob {
 	}
 	ctx.compileBlock(&block)
 	ctx.compileTrap("halt")
+	ctx.frame.asm.flushInstructions()
+	ctx.frame.asm.verify = optimize
+	ctx.frame.asm.generate()
 
 	return ctx.frame.asm.array
 }